@@ -28,8 +28,21 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/resource.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <langinfo.h>
+#include <poll.h>
 #include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <spawn.h>
 #include "system.h"
 
 #include "argmatch.h"
@@ -44,6 +57,7 @@
 #include "getopt.h"
 #include "grep.h"
 #include "intprops.h"
+#include "mtgrep.h"
 #include "progname.h"
 #include "propername.h"
 #include "quote.h"
@@ -53,7 +67,14 @@
 #include "xalloc.h"
 #include "xstrtol.h"
 
-#include <gperftools/profiler.h>
+/* Define WITH_GPERFTOOLS to 0 to build without the gperftools CPU
+   profiler, and so without --profile.  */
+#ifndef WITH_GPERFTOOLS
+# define WITH_GPERFTOOLS 1
+#endif
+#if WITH_GPERFTOOLS
+# include <gperftools/profiler.h>
+#endif
 
 #define SEP_CHAR_SELECTED ':'
 #define SEP_CHAR_REJECTED '-'
@@ -120,13 +141,68 @@ struct grepctx
   char *bufbeg;		/* Beginning of user-visible stuff. */
   char *buflim;		/* Limit of user-visible stuff. */
   off_t bufoffset;		/* Read offset; defined on regular files.  */
+  off_t input_left;		/* If nonnegative, the input is only a slice
+                                   of its descriptor (e.g., a tar member),
+                                   and this many bytes of it remain.  */
+  char const *input_mem;	/* If nonnull, read the input from here
+                                   instead of from bufdesc.  */
+  uintmax_t input_totalcc;	/* Bytes and lines that precede the input,  */
+  uintmax_t input_totalnl;	/* when it is part of a larger stream.  */
+  intmax_t out_max;		/* Maximum number of lines to output from
+                                   the input; normally max_count.  */
+  struct stdin_chunk *chunk;	/* The chunk of standard input being
+                                   searched, if any.  */
   off_t after_last_match;	/* Pointer after last matching line that
                               would have been output if we were
                               outputting characters. */
+  off_t cache_dropped;		/* With --no-cache-pollution, the input
+                                   before this offset has been dropped
+                                   from the page cache.  */
   bool skip_nuls;		/* Skip '\0' in data.  */
+  bool read_error;		/* Reading the input failed.  */
   bool seek_data_failed;	/* lseek with SEEK_DATA failed.  */
   uintmax_t totalnl;	/* Total newline count before lastnl. */
 
+  /* Once -m's limit is reached, trailing context ends at the next
+     matching line.  The buffer from MATCH_SCAN_BEG to MATCH_SCAN_END
+     has been searched for it in one go, and NEXT_MATCH is the start of
+     the first matching line there, or MATCH_SCAN_END if none.
+     NEXT_MATCH is null if nothing in the buffer has been searched.  */
+  char const *match_scan_beg;
+  char const *match_scan_end;
+  char const *next_match;
+
+  /* Where print_line_head assembles each line head.  It starts with
+     the file name part, which is the same for every line of a file
+     and so is formatted once; LINE_HEAD_PREFIX is its length, or -1
+     if it has yet to be formatted for the current file.  */
+  char *line_head;
+  size_t line_head_alloc;
+  ptrdiff_t line_head_prefix;
+
+  /* With --reverse, the starts and ends of the runs of selected lines
+     found in the buffer, to be output last first.  */
+  char **runs;
+  size_t runs_alloc;
+
+  /* With --query-file, this thread's compilation of each query's
+     pattern, and for the current input how many more lines each query
+     may select under -m, how many it has selected, and how many
+     queries may still select lines.  QUERY is the query whose line is
+     being output, or null.  */
+  void **query_patterns;
+  intmax_t *query_left;
+  intmax_t *query_count;
+  size_t queries_active;
+  struct query const *query;
+
+  /* If nonnull, selected lines are passed to REPORT with REPORT_ARG,
+     their line number and their byte offset, instead of being output.
+     REPORT returns false to end the search of the input.  */
+  bool (*report) (void *arg, struct grepctx *ctx, char *beg, char *lim,
+                  uintmax_t line, uintmax_t offset);
+  void *report_arg;
+
 #if HAVE_ASAN
   /* Record the starting address and length of the sole poisoned region,
      so that we can unpoison it later, just before each following read.  */
@@ -277,18 +353,180 @@ static const char *context_line_color  = "";	/* default color pair */
 static const char *sgr_start = "\33[%sm\33[K";
 static const char *sgr_end   = "\33[m\33[K";
 
+/* If nonnull, the memory stream that collects this thread's output
+   instead of stdout, so that it can be emitted later in input order.  */
+static __thread FILE *capture_stream;
+
+/* --stats: where each thread spends its time.  Every thread adds to
+   counters of its own, so collecting them takes two clock reads per
+   phase and no locking; they are summed once the workers are done.  */
+enum stat_phase
+{
+  STAT_WALK,			/* Traversing directories.  */
+  STAT_QUEUE,			/* Waiting on the work queue.  */
+  STAT_READ,			/* Filling the buffer.  */
+  STAT_MATCH,			/* Running the matcher.  */
+  STAT_TURN,			/* Waiting for the turn to output.  */
+  STAT_WRITE,			/* Writing output.  */
+  STAT_PHASES
+};
+
+static char const stat_phase_names[STAT_PHASES][6] =
+  { "walk", "queue", "read", "match", "turn", "write" };
+
+struct thread_stats
+{
+  uintmax_t ns[STAT_PHASES];
+  uintmax_t bytes;		/* Input bytes read.  */
+  uintmax_t files;		/* Input files searched.  */
+  uintmax_t start, end;		/* When the thread started and finished.  */
+};
+
+static bool show_stats;
+
+/* With --stats, the main thread's counters followed by each worker's;
+   otherwise NULL.  */
+static struct thread_stats *all_stats;
+static int stats_workers;
+
+/* This thread's entry in ALL_STATS, or NULL if not collecting.  */
+static __thread struct thread_stats *thread_stats;
+
+/* --trace=FILE: a Chrome trace of when each thread was in which phase.
+   Each thread records spans in a ring of its own, allocated up front,
+   so that tracing takes no locks and no memory while searching; if a
+   ring fills, its oldest spans are lost.  The rings are written out as
+   JSON once the workers are done.  */
+enum { TRACE_RING_SIZE = 1 << 15 };
+
+struct trace_span
+{
+  uintmax_t start, end;
+  char const *name;
+  char file[40];		/* The end of the name of the file searched
+                                   or walked, if any.  */
+};
+
+struct trace_ring
+{
+  struct trace_span *spans;
+  uintmax_t count;		/* Spans ever recorded.  */
+};
+
+static char const *trace_name;
+
+/* --profile=FILE: where the CPU profiler writes its samples, or NULL.
+   --profile-frequency=HZ: the sampling rate, or 0 for the profiler's
+   default.  The profiler reads the rate from the environment when the
+   program starts, so a rate other than the one in the environment
+   means running grep afresh with the environment changed.  */
+static char const *profile_name;
+static intmax_t profile_frequency;
+
+/* With --trace, the main thread's ring followed by each worker's;
+   otherwise NULL.  */
+static struct trace_ring *all_traces;
+static uintmax_t trace_epoch;
+
+/* This thread's entry in ALL_TRACES, or NULL if not tracing.  */
+static __thread struct trace_ring *thread_trace;
+
+/* How phases appear in the trace.  Matching is too fine-grained to be
+   worth a span, and walking and queueing are recorded separately.  */
+static char const *const trace_phase_names[STAT_PHASES] =
+  { NULL, NULL, "fillbuf", NULL, "output turn", "write" };
+
+/* Successive writes less than this many nanoseconds apart are shown as
+   one span, as output is written a piece at a time.  */
+enum { TRACE_WRITE_GAP = 5000 };
+
+static uintmax_t
+stats_clock (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINTMAX_C (1000000000) + ts.tv_nsec;
+}
+
+/* Record a span NAME from START to END for FILE (which may be null).  */
+static void
+trace_span (char const *name, uintmax_t start, uintmax_t end,
+            char const *file)
+{
+  struct trace_ring *r = thread_trace;
+  if (r->count)
+    {
+      struct trace_span *last = &r->spans[(r->count - 1) % TRACE_RING_SIZE];
+      if (name == trace_phase_names[STAT_WRITE] && last->name == name
+          && start - last->end < TRACE_WRITE_GAP)
+        {
+          last->end = end;
+          return;
+        }
+    }
+  struct trace_span *s = &r->spans[r->count++ % TRACE_RING_SIZE];
+  s->start = start;
+  s->end = end;
+  s->name = name;
+  s->file[0] = '\0';
+  if (file)
+    {
+      size_t len = strlen (file);
+      if (sizeof s->file <= len)
+        {
+          /* Keep the tail, but do not start it within a multibyte
+             character, as the trace is UTF-8.  */
+          file += len - (sizeof s->file - 1);
+          while ((*file & 0xc0) == 0x80)
+            file++;
+        }
+      strcpy (s->file, file);
+    }
+}
+
+/* Return the start time of a phase, for stats_end.  */
+static uintmax_t
+stats_start (void)
+{
+  return thread_stats || thread_trace ? stats_clock () : 0;
+}
+
+/* Charge the time since START to PHASE.  */
+static void
+stats_end (enum stat_phase phase, uintmax_t start)
+{
+  if (thread_stats || thread_trace)
+    {
+      uintmax_t now = stats_clock ();
+      if (thread_stats)
+        thread_stats->ns[phase] += now - start;
+      if (thread_trace && trace_phase_names[phase])
+        trace_span (trace_phase_names[phase], start, now, NULL);
+    }
+}
+
 /* SGR utility functions.  */
 static void
 pr_sgr_start (char const *s)
 {
   if (*s)
-    print_start_colorize (sgr_start, s);
+    {
+      if (capture_stream)
+        fprintf (capture_stream, sgr_start, s);
+      else
+        print_start_colorize (sgr_start, s);
+    }
 }
 static void
 pr_sgr_end (char const *s)
 {
   if (*s)
-    print_end_colorize (sgr_end);
+    {
+      if (capture_stream)
+        fputs (sgr_end, capture_stream);
+      else
+        print_end_colorize (sgr_end);
+    }
 }
 static void
 pr_sgr_start_if (char const *s)
@@ -351,46 +589,60 @@ static const struct color_cap color_dict[] =
 /* Saved errno value from failed output functions on stdout.  */
 static int stdout_errno;
 
+static FILE *
+output_stream (void)
+{
+  return capture_stream ? capture_stream : stdout;
+}
+
 static void
 putchar_errno (int c)
 {
-  if (putchar (c) < 0)
+  uintmax_t t = stats_start ();
+  if (putc (c, output_stream ()) < 0)
     stdout_errno = errno;
+  stats_end (STAT_WRITE, t);
 }
 
 static void
 fputs_errno (char const *s)
 {
-  if (fputs (s, stdout) < 0)
+  uintmax_t t = stats_start ();
+  if (fputs (s, output_stream ()) < 0)
     stdout_errno = errno;
+  stats_end (STAT_WRITE, t);
 }
 
 static void _GL_ATTRIBUTE_FORMAT_PRINTF (1, 2)
 printf_errno (char const *format, ...)
 {
+  uintmax_t t = stats_start ();
   va_list ap;
   va_start (ap, format);
-  if (vfprintf (stdout, format, ap) < 0)
+  if (vfprintf (output_stream (), format, ap) < 0)
     stdout_errno = errno;
   va_end (ap);
+  stats_end (STAT_WRITE, t);
 }
 
 static void
 fwrite_errno (void const *ptr, size_t size, size_t nmemb)
 {
-  if (fwrite (ptr, size, nmemb, stdout) != nmemb)
+  uintmax_t t = stats_start ();
+  if (fwrite (ptr, size, nmemb, output_stream ()) != nmemb)
     stdout_errno = errno;
+  stats_end (STAT_WRITE, t);
 }
 
 static void
 fflush_errno (void)
 {
-  if (fflush (stdout) != 0)
+  uintmax_t t = stats_start ();
+  if (fflush (output_stream ()) != 0)
     stdout_errno = errno;
+  stats_end (STAT_WRITE, t);
 }
 
-static struct exclude *excluded_patterns[2];
-static struct exclude *excluded_directory_patterns[2];
 /* Short options.  */
 static char const short_options[] =
 "0123456789A:B:C:D:EFGHIM::PTUVX:abcd:e:f:hiLlm:noqRrsuvwxyZz";
@@ -399,14 +651,34 @@ static char const short_options[] =
 enum
 {
   BINARY_FILES_OPTION = CHAR_MAX + 1,
+  BUILD_INDEX_OPTION,
   COLOR_OPTION,
+  DAEMON_OPTION,
   EXCLUDE_DIRECTORY_OPTION,
   EXCLUDE_OPTION,
   EXCLUDE_FROM_OPTION,
   GROUP_SEPARATOR_OPTION,
   INCLUDE_OPTION,
+  INDEX_OPTION,
   LINE_BUFFERED_OPTION,
-  LABEL_OPTION
+  LABEL_OPTION,
+  LOCK_STATS_OPTION,
+  MAX_FILESIZE_OPTION,
+  MIN_FILESIZE_OPTION,
+  NEWER_THAN_OPTION,
+  OLDER_THAN_OPTION,
+  NO_CACHE_POLLUTION_OPTION,
+  GITIGNORE_OPTION,
+  PROFILE_OPTION,
+  PROFILE_FREQUENCY_OPTION,
+  QUERY_FILE_OPTION,
+  RESULT_CACHE_OPTION,
+  REVERSE_OPTION,
+  STATS_OPTION,
+  TAR_OPTION,
+  TIME_RANGE_OPTION,
+  TRACE_OPTION,
+  WALK_CACHE_OPTION
 };
 
 /* Long options equivalences. */
@@ -420,11 +692,13 @@ static struct option const long_options[] =
   {"after-context", required_argument, NULL, 'A'},
   {"before-context", required_argument, NULL, 'B'},
   {"binary-files", required_argument, NULL, BINARY_FILES_OPTION},
+  {"build-index", required_argument, NULL, BUILD_INDEX_OPTION},
   {"byte-offset", no_argument, NULL, 'b'},
   {"context", required_argument, NULL, 'C'},
   {"color", optional_argument, NULL, COLOR_OPTION},
   {"colour", optional_argument, NULL, COLOR_OPTION},
   {"count", no_argument, NULL, 'c'},
+  {"daemon", required_argument, NULL, DAEMON_OPTION},
   {"devices", required_argument, NULL, 'D'},
   {"directories", required_argument, NULL, 'd'},
   {"exclude", required_argument, NULL, EXCLUDE_OPTION},
@@ -433,34 +707,52 @@ static struct option const long_options[] =
   {"file", required_argument, NULL, 'f'},
   {"files-with-matches", no_argument, NULL, 'l'},
   {"files-without-match", no_argument, NULL, 'L'},
+  {"gitignore", no_argument, NULL, GITIGNORE_OPTION},
   {"group-separator", required_argument, NULL, GROUP_SEPARATOR_OPTION},
   {"help", no_argument, &show_help, 1},
   {"include", required_argument, NULL, INCLUDE_OPTION},
+  {"index", required_argument, NULL, INDEX_OPTION},
   {"ignore-case", no_argument, NULL, 'i'},
   {"initial-tab", no_argument, NULL, 'T'},
   {"label", required_argument, NULL, LABEL_OPTION},
   {"line-buffered", no_argument, NULL, LINE_BUFFERED_OPTION},
+  {"lock-stats", optional_argument, NULL, LOCK_STATS_OPTION},
   {"line-number", no_argument, NULL, 'n'},
   {"line-regexp", no_argument, NULL, 'x'},
   {"max-count", required_argument, NULL, 'm'},
+  {"max-filesize", required_argument, NULL, MAX_FILESIZE_OPTION},
+  {"min-filesize", required_argument, NULL, MIN_FILESIZE_OPTION},
+  {"newer-than", required_argument, NULL, NEWER_THAN_OPTION},
+  {"older-than", required_argument, NULL, OLDER_THAN_OPTION},
   {"parallel", optional_argument, NULL, 'M'},
 
+  {"no-cache-pollution", no_argument, NULL, NO_CACHE_POLLUTION_OPTION},
   {"no-filename", no_argument, NULL, 'h'},
   {"no-group-separator", no_argument, NULL, GROUP_SEPARATOR_OPTION},
   {"no-messages", no_argument, NULL, 's'},
   {"null", no_argument, NULL, 'Z'},
   {"null-data", no_argument, NULL, 'z'},
   {"only-matching", no_argument, NULL, 'o'},
+  {"profile", required_argument, NULL, PROFILE_OPTION},
+  {"profile-frequency", required_argument, NULL, PROFILE_FREQUENCY_OPTION},
+  {"query-file", required_argument, NULL, QUERY_FILE_OPTION},
   {"quiet", no_argument, NULL, 'q'},
   {"recursive", no_argument, NULL, 'r'},
   {"dereference-recursive", no_argument, NULL, 'R'},
   {"regexp", required_argument, NULL, 'e'},
+  {"result-cache", required_argument, NULL, RESULT_CACHE_OPTION},
+  {"reverse", no_argument, NULL, REVERSE_OPTION},
   {"invert-match", no_argument, NULL, 'v'},
   {"silent", no_argument, NULL, 'q'},
+  {"stats", no_argument, NULL, STATS_OPTION},
+  {"tar", no_argument, NULL, TAR_OPTION},
   {"text", no_argument, NULL, 'a'},
+  {"time-range", required_argument, NULL, TIME_RANGE_OPTION},
+  {"trace", required_argument, NULL, TRACE_OPTION},
   {"binary", no_argument, NULL, 'U'},
   {"unix-byte-offsets", no_argument, NULL, 'u'},
   {"version", no_argument, NULL, 'V'},
+  {"walk-cache", required_argument, NULL, WALK_CACHE_OPTION},
   {"with-filename", no_argument, NULL, 'H'},
   {"word-regexp", no_argument, NULL, 'w'},
   {0, 0, 0, 0}
@@ -515,10 +807,13 @@ static enum
   } devices = READ_COMMAND_LINE_DEVICES;
 
 static void search_file (int, char const *, char const *, bool, bool);
+static bool open_symlink_nofollow_error (int);
+static bool binary_file_name (char const *);
 
 static void dos_binary (void);
 static void dos_unix_byte_offsets (void);
 static size_t undossify_input (struct grepctx *, char *, size_t);
+static bool contains_encoding_error (char const *, size_t);
 
 static bool
 is_device_mode (mode_t m)
@@ -557,21 +852,257 @@ typedef size_t (*execute_fp_t) (void *, struct grepctx *, char *, size_t,
 static compile_fp_t compile;
 static execute_fp_t execute;
 
+/* Successive matches within one line, as -o and --color need them.  */
+struct match_iter
+{
+  void *compiled_pattern;
+  struct grepctx *ctx;
+  char *beg;			/* The line, including its end.  */
+  size_t size;
+  char const *cur;		/* Where the next match may start;
+                                   the caller advances it.  */
+  execute_fp_t execute;
+};
+
+/* A matcher's optional iterator: find the first match in IT's line
+   that starts at or after IT->cur, and store its offset from IT->beg
+   and its size.  Return false if there is none.  */
+typedef bool (*iterate_fp_t) (struct match_iter *it, size_t *match_offset,
+                              size_t *match_size);
+static iterate_fp_t iterate;
+
+/* Run the matcher with CTX's pattern, charging the time to --stats.  */
+static size_t
+timed_execute (struct grepctx *ctx, char *buf, size_t size,
+               size_t *match_size, char const *start_ptr)
+{
+  uintmax_t t = stats_start ();
+  size_t r = execute (ctx->compiled_pattern, ctx, buf, size, match_size,
+                      start_ptr);
+  stats_end (STAT_MATCH, t);
+  return r;
+}
+
+/* Start iterating over the matches in the line BEG..LIM with CTX's
+   pattern, using EXECUTE and ITERATE.  */
+static void
+match_iter_init (struct match_iter *it, struct grepctx *ctx,
+                 execute_fp_t execute, char *beg, char const *lim)
+{
+  it->compiled_pattern = ctx->compiled_pattern;
+  it->ctx = ctx;
+  it->beg = beg;
+  it->cur = beg;
+  it->size = lim - beg;
+  it->execute = execute;
+}
+
+/* Find the next match for IT as an iterate_fp_t does, using ITERATE
+   if the matcher has one, and otherwise running the matcher again
+   from IT->cur.  Charge the time to --stats.  */
+static bool
+match_iter_next (struct match_iter *it, iterate_fp_t iterate,
+                 size_t *match_offset, size_t *match_size)
+{
+  if (it->beg + it->size <= it->cur)
+    return false;
+  uintmax_t t = stats_start ();
+  bool found;
+  if (iterate)
+    found = iterate (it, match_offset, match_size);
+  else
+    {
+      *match_offset = it->execute (it->compiled_pattern, it->ctx, it->beg,
+                                   it->size, match_size, it->cur);
+      found = *match_offset != (size_t) -1;
+    }
+  stats_end (STAT_MATCH, t);
+  return found;
+}
+
+/* --lock-stats: how long threads wait for, and hold, the locks that
+   order their work and output.  Waiting on a condition variable does
+   not count as holding its mutex.  */
+enum lock_id
+{
+  LOCK_OUTPUT,			/* output_lock, outermost acquisitions */
+  LOCK_QUEUE,			/* queueLock */
+  LOCK_NODE_READ,		/* nodeLock, read-locked */
+  LOCK_NODE_WRITE,		/* nodeLock, write-locked */
+  LOCK_WORKQUEUE,		/* workqueue.lock */
+  NLOCKS
+};
+
+static char const *const lock_names[NLOCKS] =
+  { "output_lock", "queueLock", "nodeLock/read", "nodeLock/write",
+    "workqueue.lock" };
+
+struct lock_stats
+{
+  uintmax_t acquired;		/* Acquisitions.  */
+  uintmax_t contended;		/* Acquisitions that had to wait.  */
+  uintmax_t wait_ns, max_wait_ns;
+  uintmax_t hold_ns, max_hold_ns;
+};
+
+static enum
+{
+  LOCK_STATS_NONE,
+  LOCK_STATS_TABLE,
+  LOCK_STATS_JSON
+} lock_stats_format;
+
+static struct lock_stats lock_stats[NLOCKS];
+
+/* Wakeups of threads waiting on headNodeUpdate, and those of them
+   after which it was still not the thread's turn.  */
+static uintmax_t head_wakeups, head_spurious;
+
+/* When this thread last acquired each lock that it holds.  */
+static __thread uintmax_t lock_held_since[NLOCKS];
+
+static void
+stat_add (uintmax_t *counter, uintmax_t n)
+{
+  __atomic_fetch_add (counter, n, __ATOMIC_RELAXED);
+}
+
+static void
+stat_max (uintmax_t *counter, uintmax_t n)
+{
+  uintmax_t old = __atomic_load_n (counter, __ATOMIC_RELAXED);
+  while (old < n
+         && !__atomic_compare_exchange_n (counter, &old, n, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    continue;
+}
+
+/* Record that this thread acquired lock ID, having tried since START.  */
+static void
+lock_acquired (enum lock_id id, uintmax_t start, bool contended)
+{
+  struct lock_stats *s = &lock_stats[id];
+  uintmax_t now = stats_clock ();
+  stat_add (&s->acquired, 1);
+  stat_add (&s->contended, contended);
+  stat_add (&s->wait_ns, now - start);
+  stat_max (&s->max_wait_ns, now - start);
+  lock_held_since[id] = now;
+}
+
+/* Record that this thread is about to release lock ID.  */
+static void
+lock_releasing (enum lock_id id)
+{
+  struct lock_stats *s = &lock_stats[id];
+  uintmax_t held = stats_clock () - lock_held_since[id];
+  stat_add (&s->hold_ns, held);
+  stat_max (&s->max_hold_ns, held);
+}
+
+static void
+timed_mutex_lock (pthread_mutex_t *mutex, enum lock_id id)
+{
+  if (!lock_stats_format)
+    {
+      if (pthread_mutex_lock (mutex))
+        abort ();
+      return;
+    }
+  uintmax_t start = stats_clock ();
+  bool contended = pthread_mutex_trylock (mutex) != 0;
+  if (contended && pthread_mutex_lock (mutex))
+    abort ();
+  lock_acquired (id, start, contended);
+}
+
+static void
+timed_mutex_unlock (pthread_mutex_t *mutex, enum lock_id id)
+{
+  if (lock_stats_format)
+    lock_releasing (id);
+  if (pthread_mutex_unlock (mutex))
+    abort ();
+}
+
+static void
+timed_rdlock (pthread_rwlock_t *rwlock, enum lock_id id)
+{
+  if (!lock_stats_format)
+    {
+      if (pthread_rwlock_rdlock (rwlock))
+        abort ();
+      return;
+    }
+  uintmax_t start = stats_clock ();
+  bool contended = pthread_rwlock_tryrdlock (rwlock) != 0;
+  if (contended && pthread_rwlock_rdlock (rwlock))
+    abort ();
+  lock_acquired (id, start, contended);
+}
+
+static void
+timed_wrlock (pthread_rwlock_t *rwlock, enum lock_id id)
+{
+  if (!lock_stats_format)
+    {
+      if (pthread_rwlock_wrlock (rwlock))
+        abort ();
+      return;
+    }
+  uintmax_t start = stats_clock ();
+  bool contended = pthread_rwlock_trywrlock (rwlock) != 0;
+  if (contended && pthread_rwlock_wrlock (rwlock))
+    abort ();
+  lock_acquired (id, start, contended);
+}
+
+static void
+timed_rwlock_unlock (pthread_rwlock_t *rwlock, enum lock_id id)
+{
+  if (lock_stats_format)
+    lock_releasing (id);
+  if (pthread_rwlock_unlock (rwlock))
+    abort ();
+}
+
+/* Wait on COND, which releases MUTEX (lock ID) meanwhile.  */
+static void
+timed_cond_wait (pthread_cond_t *cond, pthread_mutex_t *mutex,
+                 enum lock_id id)
+{
+  if (lock_stats_format)
+    lock_releasing (id);
+  pthread_cond_wait (cond, mutex);
+  if (lock_stats_format)
+    lock_held_since[id] = stats_clock ();
+}
+
 static pthread_mutex_t output_lock;
 
+/* How many times this thread has locked output_lock.  */
+static __thread int output_lock_depth;
+
 static void suppressible_error (char const *mesg, int errnum);
 
 static void
 lock_output (void)
 {
-  if (pthread_mutex_lock (&output_lock))
-    abort ();
+  if (output_lock_depth++)
+    {
+      if (pthread_mutex_lock (&output_lock))
+        abort ();
+    }
+  else
+    timed_mutex_lock (&output_lock, LOCK_OUTPUT);
   //printf ( "Locking" );
 }
 
 static void
 unlock_output (void)
 {
+  if (!--output_lock_depth && lock_stats_format)
+    lock_releasing (LOCK_OUTPUT);
   if (pthread_mutex_unlock (&output_lock))
     abort ();
   //printf ( "Unlocking" );
@@ -593,6 +1124,7 @@ suppressible_error (char const *mesg, int errnum)
   errseen = true;
 }
 
+#if !defined MTGREP_LIBRARY && !defined GREP_MICROBENCH
 /* If there has already been a write error, don't bother closing
    standard output, as that might elicit a duplicate diagnostic.  */
 static void
@@ -601,6 +1133,7 @@ clean_up_stdout (void)
   if (! stdout_errno)
     close_stdout ();
 }
+#endif
 
 /* A cast to TYPE of VAL.  Use this when TYPE is a pointer type, VAL
    is properly aligned for TYPE, and 'gcc -Wcast-align' cannot infer
@@ -676,6 +1209,36 @@ skip_easy_bytes (char const *buf)
   return p;
 }
 
+/* Return the number of bytes equal to EOL from BEG to LIM.  Count a
+   uword at a time, so that many short lines cost no more than one
+   long one, as they would with a memchr call for each line.  */
+static uintmax_t _GL_ATTRIBUTE_PURE
+count_eols (char const *beg, char const *lim, char eol)
+{
+  uword uword_max = -1;
+  uword ones = uword_max / UCHAR_MAX;
+  uword highs = ones << (CHAR_BIT - 1);
+  uword eols = ones * to_uchar (eol);
+  uintmax_t n = 0;
+  char const *p;
+
+  for (p = beg; p < lim && (uintptr_t) p % sizeof (uword) != 0; p++)
+    n += *p == eol;
+  for (; sizeof (uword) <= lim - p; p += sizeof (uword))
+    {
+      /* A byte of W is zero where the input has EOL.  Set the top bit
+         of each byte of W that is nonzero, without carrying into the
+         next byte; then add up the zero bytes.  */
+      uword w = *CAST_ALIGNED (uword const *, p) ^ eols;
+      uword nonzero = ((w & ~highs) + ~highs) | w;
+      n += ((~nonzero & highs) >> (CHAR_BIT - 1)) * ones
+           >> (sizeof (uword) - 1) * CHAR_BIT;
+    }
+  for (; p < lim; p++)
+    n += *p == eol;
+  return n;
+}
+
 /* Return true if BUF, of size SIZE, has an encoding error.
    BUF must be followed by at least sizeof (uword) bytes,
    the first of which may be modified.  */
@@ -717,7 +1280,7 @@ static bool
 file_must_have_nulls (struct grepctx *ctx, size_t size, int fd,
                       struct stat const *st)
 {
-  if (usable_st_size (st))
+  if (usable_st_size (st) && ctx->input_left < 0)
     {
       if (st->st_size <= size)
         return false;
@@ -768,78 +1331,572 @@ context_length_arg (char const *str, intmax_t *out)
     }
 }
 
-/* Return the add_exclude options suitable for excluding a file name.
-   If COMMAND_LINE, it is a command-line file name.  */
-static int
-exclude_options (bool command_line)
+/* FNV-1a hash of the N bytes at P, continuing from the hash H,
+   which is HASH_INIT for a fresh hash.  */
+#define HASH_INIT UINT64_C (14695981039346656037)
+static uint64_t
+hash_bytes (uint64_t h, void const *p, size_t n)
 {
-  return EXCLUDE_WILDCARDS | (command_line ? 0 : EXCLUDE_ANCHORED);
+  unsigned char const *s = p;
+  for (size_t i = 0; i < n; i++)
+    h = (h ^ s[i]) * 1099511628211u;
+  return h;
 }
 
-/* Return true if the file with NAME should be skipped.
-   If COMMAND_LINE, it is a command-line argument.
-   If IS_DIR, it is a directory.  */
-static bool
-skipped_file (char const *name, bool command_line, bool is_dir)
+/* File name patterns from --include, --exclude, --exclude-from and
+   --exclude-dir, compiled as they are given.  As with gnulib's exclude
+   module, which they replace, a name is decided by the last pattern
+   that matches it, or if none does, by the opposite of the first
+   pattern.  Literal names and patterns of the form "*SUFFIX" and
+   "PREFIX*" are looked up in hash tables; only the other patterns go
+   through fnmatch, and only those given after the last hash hit.  */
+
+struct name_rule
 {
-  struct exclude **pats;
-  if (! is_dir)
-    pats = excluded_patterns;
-  else if (directories == SKIP_DIRECTORIES)
-    return true;
-  else if (command_line && omit_dot_slash)
-    return false;
-  else
-    pats = excluded_directory_patterns;
-  return pats[command_line] && excluded_file_name (pats[command_line], name);
+  char *pattern;
+  bool include;			/* From --include, not --exclude.  */
+};
+
+/* A hash table from strings to the number plus 1 of the last rule
+   that they match.  */
+struct name_table
+{
+  struct name_entry
+  {
+    char *key;
+    size_t len;
+    size_t rule;
+  } *slot;
+  size_t nslots, nused;
+};
+
+struct name_matcher
+{
+  /* Match only whole names, rather than also the parts after each '/'.  */
+  bool anchored;
+
+  struct name_rule *rule;
+  size_t nrules, rules_alloc;
+
+  struct name_table literals, suffixes, prefixes;
+
+  /* The distinct lengths of the suffixes and prefixes in the tables.  */
+  size_t *suffix_len, nsuffix_lens, suffix_lens_alloc;
+  size_t *prefix_len, nprefix_lens, prefix_lens_alloc;
+
+  /* Numbers of the rules that need fnmatch, in ascending order.  */
+  size_t *others, nothers, others_alloc;
+};
+
+static struct name_matcher *excluded_patterns[2];
+static struct name_matcher *excluded_directory_patterns[2];
+
+static size_t
+name_table_find (struct name_table const *t, char const *key, size_t len)
+{
+  if (!t->nused)
+    return 0;
+  for (size_t h = hash_bytes (HASH_INIT, key, len) & (t->nslots - 1);
+       t->slot[h].key; h = (h + 1) & (t->nslots - 1))
+    if (t->slot[h].len == len && memcmp (t->slot[h].key, key, len) == 0)
+      return t->slot[h].rule;
+  return 0;
 }
 
-/* Hairy buffering mechanism for grep.  The intent is to keep
-   all reads aligned on a page boundary and multiples of the
-   page size, unless a read yields a partial page.  */
+static void
+name_table_set (struct name_table *t, char const *key, size_t len,
+                size_t rule)
+{
+  if (t->nslots <= 2 * t->nused)
+    {
+      struct name_table old = *t;
+      t->nslots = old.nslots ? 2 * old.nslots : 16;
+      t->slot = xcalloc (t->nslots, sizeof *t->slot);
+      t->nused = 0;
+      for (size_t i = 0; i < old.nslots; i++)
+        if (old.slot[i].key)
+          {
+            size_t h = (hash_bytes (HASH_INIT, old.slot[i].key,
+                                    old.slot[i].len)
+                        & (t->nslots - 1));
+            while (t->slot[h].key)
+              h = (h + 1) & (t->nslots - 1);
+            t->slot[h] = old.slot[i];
+            t->nused++;
+          }
+      free (old.slot);
+    }
 
-#define INITIAL_BUFSIZE 32768	/* Initial buffer size, not counting slop. */
-static size_t pagesize;		/* alignment of memory pages */
-static bool skip_empty_lines;	/* Skip empty lines in data.  */
+  size_t h = hash_bytes (HASH_INIT, key, len) & (t->nslots - 1);
+  for (; t->slot[h].key; h = (h + 1) & (t->nslots - 1))
+    if (t->slot[h].len == len && memcmp (t->slot[h].key, key, len) == 0)
+      {
+        t->slot[h].rule = rule;
+        return;
+      }
+  t->slot[h].key = xmemdup (key, len);
+  t->slot[h].len = len;
+  t->slot[h].rule = rule;
+  t->nused++;
+}
 
-/* Return VAL aligned to the next multiple of ALIGNMENT.  VAL can be
-   an integer or a pointer.  Both args must be free of side effects.  */
-#define ALIGN_TO(val, alignment) \
-  ((size_t) (val) % (alignment) == 0 \
-   ? (val) \
-   : (val) + ((alignment) - (size_t) (val) % (alignment)))
+/* Add LEN to the descending list *LENS of *N lengths.  */
+static void
+add_name_len (size_t **lens, size_t *n, size_t *alloc, size_t len)
+{
+  size_t i;
+  for (i = 0; i < *n && len < (*lens)[i]; i++)
+    continue;
+  if (i < *n && (*lens)[i] == len)
+    return;
+  if (*n == *alloc)
+    *lens = x2nrealloc (*lens, alloc, sizeof **lens);
+  memmove (*lens + i + 1, *lens + i, (*n - i) * sizeof **lens);
+  (*lens)[i] = len;
+  (*n)++;
+}
 
-/* Add two numbers that count input bytes or lines, and report an
-   error if the addition overflows.  */
-static uintmax_t
-add_count (uintmax_t a, uintmax_t b)
+/* Remove the backslashes that quote characters in the glob S.  */
+static void
+unescape_glob (char *s)
 {
-  uintmax_t sum = a + b;
-  if (sum < a)
-    ts_error (EXIT_TROUBLE, 0, _("input is too large to count"));
-  return sum;
+  char *q = s;
+  for (; *s; s++)
+    {
+      if (*s == '\\' && s[1])
+        s++;
+      *q++ = *s;
+    }
+  *q = '\0';
 }
 
-/* Return true if BUF (of size SIZE) is all zeros.  */
+/* Return true if the N bytes at S have no wildcards or backslashes.  */
 static bool
-all_zeros (char const *buf, size_t size)
+plain_glob_part (char const *s, size_t n)
 {
-  for (char const *p = buf; p < buf + size; p++)
-    if (*p)
+  for (size_t i = 0; i < n; i++)
+    if (strchr ("\\?*[]", s[i]))
       return false;
   return true;
 }
 
-/* Reset the buffer for a new file, returning false if we should skip it.
-   Initialize on the first time through. */
-static bool
-reset (struct grepctx *ctx, int fd, struct stat const *st)
+/* Add PATTERN to the rules of *PM, creating it if need be.  INCLUDE
+   says whether it is from --include.  COMMAND_LINE says whether the
+   rules are for command-line file names, which are matched unanchored.  */
+static void
+add_name_rule (struct name_matcher **pm, char const *pattern, bool include,
+               bool command_line)
 {
-  ctx->bufbeg = ctx->buflim = ALIGN_TO (ctx->buffer + 1, pagesize);
-  ctx->bufbeg[-1] = eolbyte;
-  ctx->bufdesc = fd;
-
-  if (S_ISREG (st->st_mode))
+  struct name_matcher *m = *pm;
+  if (!m)
+    {
+      m = *pm = xzalloc (sizeof *m);
+      m->anchored = !command_line;
+    }
+
+  if (m->nrules == m->rules_alloc)
+    m->rule = x2nrealloc (m->rule, &m->rules_alloc, sizeof *m->rule);
+  size_t n = m->nrules++;
+  m->rule[n].pattern = xstrdup (pattern);
+  m->rule[n].include = include;
+
+  size_t len = strlen (pattern);
+  if (! fnmatch_pattern_has_wildcards (pattern, EXCLUDE_WILDCARDS))
+    {
+      char *lit = xstrdup (pattern);
+      unescape_glob (lit);
+      name_table_set (&m->literals, lit, strlen (lit), n + 1);
+      free (lit);
+    }
+  else if (pattern[0] == '*' && plain_glob_part (pattern + 1, len - 1))
+    {
+      name_table_set (&m->suffixes, pattern + 1, len - 1, n + 1);
+      add_name_len (&m->suffix_len, &m->nsuffix_lens, &m->suffix_lens_alloc,
+                    len - 1);
+    }
+  else if (pattern[len - 1] == '*' && plain_glob_part (pattern, len - 1))
+    {
+      name_table_set (&m->prefixes, pattern, len - 1, n + 1);
+      add_name_len (&m->prefix_len, &m->nprefix_lens, &m->prefix_lens_alloc,
+                    len - 1);
+    }
+  else
+    {
+      if (m->nothers == m->others_alloc)
+        m->others = x2nrealloc (m->others, &m->others_alloc,
+                                sizeof *m->others);
+      m->others[m->nothers++] = n;
+    }
+}
+
+/* Add to both PM[0] and PM[1] (for command-line names) the patterns
+   in the file FILE, one per line, ignoring trailing white space and
+   empty lines; "-" stands for standard input.  Return 0, or -1 with
+   errno set on failure.  */
+static int
+add_name_rules_from_file (struct name_matcher *pm[2], char const *file,
+                          bool include)
+{
+  bool use_stdin = STREQ (file, "-");
+  FILE *in = use_stdin ? stdin : fopen (file, "re");
+  if (!in)
+    return -1;
+
+  char *line = NULL;
+  size_t linealloc = 0;
+  ssize_t len;
+  while (0 <= (len = getline (&line, &linealloc, in)))
+    {
+      while (0 < len && c_isspace (line[len - 1]))
+        len--;
+      line[len] = '\0';
+      if (len)
+        for (int cmd = 0; cmd < 2; cmd++)
+          add_name_rule (&pm[cmd], line, include, cmd);
+    }
+  free (line);
+
+  int err = ferror (in) ? errno : 0;
+  if (!use_stdin && fclose (in) != 0 && !err)
+    err = errno;
+  errno = err;
+  return err ? -1 : 0;
+}
+
+/* Return the number plus 1 of the last rule of M whose pattern is one
+   of the strings in TABLE with a length in the descending list LENS of
+   N lengths, and that matches NAME (of length LEN) as a prefix if
+   PREFIX, or as a suffix otherwise.  Return 0 if there is none.  */
+static size_t
+name_affix_rule (struct name_table const *table, size_t const *lens,
+                 size_t n, char const *name, size_t len, bool prefix)
+{
+  size_t best = 0;
+  for (size_t i = 0; i < n; i++)
+    if (lens[i] <= len)
+      {
+        char const *key = prefix ? name : name + len - lens[i];
+        best = MAX (best, name_table_find (table, key, lens[i]));
+      }
+  return best;
+}
+
+/* Return true if the glob PATTERN matches NAME, or unless ANCHORED,
+   the part of NAME after any '/' not followed by another '/'.  */
+static bool
+name_glob_match (char const *pattern, char const *name, bool anchored)
+{
+  if (fnmatch (pattern, name, 0) == 0)
+    return true;
+  if (!anchored)
+    for (char const *p = name; *p; p++)
+      if (*p == '/' && p[1] != '/' && fnmatch (pattern, p + 1, 0) == 0)
+        return true;
+  return false;
+}
+
+/* Return true if M says to exclude the file named NAME.  */
+static bool
+name_matcher_excluded (struct name_matcher const *m, char const *name)
+{
+  size_t len = strlen (name);
+  size_t best = name_affix_rule (&m->suffixes, m->suffix_len,
+                                 m->nsuffix_lens, name, len, false);
+
+  /* Unless anchored, a literal or prefix may match any part of NAME
+     that follows a '/'; gnulib's exclude module counts the literal
+     ones from just after every '/'.  */
+  for (char const *t = name; t; )
+    {
+      size_t tlen = strlen (t);
+      best = MAX (best, name_table_find (&m->literals, t, tlen));
+      if (t == name || *t != '/')
+        best = MAX (best, name_affix_rule (&m->prefixes, m->prefix_len,
+                                           m->nprefix_lens, t, tlen, true));
+      if (m->anchored)
+        break;
+      t = strchr (t, '/');
+      if (t)
+        t++;
+    }
+
+  for (size_t i = m->nothers; i-- != 0 && best <= m->others[i]; )
+    if (name_glob_match (m->rule[m->others[i]].pattern, name, m->anchored))
+      {
+        best = m->others[i] + 1;
+        break;
+      }
+
+  if (best)
+    return ! m->rule[best - 1].include;
+  return m->nrules && m->rule[0].include;
+}
+
+/* Return true if the file with NAME should be skipped.
+   If COMMAND_LINE, it is a command-line argument.
+   If IS_DIR, it is a directory.  */
+static bool
+skipped_file (char const *name, bool command_line, bool is_dir)
+{
+  struct name_matcher **pats;
+  if (! is_dir)
+    pats = excluded_patterns;
+  else if (directories == SKIP_DIRECTORIES)
+    return true;
+  else if (command_line && omit_dot_slash)
+    return false;
+  else
+    pats = excluded_directory_patterns;
+  return (pats[command_line]
+          && name_matcher_excluded (pats[command_line], name));
+}
+
+/* --min-filesize, --max-filesize, --newer-than and --older-than:
+   limits on the size and the modification time of regular files.
+   FILE_LIMITS is true if any was given.  */
+static bool file_limits;
+static off_t min_filesize;
+static off_t max_filesize = TYPE_MAXIMUM (off_t);
+static time_t newer_than = TYPE_MINIMUM (time_t);
+static time_t older_than = TYPE_MAXIMUM (time_t);
+
+/* Return true if the file with status ST is outside the limits.  */
+static bool
+outside_file_limits (struct stat const *st)
+{
+  return (S_ISREG (st->st_mode)
+          && (st->st_size < min_filesize || max_filesize < st->st_size
+              || st->st_mtime <= newer_than || older_than <= st->st_mtime));
+}
+
+/* Return true if the file NAME in the directory DIRDESC, found while
+   recursing, is outside the limits, so that it need not be opened.
+   ST is its status if already known, and otherwise null; in that case
+   get the status, following a symbolic link only if FOLLOW.  */
+static bool
+skipped_by_limits (int dirdesc, char const *name, struct stat const *st,
+                   bool follow)
+{
+  struct stat st1;
+  if (!file_limits)
+    return false;
+  if (!st)
+    {
+      /* If this fails, so will opening the file, with a diagnostic.  */
+      if (fstatat (dirdesc, name, &st1, follow ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+        return false;
+      st = &st1;
+    }
+  return outside_file_limits (st);
+}
+
+/* Parse ARG, a size with an optional suffix such as K or M.  */
+static off_t
+parse_filesize (char const *arg)
+{
+  uintmax_t n;
+  if (xstrtoumax (arg, NULL, 10, &n, "bEGKkMmPTYZ0") != LONGINT_OK
+      || TYPE_MAXIMUM (off_t) < n)
+    ts_error (EXIT_TROUBLE, 0, _("invalid file size: %s"), quote (arg));
+  return n;
+}
+
+/* Parse ARG, an age or a time, and return the time it designates.
+   An age is a number of seconds, minutes, hours, days or weeks, as
+   given by a suffix of s (the default), m, h, d or w, before now.
+   A time is '@' followed by a number of seconds since the Epoch.  */
+static time_t
+parse_file_time (char const *arg)
+{
+  bool absolute = *arg == '@';
+  char const *digits = arg + absolute;
+  char *end;
+  intmax_t unit = 1;
+  errno = 0;
+  intmax_t n = strtoimax (digits, &end, 10);
+  bool ok = errno == 0 && end != digits;
+  if (ok && !absolute)
+    {
+      switch (*end)
+        {
+        case 'w': unit *= 7;	/* Fall through.  */
+        case 'd': unit *= 24;	/* Fall through.  */
+        case 'h': unit *= 60;	/* Fall through.  */
+        case 'm': unit *= 60;	/* Fall through.  */
+        case 's': end++;
+        }
+      ok = 0 <= n && n <= INTMAX_MAX / unit;
+    }
+  if (!ok || *end)
+    ts_error (EXIT_TROUBLE, 0, _("invalid file age or time: %s"),
+              quote (arg));
+  return absolute ? n : time (NULL) - n * unit;
+}
+
+/* Hairy buffering mechanism for grep.  The intent is to keep
+   all reads aligned on a page boundary and multiples of the
+   page size, unless a read yields a partial page.  */
+
+#define INITIAL_BUFSIZE 32768	/* Initial buffer size, not counting slop. */
+static size_t pagesize;		/* alignment of memory pages */
+static bool skip_empty_lines;	/* Skip empty lines in data.  */
+
+/* If true, keep searched data from crowding other data out of the page
+   cache: drop the pages of each file once they have been scanned, and
+   request readahead only for the next few files in the queue.  */
+static bool no_cache_pollution;
+
+/* With --no-cache-pollution, drop scanned pages in batches of this
+   many bytes, and request readahead for this many queued files.  */
+enum { DROP_CACHE_BATCH = 1 << 20 };
+enum { WILLNEED_WINDOW = 4 };
+
+/* Return VAL aligned to the next multiple of ALIGNMENT.  VAL can be
+   an integer or a pointer.  Both args must be free of side effects.  */
+#define ALIGN_TO(val, alignment) \
+  ((size_t) (val) % (alignment) == 0 \
+   ? (val) \
+   : (val) + ((alignment) - (size_t) (val) % (alignment)))
+
+/* Add two numbers that count input bytes or lines, and report an
+   error if the addition overflows.  */
+static uintmax_t
+add_count (uintmax_t a, uintmax_t b)
+{
+  uintmax_t sum = a + b;
+  if (sum < a)
+    ts_error (EXIT_TROUBLE, 0, _("input is too large to count"));
+  return sum;
+}
+
+/* Return true if BUF (of size SIZE) is all zeros.  */
+static bool
+all_zeros (char const *buf, size_t size)
+{
+  for (char const *p = buf; p < buf + size; p++)
+    if (*p)
+      return false;
+  return true;
+}
+
+/* Magic numbers of binary formats whose first page need not have a
+   null byte, mostly compressed ones.  TEXT is true if the magic number
+   is printable, so that a text file might start with it too.  */
+static struct
+{
+  char const *magic;
+  int len;
+  bool text;
+} const binary_magic[] =
+{
+  { "\177ELF", 4, false },
+  { "\x1f\x8b", 2, false },		/* gzip */
+  { "BZh", 3, true },			/* bzip2, checked further below */
+  { "(\xb5/\xfd", 4, false },		/* zstd */
+  { "\xfd" "7zXZ", 5, false },
+  { "7z\xbc\xaf\x27\x1c", 6, false },
+  { "PK\3\4", 4, false },
+  { "\x89PNG\r\n\x1a\n", 8, false },
+  { "\xff\xd8\xff", 3, false },		/* JPEG */
+  { "GIF8", 4, true },
+  { "\xca\xfe\xba\xbe", 4, false },	/* Java class, Mach-O fat */
+  { "\xcf\xfa\xed\xfe", 4, false },	/* Mach-O */
+  { "\xce\xfa\xed\xfe", 4, false },
+  { "OggS", 4, true },
+  { "wOFF", 4, true },
+  { "wOF2", 4, true },
+};
+
+/* Return true if the SIZE bytes at BUF, the start of a file, are
+   plausible text: characters valid in the locale, and no control
+   characters other than those found in text and escape sequences.
+   If PARTIAL, the file goes on past BUF, so a character may be cut
+   short at the end.  */
+static bool
+page_is_text (char const *buf, size_t size, bool partial)
+{
+  mbstate_t mbs = { 0 };
+  size_t clen;
+
+  for (char const *p = buf; p < buf + size; p += clen)
+    {
+      unsigned char c = *p;
+      if (c < ' ' && ! (('\a' <= c && c <= '\r') || c == '\33'))
+        return false;
+      clen = unibyte_mask ? mbrlen (p, buf + size - p, &mbs) : 1;
+      if (clen == (size_t) -2 && partial)
+        break;
+      if ((size_t) -2 <= clen)
+        return false;
+    }
+
+  return true;
+}
+
+/* Return true if the regular file FD with status ST is binary, judging
+   before reading it: if it has a hole, which reads as null bytes, or
+   if its first page has a null byte or starts with a binary format's
+   magic number.  A printable
+   magic number, or a name with a binary format's suffix, counts only
+   if the first page is not plausible text.  Read at most a page, into
+   CTX's buffer (which reset has prepared), without moving the file
+   offset.  */
+static bool
+probe_binary (struct grepctx *ctx, int fd, struct stat const *st)
+{
+  if (! S_ISREG (st->st_mode) || 0 <= ctx->input_left)
+    return false;
+
+  off_t start = fd == STDIN_FILENO ? lseek (fd, 0, SEEK_CUR) : 0;
+  if (start < 0)
+    return false;
+
+  if (SEEK_HOLE != SEEK_SET && usable_st_size (st))
+    {
+      off_t hole_start = lseek (fd, start, SEEK_HOLE);
+      if (0 <= hole_start)
+        {
+          if (lseek (fd, start, SEEK_SET) < 0)
+            suppressible_error (ctx->filename, errno);
+          if (hole_start < st->st_size)
+            return true;
+        }
+    }
+
+  ssize_t n = pread (fd, ctx->bufbeg, pagesize, start);
+  if (n <= 0)
+    return false;
+  if (memchr (ctx->bufbeg, '\0', n))
+    return true;
+
+  bool hint = binary_file_name (ctx->filename);
+  for (size_t i = 0; i < sizeof binary_magic / sizeof *binary_magic; i++)
+    if (binary_magic[i].len <= n
+        && memcmp (ctx->bufbeg, binary_magic[i].magic,
+                   binary_magic[i].len) == 0)
+      {
+        if (! binary_magic[i].text)
+          return true;
+        if (binary_magic[i].magic[0] != 'B'
+            || (10 <= n && '1' <= ctx->bufbeg[3] && ctx->bufbeg[3] <= '9'
+                && memcmp (ctx->bufbeg + 4, "1AY&SY", 6) == 0))
+          hint = true;
+        break;
+      }
+
+  return hint && ! page_is_text (ctx->bufbeg, n, n == pagesize);
+}
+
+/* Reset the buffer for a new file, returning false if we should skip it.
+   Initialize on the first time through. */
+static bool
+reset (struct grepctx *ctx, int fd, struct stat const *st)
+{
+  ctx->bufbeg = ctx->buflim = ALIGN_TO (ctx->buffer + 1, pagesize);
+  ctx->bufbeg[-1] = eolbyte;
+  ctx->bufdesc = fd;
+
+  if (S_ISREG (st->st_mode))
     {
       if (fd != STDIN_FILENO)
         ctx->bufoffset = 0;
@@ -852,10 +1909,51 @@ reset (struct grepctx *ctx, int fd, struct stat const *st)
               return false;
             }
         }
+      ctx->cache_dropped = ctx->bufoffset;
     }
   return true;
 }
 
+/* Read up to SIZE bytes of input into BUF, the way safe_read does,
+   but honoring the limits of an input that is only a slice of its
+   descriptor or that lives in memory.  */
+static size_t
+read_input (struct grepctx *ctx, char *buf, size_t size)
+{
+  if (ctx->input_left < 0)
+    return safe_read (ctx->bufdesc, buf, size);
+
+  if (ctx->input_left < size)
+    size = ctx->input_left;
+  if (ctx->input_mem)
+    {
+      memcpy (buf, ctx->input_mem, size);
+      ctx->input_mem += size;
+    }
+  else
+    {
+      size = safe_read (ctx->bufdesc, buf, size);
+      if (size == SAFE_READ_ERROR)
+        return size;
+    }
+  ctx->input_left -= size;
+  return size;
+}
+
+/* Tell the kernel that the input before the buffer will not be read
+   again, once there is enough of it to be worth a system call.  */
+static void
+drop_cache_behind (struct grepctx *ctx)
+{
+  off_t scanned = ctx->bufoffset - (ctx->buflim - ctx->bufbeg);
+  if (DROP_CACHE_BATCH <= scanned - ctx->cache_dropped)
+    {
+      posix_fadvise (ctx->bufdesc, ctx->cache_dropped,
+                     scanned - ctx->cache_dropped, POSIX_FADV_DONTNEED);
+      ctx->cache_dropped = scanned;
+    }
+}
+
 /* Read new stuff into the buffer, saving the specified
    amount of old stuff.  When we're done, 'bufbeg' points
    to the beginning of the buffer contents, and 'buflim'
@@ -926,13 +2024,14 @@ fillbuf (struct grepctx *ctx, size_t save, struct stat const *st)
     }
 
   clear_asan_poison (ctx);
+  uintmax_t t = stats_start ();
 
   readsize = ctx->buffer + ctx->bufalloc - sizeof (uword) - readbuf;
   readsize -= readsize % pagesize;
 
   while (true)
     {
-      fillsize = safe_read (ctx->bufdesc, readbuf, readsize);
+      fillsize = read_input (ctx, readbuf, readsize);
       if (fillsize == SAFE_READ_ERROR)
         {
           fillsize = 0;
@@ -965,6 +2064,12 @@ fillbuf (struct grepctx *ctx, size_t save, struct stat const *st)
 
   fillsize = undossify_input (ctx, readbuf, fillsize);
   ctx->buflim = readbuf + fillsize;
+  if (thread_stats)
+    thread_stats->bytes += fillsize;
+  stats_end (STAT_READ, t);
+
+  if (no_cache_pollution && ctx->input_left < 0 && S_ISREG (st->st_mode))
+    drop_cache_behind (ctx);
 
   /* Initialize the following word, because skip_easy_bytes and some
      matchers read (but do not use) those bytes.  This avoids false
@@ -999,6 +2104,8 @@ static int filename_mask;	/* If zero, output nulls after filenames.  */
 static bool out_invert;		/* Print nonmatching stuff. */
 static bool out_line;		/* Print line numbers. */
 static bool out_byte;		/* Print byte offsets. */
+static bool bulk_invert;	/* -v output lines need no decoration,
+                                   so runs of them can be copied whole.  */
 static intmax_t out_before;	/* Lines of leading context. */
 static intmax_t out_after;	/* Lines of trailing context. */
 static bool count_matches;	/* Count matching lines.  */
@@ -1010,6 +2117,27 @@ static char *label = NULL;      /* Fake filename for stdin */
 
 static bool exit_on_match;	/* Exit on first match.  */
 
+/* --query-file=FILE: search for several named patterns in one pass.
+   Each line of FILE is an ID, a tab and a pattern.  A line is output
+   once for each query that matches it, after the query's ID, and -c
+   and -m apply to each query separately.  All the patterns together
+   make up the ordinary pattern, which finds the lines that some query
+   may match, so that the queries are tried only on those.  */
+struct query
+{
+  char *id;
+  size_t idlen;
+  char *pattern;
+  size_t size;
+};
+static char const *query_file;
+static struct query *queries;
+static size_t nqueries;
+static size_t query_id_max;	/* Length of the longest ID.  */
+static void ***query_sets;	/* A compilation of every query's pattern
+                                   for each worker thread.  */
+static size_t query_sets_taken;
+
 #include "dosbuf.c"
 
 static void
@@ -1046,31 +2174,105 @@ print_sep (char sep)
   pr_sgr_end_if (sep_color);
 }
 
-/* Print a line number or a byte offset.  */
-static void
-print_offset (uintmax_t pos, int min_width, const char *color)
+/* The number of bytes that format_sgr_start and format_sgr_end may
+   store for COLOR.  */
+static size_t
+sgr_size (char const *color)
 {
-  /* Do not rely on printf to print pos, since uintmax_t may be longer
-     than long, and long long is not portable.  */
+  return (color_option && *color
+          ? strlen (sgr_start) + strlen (color) + strlen (sgr_end)
+          : 0);
+}
 
-  char buf[sizeof pos * CHAR_BIT];
-  char *p = buf + sizeof buf;
+/* Store at P the start of the SGR sequence for COLOR, as
+   pr_sgr_start_if would print it, and return the end.  */
+static char *
+format_sgr_start (char *p, char const *color)
+{
+  if (color_option && *color)
+    p += sprintf (p, sgr_start, color);
+  return p;
+}
 
-  do
+static char *
+format_sgr_end (char *p, char const *color)
+{
+  if (color_option && *color)
+    p = stpcpy (p, sgr_end);
+  return p;
+}
+
+/* Store at P a separator, as print_sep would print it.  */
+static char *
+format_sep (char *p, char sep)
+{
+  p = format_sgr_start (p, sep_color);
+  *p++ = sep;
+  return format_sgr_end (p, sep_color);
+}
+
+/* Store at P a line number or a byte offset, and return the end.  */
+static char *
+format_offset (char *p, uintmax_t pos, int min_width, const char *color)
+{
+  /* Do not rely on printf to print pos, since uintmax_t may be longer
+     than long, and long long is not portable.  Convert two digits at
+     a time, which halves the divisions.  */
+  static char const digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+  char buf[INT_BUFSIZE_BOUND (uintmax_t)];
+  char *d = buf + sizeof buf;
+
+  for (; 100 <= pos; pos /= 100)
     {
-      *--p = '0' + pos % 10;
-      --min_width;
+      d -= 2;
+      memcpy (d, digit_pairs + 2 * (pos % 100), 2);
     }
-  while ((pos /= 10) != 0);
+  if (10 <= pos)
+    {
+      d -= 2;
+      memcpy (d, digit_pairs + 2 * pos, 2);
+    }
+  else
+    *--d = '0' + pos;
 
+  p = format_sgr_start (p, color);
   /* Do this to maximize the probability of alignment across lines.  */
   if (align_tabs)
-    while (--min_width >= 0)
-      *--p = ' ';
+    for (int width = buf + sizeof buf - d; width < min_width; width++)
+      *p++ = ' ';
+  p = mempcpy (p, d, buf + sizeof buf - d);
+  return format_sgr_end (p, color);
+}
+
+/* Make room in CTX for the line heads of the current file, and format
+   the file name part that they all start with.  */
+static void
+prepare_line_head (struct grepctx *ctx)
+{
+  size_t namelen = out_file ? strlen (ctx->filename) : 0;
+  size_t size = (namelen + 1 + sgr_size (filename_color) + query_id_max
+                 + 4 * (sgr_size (sep_color) + 1)
+                 + sgr_size (line_num_color) + sgr_size (byte_num_color)
+                 + 2 * INT_BUFSIZE_BOUND (uintmax_t) + sizeof "\t\b");
+  if (ctx->line_head_alloc < size)
+    {
+      free (ctx->line_head);
+      ctx->line_head = xmalloc (ctx->line_head_alloc = size);
+    }
 
-  pr_sgr_start_if (color);
-  fwrite_errno (p, 1, buf + sizeof buf - p);
-  pr_sgr_end_if (color);
+  char *p = ctx->line_head;
+  if (out_file)
+    {
+      p = format_sgr_start (p, filename_color);
+      p = mempcpy (p, ctx->filename, namelen);
+      p = format_sgr_end (p, filename_color);
+      if (!filename_mask)
+        *p++ = '\0';
+    }
+  ctx->line_head_prefix = p - ctx->line_head;
 }
 
 /* Print a whole line head (filename, line, byte).  The output data
@@ -1099,15 +2301,19 @@ print_line_head (struct grepctx *ctx, char *beg, size_t len, char const *lim,
       return false;
     }
 
-  bool pending_sep = false;
+  /* Assemble the head after the file name part, and write it all
+     at once.  */
+  if (ctx->line_head_prefix < 0)
+    prepare_line_head (ctx);
+  char *p = ctx->line_head + ctx->line_head_prefix;
+  bool pending_sep = out_file && filename_mask;
 
-  if (out_file)
+  if (ctx->query)
     {
-      print_filename (ctx);
-      if (filename_mask)
-        pending_sep = true;
-      else
-        putchar_errno (0);
+      if (pending_sep)
+        p = format_sep (p, sep);
+      p = mempcpy (p, ctx->query->id, ctx->query->idlen);
+      pending_sep = true;
     }
 
   if (out_line)
@@ -1119,8 +2325,8 @@ print_line_head (struct grepctx *ctx, char *beg, size_t len, char const *lim,
           ctx->lastnl = lim;
         }
       if (pending_sep)
-        print_sep (sep);
-      print_offset (ctx->totalnl, 4, line_num_color);
+        p = format_sep (p, sep);
+      p = format_offset (p, ctx->totalnl, 4, line_num_color);
       pending_sep = true;
     }
 
@@ -1129,8 +2335,8 @@ print_line_head (struct grepctx *ctx, char *beg, size_t len, char const *lim,
       uintmax_t pos = add_count (ctx->totalcc, beg - ctx->bufbeg);
       pos = dossified_pos (pos);
       if (pending_sep)
-        print_sep (sep);
-      print_offset (pos, 6, byte_num_color);
+        p = format_sep (p, sep);
+      p = format_offset (p, pos, 6, byte_num_color);
       pending_sep = true;
     }
 
@@ -1141,11 +2347,13 @@ print_line_head (struct grepctx *ctx, char *beg, size_t len, char const *lim,
          (and its combining and wide characters)
          filenames and you're wasting your efforts.  */
       if (align_tabs)
-        fputs_errno ("\t\b");
+        p = stpcpy (p, "\t\b");
 
-      print_sep (sep);
+      p = format_sep (p, sep);
     }
 
+  if (p != ctx->line_head)
+    fwrite_errno (ctx->line_head, 1, p - ctx->line_head);
   return true;
 }
 
@@ -1158,11 +2366,12 @@ print_line_middle (struct grepctx *ctx, char *beg, char *lim,
   char *cur;
   char *mid = NULL;
   char *b;
+  struct match_iter it;
 
+  match_iter_init (&it, ctx, execute, beg, lim);
   for (cur = beg;
-       (cur < lim
-        && ((match_offset = execute (ctx->compiled_pattern, ctx, beg, lim - beg,
-                                     &match_size, cur)) != (size_t) -1));
+       (it.cur = cur,
+        match_iter_next (&it, iterate, &match_offset, &match_size));
        cur = b + match_size)
     {
       b = beg + match_offset;
@@ -1238,6 +2447,22 @@ print_line_tail (char *beg, const char *lim, const char *line_color)
   return beg;
 }
 
+/* Pass the line BEG..LIM to CTX's reporting hook, numbering it as
+   print_line_head would.  If the hook says to stop, stop as -q does.  */
+static void
+report_line (struct grepctx *ctx, char *beg, char *lim)
+{
+  if (ctx->lastnl < lim)
+    {
+      nlscan (ctx, beg);
+      ctx->totalnl = add_count (ctx->totalnl, 1);
+      ctx->lastnl = lim;
+    }
+  if (! ctx->report (ctx->report_arg, ctx, beg, lim, ctx->totalnl,
+                     add_count (ctx->totalcc, beg - ctx->bufbeg)))
+    ctx->done_on_match = ctx->out_quiet = true;
+}
+
 static void
 prline (struct grepctx *ctx, char *beg, char *lim, char sep)
 {
@@ -1245,6 +2470,12 @@ prline (struct grepctx *ctx, char *beg, char *lim, char sep)
   const char *line_color;
   const char *match_color;
 
+  if (ctx->report)
+    {
+      report_line (ctx, beg, lim);
+      return;
+    }
+
   if (!only_matching)
     if (! print_line_head (ctx, beg, lim - beg - 1, lim, sep))
       return;
@@ -1299,6 +2530,7 @@ prline (struct grepctx *ctx, char *beg, char *lim, char sep)
    Implemented with a queue with a double linked list implementation */
 typedef struct node {
   pthread_t ID; /* of thread */
+  bool idle; /* thread is between files, so has nothing to print */
   struct node *next;
   struct node *prev;
 } node;
@@ -1317,13 +2549,15 @@ static bool
 sendNodeToBack( pthread_t ID )
 {
   /* Lock queue head from being read */
-  pthread_mutex_lock( &queueLock );
-  pthread_rwlock_wrlock( &nodeLock );
+  timed_mutex_lock( &queueLock, LOCK_QUEUE );
+  timed_wrlock( &nodeLock, LOCK_NODE_WRITE );
   bool retVal = true;
 
   struct node *p = headNode;
   while( p != NULL && p->ID != ID )
     p = p->next;
+  if( p != NULL )
+    p->idle = false;
   if( p == NULL ) /* ID was not found */
     retVal = false;
   else if( p->next == NULL ) /* p is last node */
@@ -1350,27 +2584,52 @@ sendNodeToBack( pthread_t ID )
     last->prev = p;
     last->next = NULL;
   }
-  pthread_rwlock_unlock( &nodeLock );
-  pthread_mutex_unlock( &queueLock );
+  timed_rwlock_unlock( &nodeLock, LOCK_NODE_WRITE );
+  timed_mutex_unlock( &queueLock, LOCK_QUEUE );
   return retVal;
 }
 
+/* true if ID may print, i.e. every node ahead of it is idle.  Idle
+   threads wait for work without holding up the ones behind them, which
+   matters once workers themselves queue work (tar members). */
 static bool
 isNodeHead( pthread_t ID )
 {
-  pthread_rwlock_rdlock( &nodeLock );
+  timed_rdlock( &nodeLock, LOCK_NODE_READ );
   bool val = false;
-  if( headNode != NULL )
-    val = ( ID == headNode->ID );
-  pthread_rwlock_unlock( &nodeLock );
+  struct node *p = headNode;
+  while( p != NULL && p->ID != ID && p->idle )
+    p = p->next;
+  if( p != NULL )
+    val = ( ID == p->ID );
+  timed_rwlock_unlock( &nodeLock, LOCK_NODE_READ );
   return val;
 }
 
+/* mark ID as idle, letting the nodes behind it take their turn */
+static void
+setNodeIdle( pthread_t ID )
+{
+  timed_mutex_lock( &queueLock, LOCK_QUEUE );
+  timed_wrlock( &nodeLock, LOCK_NODE_WRITE );
+
+  struct node *p = headNode;
+  while( p != NULL && p->ID != ID )
+    p = p->next;
+  if( p != NULL && !p->idle )
+  {
+    p->idle = true;
+    pthread_cond_broadcast( &headNodeUpdate );
+  }
+  timed_rwlock_unlock( &nodeLock, LOCK_NODE_WRITE );
+  timed_mutex_unlock( &queueLock, LOCK_QUEUE );
+}
+
 static bool
 addNode( struct node *n )
 {
-  pthread_mutex_lock( &queueLock );
-  pthread_rwlock_wrlock( &nodeLock );
+  timed_mutex_lock( &queueLock, LOCK_QUEUE );
+  timed_wrlock( &nodeLock, LOCK_NODE_WRITE );
 
   if( headNode == NULL )
   {
@@ -1389,16 +2648,16 @@ addNode( struct node *n )
     n->prev = p;
     n->next = NULL;
   }
-  pthread_rwlock_unlock( &nodeLock );
-  pthread_mutex_unlock( &queueLock );
+  timed_rwlock_unlock( &nodeLock, LOCK_NODE_WRITE );
+  timed_mutex_unlock( &queueLock, LOCK_QUEUE );
   return true;
 }
 
 static bool
 deleteNode( pthread_t ID )
 {
-  pthread_mutex_lock( &queueLock );
-  pthread_rwlock_wrlock( &nodeLock );
+  timed_mutex_lock( &queueLock, LOCK_QUEUE );
+  timed_wrlock( &nodeLock, LOCK_NODE_WRITE );
 
   struct node *p = headNode;
   while( p != NULL && p->ID != ID )
@@ -1406,18 +2665,21 @@ deleteNode( pthread_t ID )
 
   if( p == NULL )
   {
-    pthread_mutex_unlock( &queueLock );
+    timed_rwlock_unlock( &nodeLock, LOCK_NODE_WRITE );
+    timed_mutex_unlock( &queueLock, LOCK_QUEUE );
     return false;
   }
   /* 3 conditions, p is head */
   if( p == headNode )
   {
     headNode = p->next;
+    if( headNode != NULL )
+      headNode->prev = NULL;
     pthread_cond_broadcast( &headNodeUpdate );
   }
   /* p is last */
   else if( p->next == NULL )
-    p->prev = NULL;
+    p->prev->next = NULL;
   /* p is in the middle of the queue */
   else
   {
@@ -1426,11 +2688,39 @@ deleteNode( pthread_t ID )
   }
 
   free( p );
-  pthread_rwlock_unlock( &nodeLock );
-  pthread_mutex_unlock( &queueLock );
+  timed_rwlock_unlock( &nodeLock, LOCK_NODE_WRITE );
+  timed_mutex_unlock( &queueLock, LOCK_QUEUE );
   return true;
 }
 
+/* Wait until it is ID's turn to print, and take the output lock, unless
+   *LOCKED says that was already done.  Chunks of standard input have no
+   turn; their output is captured, then emitted in the turn of the
+   input as a whole.  Nor do searches that report their lines to a
+   hook rather than output them.  */
+static void
+wait_output_turn( struct grepctx *ctx, pthread_t ID, bool *locked )
+{
+  if( *locked || ctx->chunk || ctx->report )
+    return;
+
+  uintmax_t t = stats_start ();
+  timed_mutex_lock( &queueLock, LOCK_QUEUE );
+  for( bool woken = false; !isNodeHead( ID ); woken = true )
+  {
+    if( woken && lock_stats_format )
+      stat_add( &head_spurious, 1 );
+    timed_cond_wait( &headNodeUpdate, &queueLock, LOCK_QUEUE );
+    if( lock_stats_format )
+      stat_add( &head_wakeups, 1 );
+  }
+  timed_mutex_unlock( &queueLock, LOCK_QUEUE );
+
+  lock_output();
+  *locked = true;
+  stats_end (STAT_TURN, t);
+}
+
 /* Multithreading implementation */
 
 
@@ -1443,29 +2733,39 @@ prpending (struct grepctx *ctx, char const *lim, pthread_t ID, bool *locked)
     ctx->lastout = ctx->bufbeg;
   //lock_output ();
 
-  /* FIXME ADD locks here */
-
-  if( !*locked )
-  {
-    pthread_mutex_lock( &queueLock );
-    while( !isNodeHead( ID ) )
-      pthread_cond_wait( &headNodeUpdate, &queueLock );
-    pthread_mutex_unlock( &queueLock );
-
-    lock_output();
-    *locked = true;
-  }
+  wait_output_turn( ctx, ID, locked );
 
   while (ctx->pending > 0 && ctx->lastout < lim)
     {
       char *nl = memchr (ctx->lastout, eolbyte, lim - ctx->lastout);
       size_t match_size;
+      bool selected;
       --ctx->pending;
-      if (ctx->outleft
-          || ((execute (ctx->compiled_pattern, ctx, ctx->lastout,
-                        nl + 1 - ctx->lastout, &match_size, NULL)
-               == (size_t) -1)
-              == !out_invert))
+      if (ctx->outleft)
+        selected = false;
+      else if (out_invert)
+        selected = (timed_execute (ctx, ctx->lastout, nl + 1 - ctx->lastout,
+                                   &match_size, NULL)
+                    == (size_t) -1);
+      else
+        {
+          /* Rather than matching each context line on its own, find
+             the next matching line once and count down to it.  */
+          if (! (ctx->next_match && ctx->match_scan_beg <= ctx->lastout
+                 && ctx->lastout <= ctx->next_match
+                 && nl < ctx->match_scan_end))
+            {
+              size_t off = timed_execute (ctx, ctx->lastout,
+                                          lim - ctx->lastout, &match_size,
+                                          NULL);
+              ctx->match_scan_beg = ctx->lastout;
+              ctx->match_scan_end = lim;
+              ctx->next_match = (off == (size_t) -1 ? lim
+                                 : ctx->lastout + off);
+            }
+          selected = ctx->lastout == ctx->next_match;
+        }
+      if (!selected)
         prline (ctx, ctx->lastout, nl + 1, SEP_CHAR_REJECTED);
       else
         ctx->pending = 0;
@@ -1489,18 +2789,8 @@ prtext (struct grepctx *ctx, char *beg, char *lim, pthread_t ID, bool *locked)
 
   //lock_output ();
 
-  /* FIXME Add locks here */
-  if ( !*locked )
-  {
-    pthread_mutex_lock( &queueLock );
-    while( !isNodeHead( ID ) )
-      pthread_cond_wait( &headNodeUpdate, &queueLock );
-    pthread_mutex_unlock( &queueLock );
-    
-    lock_output ();
-    *locked = true;
-  }
-  
+  wait_output_turn( ctx, ID, locked );
+
   if (!ctx->out_quiet)
     {
       /* Deal with leading context.  */
@@ -1535,15 +2825,46 @@ prtext (struct grepctx *ctx, char *beg, char *lim, pthread_t ID, bool *locked)
   intmax_t n;
   if (out_invert)
     {
-      /* One or more lines are output.  */
-      for (n = 0; p < lim && n < ctx->outleft; n++)
+      /* One or more lines are output.  If OUTLEFT cannot cut them
+         short, count them in one pass.  */
+      char *end = p;
+      if (lim - p <= ctx->outleft)
         {
-          char *nl = memchr (p, eol, lim - p);
-          nl++;
-          if (!ctx->out_quiet)
-            prline (ctx, p, nl, SEP_CHAR_SELECTED);
-          p = nl;
+          end = lim;
+          n = count_eols (p, lim, eol);
+        }
+      else
+        for (n = 0; end < lim && n < ctx->outleft; n++)
+          end = (char *) memchr (end, eol, lim - end) + 1;
+
+      bool bulk = bulk_invert && !ctx->out_quiet;
+      if (bulk && binary_files != TEXT_BINARY_FILES)
+        {
+          /* An encoding error suppresses output from its line on, so
+             leave that to prline.  */
+          char ch = *end;
+          bulk = ! buf_has_encoding_errors (p, end - p);
+          *end = ch;
+        }
+
+      if (bulk)
+        {
+          fwrite_errno (p, 1, end - p);
+          if (line_buffered)
+            fflush_errno ();
+          if (stdout_errno)
+            ts_error (EXIT_TROUBLE, stdout_errno, _("write error"));
+          ctx->lastout = end;
         }
+      else
+        while (p < end && !ctx->out_quiet)
+          {
+            char *nl = memchr (p, eol, end - p);
+            nl++;
+            prline (ctx, p, nl, SEP_CHAR_SELECTED);
+            p = nl;
+          }
+      p = end;
     }
   else
     {
@@ -1583,6 +2904,73 @@ zap_nuls (char *p, char *lim, char eol)
       }
 }
 
+/* Like grepbuf, for --query-file: find with CTX's pattern the lines
+   between BEG and LIM that some query may match, and try each query
+   on them.  Return a count of the lines that some query selected.  */
+static intmax_t
+grepbuf_queries (struct grepctx *ctx, char *beg, char const *lim,
+                 pthread_t ID, bool *locked)
+{
+  void *compiled_pattern = ctx->compiled_pattern;
+  intmax_t nlines = 0;
+  char *endp;
+
+  for (char *p = beg; p < lim; p = endp)
+    {
+      size_t match_size;
+      size_t match_offset = timed_execute (ctx, p, lim - p, &match_size, NULL);
+      if (match_offset == (size_t) -1)
+        break;
+      char *b = p + match_offset;
+      endp = b + match_size;
+      /* Avoid matching the empty line at the end of the buffer. */
+      if (b == lim)
+        break;
+
+      bool selected = false;
+      for (size_t q = 0; q < nqueries; q++)
+        if (ctx->query_left[q])
+          {
+            ctx->compiled_pattern = ctx->query_patterns[q];
+            if (timed_execute (ctx, b, endp - b, &match_size, NULL)
+                != (size_t) -1)
+              {
+                selected = true;
+                ctx->query_count[q]++;
+                if (! --ctx->query_left[q])
+                  ctx->queries_active--;
+                if (!ctx->out_quiet)
+                  {
+                    wait_output_turn (ctx, ID, locked);
+                    ctx->query = &queries[q];
+                    prline (ctx, b, endp, SEP_CHAR_SELECTED);
+                    ctx->query = NULL;
+                  }
+              }
+            ctx->compiled_pattern = compiled_pattern;
+          }
+
+      if (selected)
+        {
+          nlines++;
+          ctx->after_last_match = ctx->bufoffset - (ctx->buflim - endp);
+          if (ctx->done_on_match)
+            {
+              if (exit_on_match)
+                exit (errseen ? exit_failure : EXIT_SUCCESS);
+              break;
+            }
+        }
+      if (!ctx->queries_active)
+        {
+          ctx->outleft = 0;
+          break;
+        }
+    }
+
+  return nlines;
+}
+
 /* Scan the specified portion of the buffer, matching lines (or
    between matching lines if OUT_INVERT is true).  Return a count of
    lines printed.  Replace all NUL bytes with NUL_ZAPPER as we go.  */
@@ -1593,11 +2981,13 @@ pthread_t ID, bool *locked)
   intmax_t outleft0 = ctx->outleft;
   char *endp;
 
+  if (nqueries)
+    return grepbuf_queries (ctx, beg, lim, ID, locked);
+
   for (char *p = beg; p < lim; p = endp)
     {
       size_t match_size;
-      size_t match_offset = execute (ctx->compiled_pattern, ctx, p, lim - p,
-                                     &match_size, NULL);
+      size_t match_offset = timed_execute (ctx, p, lim - p, &match_size, NULL);
       if (match_offset == (size_t) -1)
         {
           if (!out_invert)
@@ -1628,6 +3018,24 @@ pthread_t ID, bool *locked)
 }
 
 
+/* A piece of standard input that ends at a line boundary, searched by
+   whichever worker is free.  See search_stdin_chunks.  */
+struct stdin_chunk
+{
+  intmax_t seq;			/* Position among the chunks.  */
+  char *data;			/* The chunk's input.  */
+  size_t len;
+  struct stat st;		/* Fake regular-file status for DATA.  */
+  uintmax_t totalcc;		/* Bytes and lines before the chunk.  */
+  uintmax_t totalnl;
+  char *out;			/* Output captured while searching it.  */
+  size_t outlen;
+  intmax_t count;		/* Lines selected.  */
+  bool had_nulls;		/* The chunk looked binary.  */
+  bool binary_matched;		/* Its output ends in "Binary file ...".  */
+  struct stdin_chunk *next;
+};
+
 /* Search a given (non-directory) file.  Return a count of lines printed. */
 static intmax_t
 grep (struct grepctx *ctx, int fd, struct stat const *st, 
@@ -1648,26 +3056,43 @@ grep (struct grepctx *ctx, int fd, struct stat const *st,
      before the first null.  -1 if no input nulls have been deduced.  */
   intmax_t nlines_first_null = -1;
 
+  ctx->read_error = false;
+  for (size_t q = 0; q < nqueries; q++)
+    {
+      ctx->query_left[q] = ctx->out_max;
+      ctx->query_count[q] = 0;
+    }
+  ctx->queries_active = nqueries;
   if (! reset (ctx, fd, st))
-    return 0;
+    {
+      ctx->read_error = true;
+      return 0;
+    }
 
-  ctx->totalcc = 0;
+  ctx->totalcc = ctx->input_totalcc;
   ctx->lastout = 0;
-  ctx->totalnl = 0;
-  ctx->outleft = max_count;
+  ctx->totalnl = ctx->input_totalnl;
+  ctx->outleft = ctx->out_max;
   ctx->after_last_match = 0;
   ctx->pending = 0;
   ctx->skip_nuls = skip_empty_lines && !eol;
   ctx->encoding_error_output = false;
-  ctx->seek_data_failed = false;
+  ctx->line_head_prefix = -1;
+  /* A slice must not move its descriptor behind the reader's back.  */
+  ctx->seek_data_failed = 0 <= ctx->input_left;
 
   nlines = 0;
   residue = 0;
   save = 0;
 
+  if (binary_files == WITHOUT_MATCH_BINARY_FILES && eol
+      && probe_binary (ctx, fd, st))
+    return 0;
+
   if (! fillbuf (ctx, save, st))
     {
       suppressible_error (ctx->filename, errno);
+      ctx->read_error = true;
       return 0;
     }
 
@@ -1691,6 +3116,7 @@ grep (struct grepctx *ctx, int fd, struct stat const *st,
       ctx->lastnl = ctx->bufbeg;
       if (ctx->lastout)
         ctx->lastout = ctx->bufbeg;
+      ctx->next_match = NULL;
 
       beg = ctx->bufbeg + save;
 
@@ -1744,14 +3170,15 @@ grep (struct grepctx *ctx, int fd, struct stat const *st,
 
       /* Handle some details and read more data to scan.  */
       save = residue + lim - beg;
-      if (out_byte)
+      if (out_byte || ctx->report)
         ctx->totalcc = add_count (ctx->totalcc,
                                   ctx->buflim - ctx->bufbeg - save);
-      if (out_line)
+      if (out_line || ctx->report)
         nlscan (ctx, beg);
       if (! fillbuf (ctx, save, st))
         {
           suppressible_error (ctx->filename, errno);
+          ctx->read_error = true;
           goto finish_grep;
         }
     }
@@ -1768,21 +3195,15 @@ grep (struct grepctx *ctx, int fd, struct stat const *st,
  finish_grep:
   ctx->done_on_match = done_on_match_0;
   ctx->out_quiet = out_quiet_0;
+  if (ctx->chunk)
+    ctx->chunk->had_nulls = 0 <= nlines_first_null;
   if (!ctx->out_quiet
       && (ctx->encoding_error_output
           || (0 <= nlines_first_null && nlines_first_null < nlines)))
     {
-            
-      if( !*locked )
-      {
-        pthread_mutex_lock( &queueLock );
-        while( !isNodeHead( ID ) )
-          pthread_cond_wait( &headNodeUpdate, &queueLock );
-        pthread_mutex_unlock( &queueLock );
-        lock_output();
-        *locked = true;
-      }
-      
+      wait_output_turn( ctx, ID, locked );
+      if (ctx->chunk)
+        ctx->chunk->binary_matched = true;
       printf_errno (_("Binary file %s matches\n"), ctx->filename);
       if (line_buffered)
         fflush_errno ();
@@ -1797,6 +3218,12 @@ struct workfile
   int fd;
   char *path;
   struct stat st;
+  char *data;			/* If nonnull, the file's contents, e.g.,
+                                   a tar member; FD is then -1.  */
+  size_t datalen;		/* Length of DATA.  */
+  struct stdin_chunk *chunk;	/* If nonnull, DATA is this chunk of
+                                   standard input.  */
+  bool advised;			/* Readahead has been requested.  */
   struct workfile *next;
 };
 
@@ -1806,25 +3233,71 @@ static struct
   struct workfile *tail;
   int num_files;
   int producer_done;
+  int active_producers;		/* Workers still adding files, e.g.,
+                                   members of a tar archive.  */
+  size_t queued_bytes;		/* Total DATALEN of the queued files.  */
   pthread_mutex_t lock;
   pthread_cond_t consumer_cond;
   pthread_cond_t producer_cond;
 } workqueue;
 
 static intmax_t max_queued_files;
+static intmax_t num_threads;	/* Number of worker threads.  */
+
+
+/* With --no-cache-pollution, mark for readahead the files among the
+   first WILLNEED_WINDOW in the queue that are not yet marked, storing
+   their descriptors into FDS.  Return the number stored.  The caller
+   holds workqueue.lock.  */
+static int
+willneed_window (int fds[WILLNEED_WINDOW])
+{
+  int n = 0;
+  int i = 0;
+  for (struct workfile *wf = workqueue.head; wf && i < WILLNEED_WINDOW;
+       wf = wf->next, i++)
+    if (!wf->advised)
+      {
+        wf->advised = true;
+        if (0 <= wf->fd)
+          fds[n++] = wf->fd;
+      }
+  return n;
+}
+
+/* Request readahead for the N descriptors in FDS.  */
+static void
+willneed_files (int const *fds, int n)
+{
+  for (int i = 0; i < n; i++)
+    posix_fadvise (fds[i], 0, 0, POSIX_FADV_WILLNEED);
+}
 
+static bool archive_workfile (struct workfile const *);
 
 /* Retrieve a workfile from the work queue, returning NULL if there's
-   nothing left to process. */
+   nothing left to process.  If it is an archive, count the caller as a
+   producer, so that no worker finds the queue finished while the
+   archive's members are yet to be queued; the caller undoes this with
+   add_workqueue_producer (-1) once it has searched the archive.  */
 static struct workfile *
 dequeue_workfile ( pthread_t ID )
 {
   struct workfile *wf;
-
-  pthread_mutex_lock (&workqueue.lock);
-  while (!workqueue.num_files && !workqueue.producer_done)
-    pthread_cond_wait (&workqueue.consumer_cond, &workqueue.lock);
-  if (!workqueue.num_files && workqueue.producer_done)
+  int willneed[WILLNEED_WINDOW];
+  int nwillneed = 0;
+  uintmax_t start = thread_trace ? stats_clock () : 0;
+
+  setNodeIdle( ID );
+
+  uintmax_t t = stats_start ();
+  timed_mutex_lock (&workqueue.lock, LOCK_WORKQUEUE);
+  while (!workqueue.num_files
+         && (!workqueue.producer_done || workqueue.active_producers))
+    timed_cond_wait (&workqueue.consumer_cond, &workqueue.lock,
+                     LOCK_WORKQUEUE);
+  stats_end (STAT_QUEUE, t);
+  if (!workqueue.num_files)
     wf = NULL;
   else
     {
@@ -1833,28 +3306,50 @@ dequeue_workfile ( pthread_t ID )
       if (!workqueue.head)
         workqueue.tail = NULL;
       workqueue.num_files--;
+      workqueue.queued_bytes -= wf->datalen;
+      if (archive_workfile (wf))
+        workqueue.active_producers++;
       pthread_cond_signal (&workqueue.producer_cond);
       sendNodeToBack( ID );
+      if (no_cache_pollution)
+        nwillneed = willneed_window (willneed);
     }
-  pthread_mutex_unlock (&workqueue.lock);
+  timed_mutex_unlock (&workqueue.lock, LOCK_WORKQUEUE);
 
+  /* The files stay open while queued, so the descriptors are still
+     theirs; and at worst a hint goes astray.  */
+  willneed_files (willneed, nwillneed);
+
+  if (thread_trace)
+    trace_span ("dequeue_workfile", start, stats_clock (), NULL);
   return wf;
 }
 
+/* Append WF to the work queue.  Files that hold a descriptor wait for
+   room, as the queue length is bounded by the descriptor limit; files
+   whose data is in memory do not, since their producer is a worker
+   that must not block behind its own consumers.  */
 static void
-enqueue_workfile (int fd, char const *path, struct stat *st)
+enqueue_work (struct workfile *wf)
 {
-  struct workfile *wf;
+  int willneed[WILLNEED_WINDOW];
+  int nwillneed = 0;
 
-  wf = xmalloc (sizeof (*wf));
-  wf->fd = fd;
-  wf->path = xstrdup (path);
-  wf->st = *st;
   wf->next = NULL;
+  wf->advised = !no_cache_pollution;
 
-  pthread_mutex_lock (&workqueue.lock);
-  while (workqueue.num_files >= max_queued_files)
-    pthread_cond_wait (&workqueue.producer_cond, &workqueue.lock);
+  uintmax_t t = stats_start ();
+  bool waited = false;
+  timed_mutex_lock (&workqueue.lock, LOCK_WORKQUEUE);
+  while (0 <= wf->fd && workqueue.num_files >= max_queued_files)
+    {
+      timed_cond_wait (&workqueue.producer_cond, &workqueue.lock,
+                       LOCK_WORKQUEUE);
+      waited = true;
+    }
+  stats_end (STAT_QUEUE, t);
+  if (waited && thread_trace)
+    trace_span ("enqueue wait", t, stats_clock (), NULL);
   if (!workqueue.head)
     workqueue.head = workqueue.tail = wf;
   else
@@ -1863,747 +3358,5714 @@ enqueue_workfile (int fd, char const *path, struct stat *st)
       workqueue.tail = wf;
     }
   workqueue.num_files++;
+  workqueue.queued_bytes += wf->datalen;
+  if (!wf->advised)
+    nwillneed = willneed_window (willneed);
   pthread_cond_signal (&workqueue.consumer_cond);
-  pthread_mutex_unlock (&workqueue.lock);
+  timed_mutex_unlock (&workqueue.lock, LOCK_WORKQUEUE);
+
+  willneed_files (willneed, nwillneed);
+}
+
+static void
+enqueue_workfile (int fd, char const *path, struct stat *st)
+{
+  struct workfile *wf;
+
+  wf = xmalloc (sizeof (*wf));
+  wf->fd = fd;
+  wf->path = xstrdup (path);
+  wf->st = *st;
+  wf->data = NULL;
+  wf->datalen = 0;
+  wf->chunk = NULL;
+  enqueue_work (wf);
 }
 
 static void
 finish_workqueue (void)
 {
-  pthread_mutex_lock (&workqueue.lock);
+  timed_mutex_lock (&workqueue.lock, LOCK_WORKQUEUE);
   workqueue.producer_done = 1;
   pthread_cond_broadcast (&workqueue.consumer_cond);
-  pthread_mutex_unlock (&workqueue.lock);
+  timed_mutex_unlock (&workqueue.lock, LOCK_WORKQUEUE);
 }
 
-static void *
-worker_thread_func (void *arg)
+/* Note that a worker has started or stopped adding files to the queue,
+   so that the other workers do not exit while more may arrive.  */
+static void
+add_workqueue_producer (int delta)
 {
-  struct workfile* wf;
-  struct grepctx ctx;
-  intmax_t count;
-  bool status = true;
-  bool l = false;
-  bool *locked; locked = &l;
-
-  memset (&ctx, 0, sizeof (ctx));
-  if (pagesize == 0 || 2 * pagesize + 1 <= pagesize)
-    abort ();
-  ctx.bufalloc = (ALIGN_TO (INITIAL_BUFSIZE, pagesize)
-                  + pagesize + sizeof (uword));
-  ctx.buffer = xmalloc (ctx.bufalloc);
-
-  ctx.out_quiet = out_quiet;
-  ctx.done_on_match = done_on_match;
-  ctx.compiled_pattern = arg;
-
-  /* create node on loose queue */
-  struct node *n = (struct node*) malloc( sizeof( node ) );
-  n->ID = pthread_self(); n->next = NULL; n->prev = NULL;
-  addNode( n );
+  timed_mutex_lock (&workqueue.lock, LOCK_WORKQUEUE);
+  workqueue.active_producers += delta;
+  if (!workqueue.active_producers)
+    pthread_cond_broadcast (&workqueue.consumer_cond);
+  timed_mutex_unlock (&workqueue.lock, LOCK_WORKQUEUE);
+}
 
-  while (( wf = dequeue_workfile (pthread_self()) ))
+/* Print the -c count and the -l/-L file name for the file just
+   searched by CTX, which had COUNT selected lines.  With --query-file,
+   print a -c count for each query.  */
+static void
+print_file_summary (struct grepctx *ctx, intmax_t count)
+{
+  if (count_matches)
     {
-      ctx.filename = wf->path;
-
-#if defined SET_BINARY
-      /* Set input to binary mode.  Pipes are simulated with files
-         on DOS, so this includes the case of "foo | grep bar".  */
-      if (!isatty (wf->fd))
-        SET_BINARY (wf->fd);
-#endif
-
-      count = grep (&ctx, wf->fd, &wf->st, pthread_self(), locked);
-      status = !count && status;
-      if (count_matches)
+      /* Keep the lines for the file together.  */
+      lock_output ();
+      for (size_t q = 0; q < (nqueries ? nqueries : 1); q++)
         {
-          //lock_output ();
           if (out_file)
             {
-              print_filename (&ctx);
+              print_filename (ctx);
               if (filename_mask)
                 print_sep (SEP_CHAR_SELECTED);
               else
                 putchar_errno (0);
             }
-          printf_errno ("%" PRIdMAX "\n", count);
+          if (nqueries)
+            {
+              fwrite_errno (queries[q].id, 1, queries[q].idlen);
+              print_sep (SEP_CHAR_SELECTED);
+            }
+          printf_errno ("%" PRIdMAX "\n",
+                        nqueries ? ctx->query_count[q] : count);
           if (line_buffered)
             fflush_errno ();
-          //unlock_output ();
         }
+      unlock_output ();
+    }
 
-      if ((list_files == LISTFILES_MATCHING && count > 0)
-          || (list_files == LISTFILES_NONMATCHING && count == 0))
-        {
-          //lock_output ();
-          print_filename (&ctx);
-          putchar_errno ('\n' & filename_mask);
-          if (line_buffered)
-            fflush_errno ();
-          //unlock_output ();
-        }
+  if ((list_files == LISTFILES_MATCHING && count > 0)
+      || (list_files == LISTFILES_NONMATCHING && count == 0))
+    {
+      //lock_output ();
+      print_filename (ctx);
+      putchar_errno ('\n' & filename_mask);
+      if (line_buffered)
+        fflush_errno ();
+      //unlock_output ();
+    }
+}
 
-      if (wf->fd == STDIN_FILENO)
-        {
-          off_t required_offset =
-            ctx.outleft ? ctx.bufoffset : ctx.after_last_match;
-          if (required_offset != ctx.bufoffset
-              && lseek (wf->fd, required_offset, SEEK_SET) < 0
-              && S_ISREG (wf->st.st_mode))
-            suppressible_error (wf->path, errno);
-        }
+/* Tar archives.  With --tar, each member of a file whose name looks
+   like a tar archive is searched as a file of its own, named
+   ARCHIVE:MEMBER.  Compressed archives are decoded by piping them
+   through the matching decompressor, so nothing is extracted to disk.  */
 
-      if (wf->fd != STDIN_FILENO && close (wf->fd) != 0)
-        suppressible_error (wf->path, errno);
-      free (wf->path);
-      free (wf);
-      // only unlock if the lock has been placed
-      if( *locked )
-        unlock_output();
-      *locked = false;
-      
+static bool search_archives;
+
+enum { TAR_BLOCKSIZE = 512 };
+
+/* Members no larger than this are read into memory and queued for
+   any worker; larger ones are searched in place by the worker that
+   decodes the archive, straight from the archive stream.  */
+enum { TAR_MEMBER_QUEUE_MAX = 1 << 20 };
+
+/* Stop queuing members while this many bytes of them are waiting,
+   so that decoding cannot outrun searching without bound.  */
+enum { TAR_QUEUED_BYTES_MAX = 64 << 20 };
+
+static char const *const tar_suffixes[] =
+{
+  ".tar", ".tar.gz", ".tgz", ".tar.bz2", ".tbz", ".tbz2",
+  ".tar.xz", ".txz", ".tar.zst", ".tzst", NULL
+};
+
+static struct
+{
+  char const magic[6];
+  int magic_len;
+  char const *program;
+} const tar_decompressors[] =
+{
+  { "\x1f\x8b", 2, "gzip" },
+  { "BZh", 3, "bzip2" },
+  { "\xfd" "7zXZ", 6, "xz" },
+  { "\x28\xb5\x2f\xfd", 4, "zstd" },
+};
+
+static bool
+is_tar_name (char const *name)
+{
+  size_t len = strlen (name);
+  for (char const *const *s = tar_suffixes; *s; s++)
+    {
+      size_t slen = strlen (*s);
+      if (slen < len && STREQ (name + len - slen, *s))
+        return true;
     }
-  /* clean up memeory */
-  deleteNode( pthread_self() ); 
-  return (void *) status;
+  return false;
 }
 
-static void
-search_dirent (FTS *fts, FTSENT *ent, bool command_line)
+/* Return true if WF is to be searched as a tar archive, member by
+   member.  */
+static bool
+archive_workfile (struct workfile const *wf)
 {
-  char *name;
-  bool follow;
-  command_line &= ent->fts_level == FTS_ROOTLEVEL;
+  return (search_archives && !wf->data && !wf->chunk
+          && is_tar_name (wf->path));
+}
 
-  if (ent->fts_info == FTS_DP)
-    return;
+/* Suffixes of the names of files in formats that are usually binary,
+   in order.  With --binary-files=without-match, such a file is skipped
+   if its first page is not plausible text; some, such as Wavefront
+   .obj models and .bin dumps, are text.  */
+static char const *const binary_suffixes[] =
+{
+  "7z", "a", "bin", "bz2", "class", "dll", "dylib", "exe", "gif", "gz",
+  "ico", "jar", "jpeg", "jpg", "mp3", "mp4", "o", "obj", "png", "pyc",
+  "so", "webp", "woff", "woff2", "xz", "zip", "zst"
+};
 
-  if (!command_line
-      && skipped_file (ent->fts_name, false,
-                       (ent->fts_info == FTS_D || ent->fts_info == FTS_DC
-                        || ent->fts_info == FTS_DNR)))
+static int
+compare_suffix (void const *a, void const *b)
+{
+  return strcmp (a, *(char const *const *) b);
+}
+
+/* Return true if NAME looks like the name of a binary file.  */
+static bool
+binary_file_name (char const *name)
+{
+  /* --tar searches compressed tarballs.  */
+  if (search_archives && is_tar_name (name))
+    return false;
+  char const *dot = strrchr (name, '.');
+  return (dot && dot[1] && !strchr (dot, '/')
+          && bsearch (dot + 1, binary_suffixes,
+                      sizeof binary_suffixes / sizeof *binary_suffixes,
+                      sizeof *binary_suffixes, compare_suffix));
+}
+
+/* Read SIZE bytes from FD into BUF, stopping early only at end of
+   file.  Return the number of bytes read, or SAFE_READ_ERROR.  */
+static size_t
+read_fully (int fd, char *buf, size_t size)
+{
+  size_t total = 0;
+  while (total < size)
     {
-      fts_set (fts, ent, FTS_SKIP);
-      return;
+      size_t n = safe_read (fd, buf + total, size - total);
+      if (n == SAFE_READ_ERROR)
+        return n;
+      if (n == 0)
+        break;
+      total += n;
     }
+  return total;
+}
 
-  name = ent->fts_path;
-  if (omit_dot_slash && strlen (name) >= 2)
-    name += 2;
-  follow = (fts->fts_options & FTS_LOGICAL
-            || (fts->fts_options & FTS_COMFOLLOW && command_line));
+/* Discard the next SIZE bytes of FD, seeking past them if SEEKABLE.
+   Return false on error or premature end of file.  */
+static bool
+skip_input (int fd, bool seekable, uintmax_t size)
+{
+  char buf[16 * TAR_BLOCKSIZE];
 
-  switch (ent->fts_info)
+  if (seekable)
+    return size <= TYPE_MAXIMUM (off_t) && 0 <= lseek (fd, size, SEEK_CUR);
+  while (size)
     {
-    case FTS_D:
-      if (directories == RECURSE_DIRECTORIES)
-        return;
-      fts_set (fts, ent, FTS_SKIP);
-      break;
+      size_t n = read_fully (fd, buf, MIN (size, sizeof buf));
+      if (n == SAFE_READ_ERROR || n == 0)
+        return false;
+      size -= n;
+    }
+  return true;
+}
 
-    case FTS_DC:
-      if (!suppress_errors)
-        ts_error (0, 0, _("warning: %s: %s"), name,
-                    _("recursive directory loop"));
-      return;
-
-    case FTS_DNR:
-    case FTS_ERR:
-    case FTS_NS:
-      suppressible_error (name, ent->fts_errno);
-      return;
+/* Store into *VAL the number in the tar header field FIELD of LEN
+   bytes, which is either octal or GNU base-256.  Return false if it
+   is malformed.  */
+static bool
+tar_number (char const *field, size_t len, uintmax_t *val)
+{
+  uintmax_t v = 0;
+  size_t i = 0;
 
-    case FTS_DEFAULT:
-    case FTS_NSOK:
-      if (skip_devices (command_line))
+  if (to_uchar (field[0]) == 0x80)
+    {
+      for (i = 1; i < len; i++)
         {
-          struct stat *st = ent->fts_statp;
-          struct stat st1;
-          if (! st->st_mode)
-            {
-              /* The file type is not already known.  Get the file status
-                 before opening, since opening might have side effects
-                 on a device.  */
-              int flag = follow ? 0 : AT_SYMLINK_NOFOLLOW;
-              if (fstatat (fts->fts_cwd_fd, ent->fts_accpath, &st1, flag) != 0)
-                {
-                  suppressible_error (name, errno);
-                  return;
-                }
-              st = &st1;
-            }
-          if (is_device_mode (st->st_mode))
-            return;
+          if (UINTMAX_MAX >> CHAR_BIT < v)
+            return false;
+          v = (v << CHAR_BIT) | to_uchar (field[i]);
         }
-      break;
+      *val = v;
+      return true;
+    }
 
-    case FTS_F:
-    case FTS_SLNONE:
-      break;
+  while (i < len && field[i] == ' ')
+    i++;
+  for (; i < len && '0' <= field[i] && field[i] <= '7'; i++)
+    {
+      if (UINTMAX_MAX >> 3 < v)
+        return false;
+      v = (v << 3) | (field[i] - '0');
+    }
+  if (i < len && field[i] != ' ' && field[i] != '\0')
+    return false;
+  *val = v;
+  return true;
+}
 
-    case FTS_SL:
-    case FTS_W:
-      return;
+/* Return true if the header block HDR has a valid checksum.  */
+static bool
+tar_checksum_ok (char const *hdr)
+{
+  uintmax_t chksum;
+  uintmax_t sum = 0;
 
-    default:
-      abort ();
+  if (! tar_number (hdr + 148, 8, &chksum))
+    return false;
+  for (int i = 0; i < TAR_BLOCKSIZE; i++)
+    sum += 148 <= i && i < 156 ? ' ' : to_uchar (hdr[i]);
+  return sum == chksum;
+}
+
+/* Return the value of the "path" record in the pax extended header
+   DATA of SIZE bytes, or NULL if there is none.  */
+static char *
+pax_path (char const *data, size_t size)
+{
+  char const *p = data;
+  char const *lim = data + size;
+  char *path = NULL;
+
+  while (p < lim)
+    {
+      char *end;
+      uintmax_t reclen = strtoumax (p, &end, 10);
+      if (end == p || *end != ' ' || reclen == 0 || lim - p < reclen)
+        break;
+      char const *key = end + 1;
+      char const *rec_end = p + reclen - 1;
+      if (rec_end - key > 5 && memcmp (key, "path=", 5) == 0)
+        {
+          free (path);
+          path = xmemdup (key + 5, rec_end - (key + 5) + 1);
+          path[rec_end - (key + 5)] = '\0';
+        }
+      p += reclen;
     }
+  return path;
+}
 
-  search_file (fts->fts_cwd_fd, ent->fts_accpath, name, follow, command_line);
+/* Start the decompressor for the archive FD if its first bytes MAGIC
+   (of which LEN were read) call for one.  Return the descriptor to
+   read the decoded archive from, which is FD itself if it is not
+   compressed, or -1 after diagnosing a failure.  Set *PID to the
+   decompressor's process ID, or to 0 if there is none.  */
+static int
+open_tar_stream (int fd, char const *path, char const *magic, size_t len,
+                 pid_t *pid)
+{
+  *pid = 0;
+  for (size_t i = 0; i < sizeof tar_decompressors / sizeof *tar_decompressors;
+       i++)
+    if (tar_decompressors[i].magic_len <= len
+        && memcmp (magic, tar_decompressors[i].magic,
+                   tar_decompressors[i].magic_len) == 0)
+      {
+        char const *program = tar_decompressors[i].program;
+        char *args[] = { (char *) program, (char *) "-dc", NULL };
+        posix_spawn_file_actions_t actions;
+        int fds[2];
+        int err;
+
+        /* Close-on-exec, so that decompressors started concurrently by
+           other workers cannot hold our pipe open.  */
+        if (pipe2 (fds, O_CLOEXEC) != 0)
+          {
+            suppressible_error (path, errno);
+            return -1;
+          }
+        posix_spawn_file_actions_init (&actions);
+        posix_spawn_file_actions_adddup2 (&actions, fd, STDIN_FILENO);
+        posix_spawn_file_actions_adddup2 (&actions, fds[1], STDOUT_FILENO);
+        err = posix_spawnp (pid, program, &actions, NULL, args, environ);
+        posix_spawn_file_actions_destroy (&actions);
+        close (fds[1]);
+        if (err)
+          {
+            *pid = 0;
+            close (fds[0]);
+            if (! suppress_errors)
+              ts_error (0, err, _("%s: cannot run %s"), path, program);
+            errseen = true;
+            return -1;
+          }
+        return fds[0];
+      }
+  return fd;
 }
 
-static void
-search_desc (int desc, char const *path, bool command_line)
+/* Search the members of the tar archive described by WF, which the
+   calling worker has dequeued.  Return the number of lines selected
+   in the members searched by this worker; members queued for other
+   workers are accounted for by them.  */
+static intmax_t
+grep_archive (struct grepctx *ctx, struct workfile *wf, pthread_t ID,
+              bool *locked)
 {
-  struct stat st;
+  char hdr[TAR_BLOCKSIZE];
+  char *longname = NULL;
+  bool seekable;
+  bool bad_archive = false;
+  intmax_t nlines = 0;
+  pid_t pid;
+  ssize_t magic_len;
+  int fd;
 
-  if (fstat (desc, &st) != 0)
+  magic_len = pread (wf->fd, hdr, sizeof hdr, 0);
+  if (magic_len < 0)
     {
-      suppressible_error (path, errno);
-      goto closeout;
+      suppressible_error (wf->path, errno);
+      return 0;
     }
+  fd = open_tar_stream (wf->fd, wf->path, hdr, magic_len, &pid);
+  if (fd < 0)
+    return 0;
+  seekable = fd == wf->fd && S_ISREG (wf->st.st_mode);
 
-  if (desc != STDIN_FILENO && skip_devices (command_line)
-      && is_device_mode (st.st_mode))
-    goto closeout;
+  while (true)
+    {
+      uintmax_t size;
+      size_t n = read_fully (fd, hdr, sizeof hdr);
+      if (n == SAFE_READ_ERROR)
+        {
+          suppressible_error (wf->path, errno);
+          break;
+        }
+      if (n == 0 || all_zeros (hdr, n))
+        break;
+      if (n < sizeof hdr || ! tar_checksum_ok (hdr)
+          || ! tar_number (hdr + 124, 12, &size))
+        {
+          bad_archive = true;
+          break;
+        }
 
-  if (desc != STDIN_FILENO && command_line
-      && skipped_file (path, true, S_ISDIR (st.st_mode)))
-    goto closeout;
+      uintmax_t padded = ((size + TAR_BLOCKSIZE - 1)
+                          / TAR_BLOCKSIZE * TAR_BLOCKSIZE);
+      char type = hdr[156];
 
-  if (desc != STDIN_FILENO
-      && directories == RECURSE_DIRECTORIES && S_ISDIR (st.st_mode))
-    {
-      /* Traverse the directory starting with its full name, because
-         unfortunately fts provides no way to traverse the directory
-         starting from its file descriptor.  */
+      if (type == 'L' || type == 'x')
+        {
+          /* GNU long name, or pax extended header: the data names
+             the next member.  */
+          if (SIZE_MAX - 1 < padded)
+            {
+              bad_archive = true;
+              break;
+            }
+          char *data = xmalloc (padded + 1);
+          if (read_fully (fd, data, padded) != padded)
+            {
+              free (data);
+              bad_archive = true;
+              break;
+            }
+          data[size] = '\0';
+          if (type == 'L')
+            {
+              free (longname);
+              longname = data;
+            }
+          else
+            {
+              char *p = pax_path (data, size);
+              free (data);
+              if (p)
+                {
+                  free (longname);
+                  longname = p;
+                }
+            }
+          continue;
+        }
 
-      FTS *fts;
-      FTSENT *ent;
-      int opts = fts_options & ~(command_line ? 0 : FTS_COMFOLLOW);
-      char *fts_arg[2] = { (char *) path, NULL, };
+      if (type != '0' && type != '\0' && type != '7')
+        {
+          /* Directories, links, devices and the like have no text.  */
+          if (! skip_input (fd, seekable, padded))
+            {
+              bad_archive = true;
+              break;
+            }
+          free (longname);
+          longname = NULL;
+          continue;
+        }
 
-      /* Close DESC now, to conserve file descriptors if the race
-         condition occurs many times in a deep recursion.  */
-      if (close (desc) != 0)
-        suppressible_error (path, errno);
+      char name[TAR_BLOCKSIZE];
+      if (longname)
+        ;
+      else if (memcmp (hdr + 257, "ustar", 5) == 0 && hdr[345])
+        sprintf (name, "%.155s/%.100s", hdr + 345, hdr);
+      else
+        sprintf (name, "%.100s", hdr);
+      char const *member = longname ? longname : name;
+      char *member_path = xmalloc (strlen (wf->path) + strlen (member) + 2);
+      sprintf (member_path, "%s:%s", wf->path, member);
+      free (longname);
+      longname = NULL;
+
+      uintmax_t mode, mtime;
+      struct stat st;
+      memset (&st, 0, sizeof st);
+      st.st_mode = S_IFREG | (tar_number (hdr + 100, 8, &mode) ? mode & 07777
+                              : 0);
+      st.st_size = size;
+      if (tar_number (hdr + 136, 12, &mtime))
+        st.st_mtime = mtime;
+
+      bool queue_it = false;
+      if (1 < num_threads && size <= TAR_MEMBER_QUEUE_MAX)
+        {
+          timed_mutex_lock (&workqueue.lock, LOCK_WORKQUEUE);
+          queue_it = workqueue.queued_bytes + size <= TAR_QUEUED_BYTES_MAX;
+          timed_mutex_unlock (&workqueue.lock, LOCK_WORKQUEUE);
+        }
 
-      fts = fts_open (fts_arg, opts, NULL);
+      if (queue_it)
+        {
+          /* Hand the member to whichever worker is free.  */
+          struct workfile *mf = xmalloc (sizeof *mf);
+          mf->fd = -1;
+          mf->path = member_path;
+          mf->st = st;
+          mf->datalen = size;
+          mf->chunk = NULL;
+          mf->data = xmalloc (padded + 1);
+          if (read_fully (fd, mf->data, padded) != padded)
+            {
+              free (mf->data);
+              free (mf->path);
+              free (mf);
+              bad_archive = true;
+              break;
+            }
+          enqueue_work (mf);
+        }
+      else
+        {
+          /* Search the member in place, reading no further than its
+             end, then skip whatever the search left unread.  */
+          char const *filename = ctx->filename;
+          intmax_t count;
+
+          ctx->filename = member_path;
+          ctx->input_mem = NULL;
+          ctx->input_left = size;
+          count = grep (ctx, fd, &st, ID, locked);
+          nlines += count;
+          print_file_summary (ctx, count);
+          ctx->filename = filename;
+          bool skipped = skip_input (fd, seekable,
+                                     ctx->input_left + (padded - size));
+          ctx->input_left = -1;
+          free (member_path);
+          if (! skipped)
+            {
+              bad_archive = true;
+              break;
+            }
+        }
+    }
 
-      if (!fts)
-        xalloc_die ();
-      while ((ent = fts_read (fts)))
-        search_dirent (fts, ent, command_line);
-      if (errno)
-        suppressible_error (path, errno);
-      if (fts_close (fts))
-        suppressible_error (path, errno);
-      return;
+  free (longname);
+
+  if (pid)
+    {
+      int wstatus;
+      close (fd);
+      while (waitpid (pid, &wstatus, 0) < 0)
+        if (errno != EINTR)
+          {
+            wstatus = -1;
+            break;
+          }
+      /* A decompressor killed by SIGPIPE merely saw us stop early.  */
+      if (! (WIFEXITED (wstatus) && WEXITSTATUS (wstatus) == 0)
+          && ! (WIFSIGNALED (wstatus) && WTERMSIG (wstatus) == SIGPIPE))
+        bad_archive = true;
     }
-  if (desc != STDIN_FILENO
-      && ((directories == SKIP_DIRECTORIES && S_ISDIR (st.st_mode))
-          || ((devices == SKIP_DEVICES
-               || (devices == READ_COMMAND_LINE_DEVICES && !command_line))
-              && is_device_mode (st.st_mode))))
-    goto closeout;
 
-  /* If there is a regular file on stdout and the current file refers
-     to the same i-node, we have to report the problem and skip it.
-     Otherwise when matching lines from some other input reach the
-     disk before we open this file, we can end up reading and matching
-     those lines and appending them to the file from which we're reading.
-     Then we'd have what appears to be an infinite loop that'd terminate
-     only upon filling the output file system or reaching a quota.
-     However, there is no risk of an infinite loop if grep is generating
-     no output, i.e., with --silent, --quiet, -q.
-     Similarly, with any of these:
-       --max-count=N (-m) (for N >= 2)
-       --files-with-matches (-l)
-       --files-without-match (-L)
-     there is no risk of trouble.
-     For --max-count=1, grep stops after printing the first match,
-     so there is no risk of malfunction.  But even --max-count=2, with
-     input==output, while there is no risk of infloop, there is a race
-     condition that could result in "alternate" output.  */
-  if (!out_quiet && list_files == LISTFILES_NONE && 1 < max_count
-      && SAME_INODE (st, out_stat))
+  if (bad_archive)
     {
       if (! suppress_errors)
-        ts_error (0, 0, _("input file %s is also the output"), quote (path));
+        ts_error (0, 0, _("%s: invalid or truncated tar archive"), wf->path);
       errseen = true;
-      goto closeout;
     }
+  return nlines;
+}
 
-  /* Request readahead and enqueue a piece of work to worker threads */
-  posix_fadvise (desc, 0, 0, POSIX_FADV_WILLNEED);
-  enqueue_workfile (desc, path, &st);
-
-  return;
+/* Parallel search of standard input.  When standard input is a pipe,
+   the main thread slices it into chunks that end at line boundaries
+   and queues them for the workers.  Each worker captures its chunk's
+   output in memory; whoever finishes the next chunk in input order
+   emits it, and any later chunks that are ready.  */
 
- closeout:
-  if (desc != STDIN_FILENO && close (desc) != 0)
-    suppressible_error (path, errno);
-}
+enum { STDIN_CHUNK_SIZE = 1 << 20 };
 
-/* True if errno is ERR after 'open ("symlink", ... O_NOFOLLOW ...)'.
-   POSIX specifies ELOOP, but it's EMLINK on FreeBSD and EFTYPE on NetBSD.  */
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;		/* Signaled when a chunk is searched or
+                                   retired, and when reading ends.  */
+  char const *filename;
+  struct stdin_chunk *ready;	/* Searched but not yet emitted.  */
+  intmax_t next_seq;		/* Next chunk to emit.  */
+  intmax_t in_flight;		/* Chunks read but not yet retired.  */
+  bool reading;			/* More chunks may be read.  */
+  bool emitting;		/* The emitter has yet to finish.  */
+  intmax_t count;		/* Lines selected in the emitted chunks.  */
+  bool after_nulls;		/* An emitted chunk looked binary.  */
+  bool stop;			/* Discard the remaining chunks.  */
+} stdin_chunks = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* Return true if standard input, with status ST, should be searched
+   in parallel chunks.  Chunks are searched independently, so context
+   lines, which may cross chunk boundaries, rule this out, as do
+   --query-file's counts and limits for each query, and a regular
+   file, whose offset must be left just after the last selected line.  */
 static bool
-open_symlink_nofollow_error (int err)
+stdin_chunkable (struct stat const *st)
 {
-  if (err == ELOOP || err == EMLINK)
-    return true;
-#ifdef EFTYPE
-  if (err == EFTYPE)
-    return true;
-#endif
-  return false;
+  return (1 < num_threads && !S_ISREG (st->st_mode)
+          && out_before < 0 && out_after < 0 && !nqueries);
 }
 
+/* Emit CHUNK, the next one in input order, on behalf of the worker
+   with context CTX.  The caller holds stdin_chunks.lock.  */
 static void
-search_file (int dirdesc, char const *name, char const *path, bool follow,
-             bool command_line)
+emit_stdin_chunk (struct grepctx *ctx, struct stdin_chunk *chunk)
 {
-  int oflag = (O_RDONLY | O_NOCTTY
-               | (follow ? 0 : O_NOFOLLOW)
-               | (skip_devices (command_line) ? O_NONBLOCK : 0));
-  int desc = openat_safer (dirdesc, name, oflag);
-  if (desc < 0)
+  intmax_t left = max_count - stdin_chunks.count;
+
+  if (stdin_chunks.stop)
+    return;
+
+  lock_output ();
+  if (stdin_chunks.after_nulls && chunk->count && !out_quiet)
     {
-      if (follow || ! open_symlink_nofollow_error (errno))
-        suppressible_error (name, errno);
-      return;
+      /* Output after binary data is suppressed, as in grep ().  */
+      printf_errno (_("Binary file %s matches\n"), stdin_chunks.filename);
+      stdin_chunks.stop = true;
     }
-  search_desc (desc, path, command_line);
+  else if (chunk->count <= left)
+    {
+      fwrite_errno (chunk->out, 1, chunk->outlen);
+      stdin_chunks.count += chunk->count;
+      stdin_chunks.stop = (chunk->binary_matched
+                           || (done_on_match && stdin_chunks.count));
+    }
+  else
+    {
+      /* The chunk selected more lines than -m leaves room for, so
+         search it again, this time stopping at the limit.  */
+      bool locked = true;
+      struct stdin_chunk *chunk0 = ctx->chunk;
+      char const *filename = ctx->filename;
+
+      ctx->chunk = chunk;
+      ctx->filename = stdin_chunks.filename;
+      ctx->input_mem = chunk->data;
+      ctx->input_left = chunk->len;
+      ctx->input_totalcc = chunk->totalcc;
+      ctx->input_totalnl = chunk->totalnl;
+      ctx->out_max = left;
+      stdin_chunks.count += grep (ctx, -1, &chunk->st, pthread_self (),
+                                  &locked);
+      ctx->out_max = max_count;
+      ctx->input_totalcc = ctx->input_totalnl = 0;
+      ctx->filename = filename;
+      ctx->chunk = chunk0;
+      stdin_chunks.stop = true;
+    }
+  if (line_buffered)
+    fflush_errno ();
+  unlock_output ();
+
+  if (stdout_errno)
+    ts_error (EXIT_TROUBLE, stdout_errno, _("write error"));
+  stdin_chunks.after_nulls |= chunk->had_nulls;
 }
 
+/* Emit the chunks of standard input in input order as they are
+   searched, on behalf of the worker with context CTX.  That worker
+   took the workfile WF that stands for standard input as a whole, and
+   so has its output turn; holding the turn until the last chunk keeps
+   the output between that of the files before and after it.  */
 static void
-search_command_line_arg (char const *arg)
+emit_stdin_chunks (struct grepctx *ctx, struct workfile *wf, pthread_t ID,
+                   bool *locked)
 {
-  if (STREQ (arg, "-"))
-    search_desc (STDIN_FILENO, label ? label : _("(standard input)"), true);
-  else
-    search_file (AT_FDCWD, arg, arg, true, true);
+  wait_output_turn (ctx, ID, locked);
+
+  pthread_mutex_lock (&stdin_chunks.lock);
+  while (stdin_chunks.reading || stdin_chunks.in_flight)
+    {
+      struct stdin_chunk **p = &stdin_chunks.ready;
+      while (*p && (*p)->seq != stdin_chunks.next_seq)
+        p = &(*p)->next;
+      if (!*p)
+        {
+          pthread_cond_wait (&stdin_chunks.cond, &stdin_chunks.lock);
+          continue;
+        }
+      struct stdin_chunk *c = *p;
+      *p = c->next;
+      emit_stdin_chunk (ctx, c);
+      free (c->out);
+      free (c->data);
+      free (c);
+      stdin_chunks.next_seq++;
+      stdin_chunks.in_flight--;
+      pthread_cond_broadcast (&stdin_chunks.cond);
+    }
+
+  /* Report on the input as a whole.  */
+  struct grepctx summary;
+  memset (&summary, 0, sizeof summary);
+  summary.filename = stdin_chunks.filename;
+  print_file_summary (&summary, stdin_chunks.count);
+
+  stdin_chunks.emitting = false;
+  pthread_cond_broadcast (&stdin_chunks.cond);
+  pthread_mutex_unlock (&stdin_chunks.lock);
+  free (wf->chunk);
 }
 
-_Noreturn void usage (int);
-void
-usage (int status)
+/* Search the chunk of standard input in WF, and leave it to be
+   emitted in input order.  A chunk with a negative sequence number
+   instead stands for the input as a whole, whose output it emits.
+   Return the number of lines selected.  */
+static intmax_t
+grep_stdin_chunk (struct grepctx *ctx, struct workfile *wf, pthread_t ID,
+                  bool *locked)
 {
-  if (status != 0)
+  struct stdin_chunk *chunk = wf->chunk;
+  bool chunk_locked = false;
+  intmax_t count;
+
+  if (chunk->seq < 0)
     {
-      fprintf (stderr, _("Usage: %s [OPTION]... PATTERN [FILE]...\n"),
-               program_name);
-      fprintf (stderr, _("Try '%s --help' for more information.\n"),
-               program_name);
+      emit_stdin_chunks (ctx, wf, ID, locked);
+      return 0;
+    }
+
+  /* The chunk's output does not take a turn, so let others have it.  */
+  setNodeIdle (ID);
+
+  capture_stream = open_memstream (&chunk->out, &chunk->outlen);
+  if (!capture_stream)
+    xalloc_die ();
+  ctx->chunk = chunk;
+  ctx->input_totalcc = chunk->totalcc;
+  ctx->input_totalnl = chunk->totalnl;
+  count = chunk->count = grep (ctx, -1, &chunk->st, ID, &chunk_locked);
+  ctx->chunk = NULL;
+  ctx->input_totalcc = ctx->input_totalnl = 0;
+  if (fclose (capture_stream) != 0)
+    xalloc_die ();
+  capture_stream = NULL;
+
+  /* CHUNK now owns the data, which it needs if searched again.  */
+  wf->data = NULL;
+
+  pthread_mutex_lock (&stdin_chunks.lock);
+  chunk->next = stdin_chunks.ready;
+  stdin_chunks.ready = chunk;
+  pthread_cond_broadcast (&stdin_chunks.cond);
+  pthread_mutex_unlock (&stdin_chunks.lock);
+
+  return count;
+}
+
+/* Search standard input, which is named FILENAME and has status ST,
+   by slicing it into chunks for the workers.  */
+static void
+search_stdin_chunks (char const *filename, struct stat const *st)
+{
+  char *carry = NULL;
+  size_t carry_len = 0;
+  uintmax_t totalcc = 0;
+  uintmax_t totalnl = 0;
+  bool eof = false;
+
+  pthread_mutex_lock (&stdin_chunks.lock);
+  stdin_chunks.filename = filename;
+  stdin_chunks.next_seq = 0;
+  stdin_chunks.count = 0;
+  stdin_chunks.after_nulls = stdin_chunks.stop = false;
+  stdin_chunks.reading = stdin_chunks.emitting = true;
+  pthread_mutex_unlock (&stdin_chunks.lock);
+
+  /* Queue the input as a whole first, in its place among the files,
+     for whichever worker takes it to emit the chunks' output.  */
+  struct workfile *whole = xzalloc (sizeof *whole);
+  whole->fd = -1;
+  whole->path = xstrdup (filename);
+  whole->st = *st;
+  whole->chunk = xzalloc (sizeof *whole->chunk);
+  whole->chunk->seq = -1;
+  enqueue_work (whole);
+
+  for (intmax_t seq = 0; !eof; seq++)
+    {
+      bool stop;
+
+      /* Keep at most two chunks per worker in memory.  */
+      pthread_mutex_lock (&stdin_chunks.lock);
+      while (2 * num_threads <= stdin_chunks.in_flight && !stdin_chunks.stop)
+        pthread_cond_wait (&stdin_chunks.cond, &stdin_chunks.lock);
+      stop = stdin_chunks.stop;
+      pthread_mutex_unlock (&stdin_chunks.lock);
+      if (stop)
+        break;
+
+      /* Read until the chunk is full, or until it ends a line and no
+         more input is ready, so that a slow pipe is not held back.  */
+      size_t alloc = STDIN_CHUNK_SIZE + carry_len;
+      char *data = xmalloc (alloc);
+      char *eol_end = NULL;
+      size_t len = carry_len;
+      memcpy (data, carry, carry_len);
+      free (carry);
+      while (true)
+        {
+          struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+          if (len == alloc)
+            {
+              if (eol_end)
+                break;
+              data = x2nrealloc (data, &alloc, 1);
+            }
+          size_t n = safe_read (STDIN_FILENO, data + len, alloc - len);
+          if (n == SAFE_READ_ERROR)
+            {
+              suppressible_error (filename, errno);
+              n = 0;
+            }
+          if (n == 0)
+            {
+              eof = true;
+              break;
+            }
+          char *nl = memrchr (data + len, eolbyte, n);
+          len += n;
+          if (nl)
+            eol_end = nl + 1;
+          if (eol_end && len < alloc && poll (&pfd, 1, 0) == 0)
+            break;
+        }
+
+      size_t chunk_len = eof ? len : eol_end - data;
+      carry_len = len - chunk_len;
+      carry = xmemdup (data + chunk_len, carry_len);
+      if (!chunk_len)
+        {
+          free (data);
+          break;
+        }
+
+      struct stdin_chunk *chunk = xzalloc (sizeof *chunk);
+      chunk->seq = seq;
+      chunk->data = data;
+      chunk->len = chunk_len;
+      chunk->st = *st;
+      chunk->st.st_mode = S_IFREG | (st->st_mode & ~S_IFMT);
+      chunk->st.st_size = chunk_len;
+      chunk->totalcc = totalcc;
+      chunk->totalnl = totalnl;
+      totalcc += chunk_len;
+      if (out_line)
+        for (char const *p = data;
+             (p = memchr (p, eolbyte, data + chunk_len - p)); p++)
+          totalnl++;
+
+      struct workfile *wf = xmalloc (sizeof *wf);
+      wf->fd = -1;
+      wf->path = xstrdup (filename);
+      wf->st = chunk->st;
+      wf->data = data;
+      wf->datalen = chunk_len;
+      wf->chunk = chunk;
+
+      pthread_mutex_lock (&stdin_chunks.lock);
+      stdin_chunks.in_flight++;
+      pthread_mutex_unlock (&stdin_chunks.lock);
+      enqueue_work (wf);
+    }
+  free (carry);
+
+  /* Wait for the last chunk to be emitted.  */
+  pthread_mutex_lock (&stdin_chunks.lock);
+  stdin_chunks.reading = false;
+  pthread_cond_broadcast (&stdin_chunks.cond);
+  while (stdin_chunks.emitting)
+    pthread_cond_wait (&stdin_chunks.cond, &stdin_chunks.lock);
+  pthread_mutex_unlock (&stdin_chunks.lock);
+}
+
+/* Result cache.  With --result-cache=FILE, the number of lines a
+   search selects from a regular file is recorded in a hash table
+   shared through FILE by all workers and all grep processes using it,
+   keyed by the file's identity, size and modification time and by a
+   hash of the pattern and of the options that affect the count.
+   A file with a cached count is then not read at all, when the count
+   is zero or only the count matters (-c, -l, -L, -q).  */
+
+#define RESULT_CACHE_MAGIC "MTGRRES1"
+
+/* Slots per cache, and how many slots a file may occupy, starting
+   from the one its identity hashes to.  */
+enum { RESULT_CACHE_SLOTS = 1 << 16 };
+enum { RESULT_CACHE_PROBES = 16 };
+
+struct result_cache_header
+{
+  char magic[8];
+  uint64_t nslots;
+};
+
+/* SEQ is odd while the slot is being written; readers retry on
+   another slot if it is odd or changes under them.  OPTIONS is 0 in
+   a slot never used.  */
+struct result_slot
+{
+  uint64_t seq;
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_ns;
+  uint64_t options;
+  int64_t count;
+  uint64_t unused;
+};
+
+static char const *result_cache_name;
+static struct result_slot *result_slots;
+static uint64_t result_options_hash;
+
+/* Map the result cache, creating it if need be.  */
+static void
+open_result_cache (void)
+{
+  size_t size = (sizeof (struct result_cache_header)
+                 + RESULT_CACHE_SLOTS * sizeof (struct result_slot));
+  int fd = open (result_cache_name, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  struct stat st;
+  struct result_cache_header hdr;
+
+  if (fd < 0)
+    {
+      suppressible_error (result_cache_name, errno);
+      return;
+    }
+  if (flock (fd, LOCK_EX) != 0 || fstat (fd, &st) != 0)
+    {
+      suppressible_error (result_cache_name, errno);
+      close (fd);
+      return;
     }
+  if (st.st_size == 0)
+    {
+      memset (&hdr, 0, sizeof hdr);
+      memcpy (hdr.magic, RESULT_CACHE_MAGIC, sizeof hdr.magic);
+      hdr.nslots = RESULT_CACHE_SLOTS;
+      if (ftruncate (fd, size) != 0
+          || pwrite (fd, &hdr, sizeof hdr, 0) != sizeof hdr)
+        {
+          suppressible_error (result_cache_name, errno);
+          close (fd);
+          return;
+        }
+    }
+  else if (st.st_size != size
+           || pread (fd, &hdr, sizeof hdr, 0) != sizeof hdr
+           || memcmp (hdr.magic, RESULT_CACHE_MAGIC, sizeof hdr.magic) != 0
+           || hdr.nslots != RESULT_CACHE_SLOTS)
+    {
+      if (! suppress_errors)
+        ts_error (0, 0, _("%s: not a valid result cache; ignoring it"),
+                  quote (result_cache_name));
+      close (fd);
+      return;
+    }
+
+  void *map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    suppressible_error (result_cache_name, errno);
   else
+    result_slots = (struct result_slot *) ((char *) map + sizeof hdr);
+  close (fd);
+}
+
+/* Hash the patterns KEYS (of length KEYCC) and the options that
+   affect how many lines are selected.  */
+static void
+result_cache_prepare (char const *keys, size_t keycc)
+{
+  char const *m = matcher ? matcher : "grep";
+  char const *locale = setlocale (LC_CTYPE, NULL);
+  int64_t flags[] =
     {
-      printf (_("Usage: %s [OPTION]... PATTERN [FILE]...\n"), program_name);
-      printf (_("Search for PATTERN in each FILE or standard input.\n"));
-      printf (_("PATTERN is, by default, a basic regular expression (BRE).\n"));
-      printf (_("\
-Example: %s -i 'hello world' menu.h main.c\n\
-\n\
-Regexp selection and interpretation:\n"), program_name);
-      printf (_("\
-  -E, --extended-regexp     PATTERN is an extended regular expression (ERE)\n\
-  -F, --fixed-strings       PATTERN is a set of newline-separated strings\n\
-  -G, --basic-regexp        PATTERN is a basic regular expression (BRE)\n\
-  -P, --perl-regexp         PATTERN is a Perl regular expression\n"));
-  /* -X is deliberately undocumented.  */
-      printf (_("\
-  -e, --regexp=PATTERN      use PATTERN for matching\n\
-  -f, --file=FILE           obtain PATTERN from FILE\n\
-  -i, --ignore-case         ignore case distinctions\n\
-  -w, --word-regexp         force PATTERN to match only whole words\n\
-  -x, --line-regexp         force PATTERN to match only whole lines\n\
-  -z, --null-data           a data line ends in 0 byte, not newline\n"));
-      printf (_("\
-\n\
-Miscellaneous:\n\
-  -s, --no-messages         suppress error messages\n\
-  -v, --invert-match        select non-matching lines\n\
-  -M, --parallel=NUM        use NUM search threads\n\
-  -V, --version             display version information and exit\n\
-      --help                display this help text and exit\n"));
-      printf (_("\
-\n\
-Output control:\n\
-  -m, --max-count=NUM       stop after NUM matches\n\
-  -b, --byte-offset         print the byte offset with output lines\n\
-  -n, --line-number         print line number with output lines\n\
-      --line-buffered       flush output on every line\n\
-  -H, --with-filename       print the file name for each match\n\
-  -h, --no-filename         suppress the file name prefix on output\n\
-      --label=LABEL         use LABEL as the standard input file name prefix\n\
-"));
-      printf (_("\
-  -o, --only-matching       show only the part of a line matching PATTERN\n\
-  -q, --quiet, --silent     suppress all normal output\n\
-      --binary-files=TYPE   assume that binary files are TYPE;\n\
-                            TYPE is 'binary', 'text', or 'without-match'\n\
-  -a, --text                equivalent to --binary-files=text\n\
-"));
-      printf (_("\
-  -I                        equivalent to --binary-files=without-match\n\
-  -d, --directories=ACTION  how to handle directories;\n\
-                            ACTION is 'read', 'recurse', or 'skip'\n\
-  -D, --devices=ACTION      how to handle devices, FIFOs and sockets;\n\
-                            ACTION is 'read' or 'skip'\n\
-  -r, --recursive           like --directories=recurse\n\
-  -R, --dereference-recursive  likewise, but follow all symlinks\n\
-"));
-      printf (_("\
-      --include=FILE_PATTERN  search only files that match FILE_PATTERN\n\
-      --exclude=FILE_PATTERN  skip files and directories matching\
- FILE_PATTERN\n\
-      --exclude-from=FILE   skip files matching any file pattern from FILE\n\
-      --exclude-dir=PATTERN  directories that match PATTERN will be skipped.\n\
-"));
-      printf (_("\
-  -L, --files-without-match  print only names of FILEs containing no match\n\
-  -l, --files-with-matches  print only names of FILEs containing matches\n\
-  -c, --count               print only a count of matching lines per FILE\n\
-  -T, --initial-tab         make tabs line up (if needed)\n\
-  -Z, --null                print 0 byte after FILE name\n"));
-      printf (_("\
-\n\
-Context control:\n\
-  -B, --before-context=NUM  print NUM lines of leading context\n\
-  -A, --after-context=NUM   print NUM lines of trailing context\n\
-  -C, --context=NUM         print NUM lines of output context\n\
-"));
-      printf (_("\
-  -NUM                      same as --context=NUM\n\
-      --color[=WHEN],\n\
-      --colour[=WHEN]       use markers to highlight the matching strings;\n\
-                            WHEN is 'always', 'never', or 'auto'\n\
-  -U, --binary              do not strip CR characters at EOL (MSDOS/Windows)\n\
-  -u, --unix-byte-offsets   report offsets as if CRs were not there\n\
-                            (MSDOS/Windows)\n\
-\n"));
-      printf (_("\
-'egrep' means 'grep -E'.  'fgrep' means 'grep -F'.\n\
-Direct invocation as either 'egrep' or 'fgrep' is deprecated.\n"));
-      printf (_("\
-When FILE is -, read standard input.  With no FILE, read . if a command-line\n\
--r is given, - otherwise.  If fewer than two FILEs are given, assume -h.\n\
-Exit status is 0 if any line is selected, 1 otherwise;\n\
-if any error occurs and -q is not given, the exit status is 2.\n"));
-      emit_bug_reporting_address ();
+      match_icase, match_words, match_lines, out_invert, eolbyte,
+      binary_files, max_count, done_on_match, MB_CUR_MAX,
+      /* A binary file or an encoding error cuts a search short
+         unless -c asks for the full count.  */
+      count_matches, out_quiet
+    };
+  uint64_t h = hash_bytes (HASH_INIT, RESULT_CACHE_MAGIC,
+                           sizeof RESULT_CACHE_MAGIC);
+  h = hash_bytes (h, m, strlen (m) + 1);
+  h = hash_bytes (h, locale ? locale : "", locale ? strlen (locale) + 1 : 1);
+  h = hash_bytes (h, flags, sizeof flags);
+  h = hash_bytes (h, keys, keycc);
+
+  /* Zero marks an unused slot.  */
+  result_options_hash = h | 1;
+  open_result_cache ();
+}
+
+static int64_t
+result_mtime_ns (struct stat const *st)
+{
+  return st->st_mtim.tv_sec * (int64_t) 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static struct result_slot *
+result_slot (struct stat const *st, int probe)
+{
+  uint64_t h = hash_bytes (HASH_INIT, &st->st_dev, sizeof st->st_dev);
+  h = hash_bytes (h, &st->st_ino, sizeof st->st_ino);
+  return &result_slots[(h + probe) % RESULT_CACHE_SLOTS];
+}
+
+/* Return true if slot S, whose fields have been read into V, is
+   for the file with status ST.  */
+static bool
+result_slot_matches (struct result_slot const *v, struct stat const *st)
+{
+  return (v->options == result_options_hash
+          && v->dev == st->st_dev && v->ino == st->st_ino
+          && v->size == st->st_size && v->mtime_ns == result_mtime_ns (st));
+}
+
+/* Read slot S consistently into *V.  Return false if it is being
+   written.  */
+static bool
+result_slot_read (struct result_slot *s, struct result_slot *v)
+{
+  uint64_t seq = __atomic_load_n (&s->seq, __ATOMIC_ACQUIRE);
+  if (seq & 1)
+    return false;
+  v->dev = __atomic_load_n (&s->dev, __ATOMIC_RELAXED);
+  v->ino = __atomic_load_n (&s->ino, __ATOMIC_RELAXED);
+  v->size = __atomic_load_n (&s->size, __ATOMIC_RELAXED);
+  v->mtime_ns = __atomic_load_n (&s->mtime_ns, __ATOMIC_RELAXED);
+  v->options = __atomic_load_n (&s->options, __ATOMIC_RELAXED);
+  v->count = __atomic_load_n (&s->count, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+  return __atomic_load_n (&s->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/* If the cache knows how many lines the file with status ST selects,
+   store that number in *COUNT and return true.  */
+static bool
+result_cache_lookup (struct stat const *st, intmax_t *count)
+{
+  for (int i = 0; i < RESULT_CACHE_PROBES; i++)
+    {
+      struct result_slot v;
+      if (result_slot_read (result_slot (st, i), &v)
+          && result_slot_matches (&v, st))
+        {
+          *count = v.count;
+          return true;
+        }
+    }
+  return false;
+}
+
+/* Record that the file with status ST selects COUNT lines.  */
+static void
+result_cache_store (struct stat const *st, intmax_t count)
+{
+  /* A file modified this recently might change again without its
+     timestamp changing.  */
+  if (time (NULL) - 2 <= st->st_mtim.tv_sec)
+    return;
+
+  /* Reuse the file's old slot or an unused one; failing that, evict
+     a slot chosen by the file's modification time.  */
+  struct result_slot *s = NULL;
+  for (int i = 0; i < RESULT_CACHE_PROBES && !s; i++)
+    {
+      struct result_slot v;
+      struct result_slot *t = result_slot (st, i);
+      if (result_slot_read (t, &v)
+          && (result_slot_matches (&v, st) || v.options == 0
+              || (v.dev == st->st_dev && v.ino == st->st_ino
+                  && v.options == result_options_hash)))
+        s = t;
+    }
+  if (!s)
+    s = result_slot (st, result_mtime_ns (st) % RESULT_CACHE_PROBES);
+
+  uint64_t seq = __atomic_load_n (&s->seq, __ATOMIC_RELAXED);
+  if (seq & 1
+      || ! __atomic_compare_exchange_n (&s->seq, &seq, seq + 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+  __atomic_store_n (&s->dev, st->st_dev, __ATOMIC_RELAXED);
+  __atomic_store_n (&s->ino, st->st_ino, __ATOMIC_RELAXED);
+  __atomic_store_n (&s->size, st->st_size, __ATOMIC_RELAXED);
+  __atomic_store_n (&s->mtime_ns, result_mtime_ns (st), __ATOMIC_RELAXED);
+  __atomic_store_n (&s->options, result_options_hash, __ATOMIC_RELAXED);
+  __atomic_store_n (&s->count, count, __ATOMIC_RELAXED);
+  __atomic_store_n (&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* --reverse: search a regular file from its end back, a block at a
+   time, and output the selected lines last first, so that -m NUM
+   finds the last NUM of them without reading the rest of the file.  */
+static bool reverse;
+
+/* Return the number of line ends from BEG to LIM.  */
+static uintmax_t
+count_lines (char const *beg, char const *lim)
+{
+  return count_eols (beg, lim, eolbyte);
+}
+
+/* Return the number of line ends in the part of FD from BEG to END,
+   reading it into CTX's buffer.  */
+static uintmax_t
+count_input_lines (struct grepctx *ctx, int fd, off_t beg, off_t end)
+{
+  uintmax_t lines = 0;
+  clear_asan_poison (ctx);
+  for (off_t off = beg; off < end; )
+    {
+      ssize_t n = pread (fd, ctx->buffer, MIN (ctx->bufalloc, end - off),
+                         off);
+      if (n <= 0)
+        break;
+      lines += count_lines (ctx->buffer, ctx->buffer + n);
+      off += n;
+    }
+  return lines;
+}
+
+/* Read the block of input just before CTX->bufoffset, but not before
+   LO, into the buffer, followed by the SAVE bytes that began the
+   buffer before.  Those end a line that starts in the new block or
+   further back, just as the bytes fillbuf saves start a line that
+   ends further on.  SAVE is zero only for the block that ends the
+   input, whose last line gets a line end if it lacks one, as grep
+   gives it.  When we're done, 'bufbeg' and 'buflim' delimit the
+   buffer contents, and 'bufoffset' is the offset of 'bufbeg'.
+   Return false if there's an error.  */
+static bool
+fillbuf_backward (struct grepctx *ctx, size_t save, off_t lo)
+{
+  /* Leave a byte after the block for that line end.  */
+  char *readbuf = ALIGN_TO (ctx->buffer + 1, pagesize);
+  size_t room = ctx->buffer + ctx->bufalloc - sizeof (uword) - 1 - readbuf;
+
+  if (room < save + pagesize)
+    {
+      size_t newalloc = ctx->bufalloc;
+      while (newalloc < save + 2 * pagesize + sizeof (uword) + 1)
+        if (SIZE_MAX / 2 < newalloc)
+          xalloc_die ();
+        else
+          newalloc *= 2;
+      char *newbuf = xmalloc (newalloc);
+      readbuf = ALIGN_TO (newbuf + 1, pagesize);
+      room = newbuf + newalloc - sizeof (uword) - 1 - readbuf;
+      memcpy (readbuf, ctx->bufbeg, save);
+      free (ctx->buffer);
+      ctx->buffer = newbuf;
+      ctx->bufalloc = newalloc;
+      ctx->bufbeg = readbuf;
+    }
+
+  clear_asan_poison (ctx);
+  uintmax_t t = stats_start ();
+
+  /* Keep the reads aligned on a page boundary, except the first.  */
+  size_t readsize = room - save;
+  readsize -= readsize % pagesize;
+  off_t off = lo;
+  if (readsize < ctx->bufoffset - lo)
+    {
+      off = ctx->bufoffset - readsize;
+      off += (pagesize - off % pagesize) % pagesize;
+    }
+  size_t n = ctx->bufoffset - off;
+  memmove (readbuf + n, ctx->bufbeg, save);
+
+  for (size_t got = 0; got < n; )
+    {
+      ssize_t r = pread (ctx->bufdesc, readbuf + got, n - got, off + got);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        {
+          if (r == 0)
+            errno = 0;
+          stats_end (STAT_READ, t);
+          return false;
+        }
+      got += r;
+    }
+
+  ctx->bufbeg = readbuf;
+  ctx->bufbeg[-1] = eolbyte;
+  ctx->buflim = readbuf + n + save;
+  ctx->bufoffset = off;
+  if (!save && n && ctx->buflim[-1] != eolbyte)
+    *ctx->buflim++ = eolbyte;
+  if (thread_stats)
+    thread_stats->bytes += n;
+  stats_end (STAT_READ, t);
+
+  memset (ctx->buflim, 0, sizeof (uword));
+  asan_poison (ctx, ctx->buflim + sizeof (uword),
+               ctx->bufalloc - (ctx->buflim - ctx->buffer) - sizeof (uword));
+  return true;
+}
+
+/* Like grepbuf, but output the selected lines between BEG and LIM
+   last first.  *NL is the number of lines before LIM; if -n needs it,
+   update it to the number before BEG.  Return a count of lines
+   selected.  */
+static intmax_t
+grepbuf_backward (struct grepctx *ctx, char *beg, char *lim, uintmax_t *nl,
+                  pthread_t ID, bool *locked)
+{
+  char eol = eolbyte;
+  intmax_t outleft0 = ctx->outleft;
+  size_t nruns = 0;
+  char *cursor = lim;
+
+  /* The matchers search only forward, so find the runs of selected
+     lines first, then go back through them.  */
+  for (char *p = beg, *endp; p < lim; p = endp)
+    {
+      size_t match_size;
+      size_t match_offset = timed_execute (ctx, p, lim - p, &match_size, NULL);
+      if (match_offset == (size_t) -1)
+        {
+          if (!out_invert)
+            break;
+          match_offset = lim - p;
+          match_size = 0;
+        }
+      char *b = p + match_offset;
+      endp = b + match_size;
+      /* Avoid matching the empty line at the end of the buffer. */
+      if (!out_invert && b == lim)
+        break;
+      if (!out_invert || p < b)
+        {
+          if (nruns == ctx->runs_alloc)
+            ctx->runs = x2nrealloc (ctx->runs, &ctx->runs_alloc,
+                                    2 * sizeof *ctx->runs);
+          ctx->runs[2 * nruns] = out_invert ? p : b;
+          ctx->runs[2 * nruns + 1] = out_invert ? b : endp;
+          nruns++;
+        }
+    }
+
+  while (nruns--)
+    for (char *run = ctx->runs[2 * nruns], *end = ctx->runs[2 * nruns + 1];
+         run < end; )
+      {
+        char *line = memrchr (run, eol, end - 1 - run);
+        line = line ? line + 1 : run;
+        if (!ctx->out_quiet)
+          {
+            wait_output_turn (ctx, ID, locked);
+            if (out_line)
+              {
+                *nl -= count_lines (line, cursor);
+                cursor = line;
+                ctx->totalnl = *nl;
+                ctx->lastnl = line;
+              }
+            prline (ctx, line, end, SEP_CHAR_SELECTED);
+          }
+        end = line;
+        ctx->outleft--;
+        if (!ctx->outleft || ctx->done_on_match)
+          {
+            if (exit_on_match)
+              exit (errseen ? exit_failure : EXIT_SUCCESS);
+            return outleft0 - ctx->outleft;
+          }
+      }
+
+  if (out_line)
+    *nl -= count_lines (beg, cursor);
+  return outleft0 - ctx->outleft;
+}
+
+/* Return true if the input FD from offset BASE to HI starts with a
+   null byte within what searching forward reads first.  Read into
+   CTX's buffer.  */
+static bool
+first_block_has_nulls (struct grepctx *ctx, int fd, off_t base, off_t hi)
+{
+  ssize_t n = pread (fd, ctx->bufbeg, MIN (INITIAL_BUFSIZE, hi - base), base);
+  return 0 < n && buf_has_nulls (ctx->bufbeg, n);
+}
+
+/* Search the lines of the regular file FD, with status ST, from
+   offset HI back to offset LO, for --reverse.  The input starts at
+   BASE, from which byte offsets and line numbers count.  Return a
+   count of lines selected.  */
+static intmax_t
+grep_backward (struct grepctx *ctx, int fd, struct stat const *st,
+               off_t base, off_t lo, off_t hi, pthread_t ID, bool *locked)
+{
+  char eol = eolbyte;
+  char nul_zapper = '\0';
+  bool done_on_match_0 = ctx->done_on_match;
+  bool out_quiet_0 = ctx->out_quiet;
+  intmax_t nlines_first_null = -1;
+  intmax_t nlines = 0;
+  size_t save = 0;
+
+  ctx->read_error = false;
+  ctx->bufbeg = ctx->buflim = ALIGN_TO (ctx->buffer + 1, pagesize);
+  ctx->bufdesc = fd;
+  ctx->bufoffset = hi;
+  ctx->lastout = 0;
+  ctx->outleft = ctx->out_max;
+  ctx->after_last_match = hi;
+  ctx->pending = 0;
+  ctx->encoding_error_output = false;
+  ctx->line_head_prefix = -1;
+
+  /* Searching forward would see the start of the input, and any null
+     bytes in it, before printing anything; so look there first.  */
+  if (binary_files != TEXT_BINARY_FILES && eol
+      && (probe_binary (ctx, fd, st)
+          || first_block_has_nulls (ctx, fd, base, hi)))
+    {
+      if (binary_files == WITHOUT_MATCH_BINARY_FILES)
+        return 0;
+      if (!count_matches)
+        ctx->done_on_match = ctx->out_quiet = true;
+      nlines_first_null = 0;
+      nul_zapper = eol;
+    }
+
+  /* Line numbers need the count of the lines before those searched,
+     which is the one thing here that reads the whole input.  */
+  uintmax_t nl = out_line ? count_input_lines (ctx, fd, base, hi) : 0;
+
+  while (lo < ctx->bufoffset)
+    {
+      if (! fillbuf_backward (ctx, save, lo))
+        {
+          suppressible_error (ctx->filename, errno);
+          ctx->read_error = true;
+          break;
+        }
+      if (!save && ctx->buflim - ctx->bufbeg != hi - ctx->bufoffset)
+        nl++;
+
+      /* Unless the block starts the input, what precedes its first
+         line end may belong to a line that starts further back; save
+         that for the next block.  The buffer ends in a line end.  */
+      char *beg = ctx->bufbeg;
+      char *lim = ctx->buflim;
+      if (lo < ctx->bufoffset)
+        beg = (char *) memchr (beg, eol, lim - beg) + 1;
+      save = beg - ctx->bufbeg;
+      ctx->totalcc = ctx->bufoffset - base;
+
+      if (nlines_first_null < 0 && eol && binary_files != TEXT_BINARY_FILES
+          && buf_has_nulls (beg, lim - beg))
+        {
+          if (binary_files == WITHOUT_MATCH_BINARY_FILES)
+            break;
+          if (!count_matches)
+            ctx->done_on_match = ctx->out_quiet = true;
+          nlines_first_null = nlines;
+          nul_zapper = eol;
+        }
+      zap_nuls (beg, lim, nul_zapper);
+
+      if (beg < lim)
+        {
+          nlines += grepbuf_backward (ctx, beg, lim, &nl, ID, locked);
+          if (!ctx->outleft
+              || (ctx->done_on_match && MAX (0, nlines_first_null) < nlines))
+            break;
+        }
+    }
+
+  /* Leave the offset of standard input at the end of what was
+     searched, as searching forward would.  */
+  ctx->bufoffset = hi;
+  if (fd == STDIN_FILENO && lseek (fd, hi, SEEK_SET) < 0)
+    suppressible_error (ctx->filename, errno);
+
+  ctx->done_on_match = done_on_match_0;
+  ctx->out_quiet = out_quiet_0;
+  if (!ctx->out_quiet
+      && (ctx->encoding_error_output
+          || (0 <= nlines_first_null && nlines_first_null < nlines)))
+    {
+      wait_output_turn (ctx, ID, locked);
+      printf_errno (_("Binary file %s matches\n"), ctx->filename);
+      if (line_buffered)
+        fflush_errno ();
+    }
+  return nlines;
+}
+
+/* Search the regular file of WF with CTX from its end back, and
+   return the number of lines selected.  */
+static intmax_t
+grep_reverse (struct grepctx *ctx, struct workfile *wf, pthread_t ID,
+              bool *locked)
+{
+  int fd = wf->fd;
+  off_t base = fd == STDIN_FILENO ? lseek (fd, 0, SEEK_CUR) : 0;
+  if (base < 0 || wf->st.st_size < base)
+    return grep (ctx, fd, &wf->st, ID, locked);
+  return grep_backward (ctx, fd, &wf->st, base, base, wf->st.st_size,
+                        ID, locked);
+}
+
+/* --time-range=START,END: in a regular file whose lines start with
+   ISO 8601 timestamps in increasing order, search only the lines
+   stamped from START through END, found by binary search.  Stamps are
+   compared with START and END as strings, over their lengths, so that
+   a bound like 2024-05-01T13 stands for a whole hour.  A line that
+   does not start with a digit continues the entry before it.  An
+   empty bound leaves that end of the range open.  */
+enum { TIME_STAMP_MAX = 64 };
+static bool time_range;
+static char const *time_range_start, *time_range_end;
+static size_t time_range_start_len, time_range_end_len;
+
+/* Compare the line stamp STAMP of length LEN with the bound KEY of
+   length KEYLEN, looking no further into the stamp than KEYLEN.  */
+static int
+time_stamp_cmp (char const *stamp, size_t len, char const *key,
+                size_t keylen)
+{
+  int cmp = memcmp (stamp, key, MIN (len, keylen));
+  return cmp ? cmp : len < keylen ? -1 : 0;
+}
+
+/* Return the offset of the first line of FD that starts with a digit,
+   at or after POS and before LIM, or LIM if there is none.  Store up
+   to STAMP_SIZE bytes of the start of that line in STAMP, and their
+   number in *STAMP_LEN.  BASE is where the input starts, and so
+   starts a line.  Use CTX's buffer to read.  */
+static off_t
+next_stamped_line (struct grepctx *ctx, int fd, off_t base, off_t pos,
+                   off_t lim, char *stamp, size_t stamp_size,
+                   size_t *stamp_len)
+{
+  /* Read a page at a time, as the lines wanted are usually near.  */
+  bool line_start = pos == base;
+  off_t off = line_start ? pos : pos - 1;
+  char *buf = ctx->buffer;
+  while (off < lim)
+    {
+      ssize_t n = pread (fd, buf, MIN (pagesize, lim - off), off);
+      if (n <= 0)
+        break;
+      char *p = buf;
+      char *end = buf + n;
+      if (!line_start)
+        p = memchr (p, eolbyte, n);
+      while (p && (p += !line_start) < end)
+        {
+          line_start = false;
+          if (c_isdigit (to_uchar (*p)))
+            {
+              off_t line = off + (p - buf);
+              ssize_t m = pread (fd, stamp, MIN (stamp_size, lim - line),
+                                 line);
+              char *eol = 0 < m ? memchr (stamp, eolbyte, m) : NULL;
+              *stamp_len = eol ? eol - stamp : MAX (m, 0);
+              return line;
+            }
+          p = memchr (p, eolbyte, end - p);
+        }
+      line_start = p == end;
+      off += n;
+    }
+  return lim;
+}
+
+/* Return the offset of the first line of FD between BASE and LIM that
+   is stamped at or after KEY (of length KEYLEN), or strictly after it
+   if AFTER.  */
+static off_t
+time_range_bound (struct grepctx *ctx, int fd, off_t base, off_t lim,
+                  char const *key, size_t keylen, bool after)
+{
+  char stamp[TIME_STAMP_MAX];
+  size_t len;
+  off_t lo = base, hi = lim;
+  clear_asan_poison (ctx);
+
+  /* The first line at or after X that passes is a nondecreasing
+     function of X; find the least X for which there is one.  */
+  while (lo < hi)
+    {
+      off_t mid = lo + (hi - lo) / 2;
+      off_t line = next_stamped_line (ctx, fd, base, mid, lim, stamp,
+                                      keylen, &len);
+      int cmp = line < lim ? time_stamp_cmp (stamp, len, key, keylen) : 1;
+      if (after ? 0 < cmp : 0 <= cmp)
+        hi = mid;
+      else
+        lo = line + 1;
+    }
+  return (lo < lim
+          ? next_stamped_line (ctx, fd, base, lo, lim, stamp, 0, &len)
+          : lim);
+}
+
+/* Search the part of the regular file of WF that --time-range selects
+   with CTX, and return the number of lines selected.  */
+static intmax_t
+grep_time_range (struct grepctx *ctx, struct workfile *wf, pthread_t ID,
+                 bool *locked)
+{
+  int fd = wf->fd;
+  off_t base = fd == STDIN_FILENO ? lseek (fd, 0, SEEK_CUR) : 0;
+  off_t size = wf->st.st_size;
+  if (base < 0 || size < base)
+    return grep (ctx, fd, &wf->st, ID, locked);
+
+  off_t beg = (time_range_start_len
+               ? time_range_bound (ctx, fd, base, size, time_range_start,
+                                   time_range_start_len, false)
+               : base);
+  off_t end = (time_range_end_len
+               ? time_range_bound (ctx, fd, beg, size, time_range_end,
+                                   time_range_end_len, true)
+               : size);
+
+  if (reverse)
+    return grep_backward (ctx, fd, &wf->st, base, beg, end, ID, locked);
+
+  /* Count the lines skipped only if their number is shown.  */
+  uintmax_t skipped_lines = (out_line
+                             ? count_input_lines (ctx, fd, base, beg) : 0);
+
+  if (lseek (fd, beg, SEEK_SET) < 0)
+    {
+      suppressible_error (ctx->filename, errno);
+      ctx->read_error = true;
+      return 0;
+    }
+  ctx->input_mem = NULL;
+  ctx->input_left = end - beg;
+  ctx->input_totalcc = beg - base;
+  ctx->input_totalnl = skipped_lines;
+  intmax_t count = grep (ctx, fd, &wf->st, ID, locked);
+  ctx->input_left = -1;
+  ctx->input_totalcc = ctx->input_totalnl = 0;
+  return count;
+}
+
+/* Search the regular file of WF with CTX, through the result cache if
+   there is one, and return the number of lines selected.  */
+static intmax_t
+grep_cached (struct grepctx *ctx, struct workfile *wf, pthread_t ID,
+             bool *locked)
+{
+  bool cacheable = (result_slots && 0 <= wf->fd && wf->fd != STDIN_FILENO
+                    && !wf->data && S_ISREG (wf->st.st_mode) && !nqueries);
+  intmax_t count;
+
+  if (time_range && 0 <= wf->fd && !wf->data && S_ISREG (wf->st.st_mode))
+    return grep_time_range (ctx, wf, ID, locked);
+  if (reverse && 0 <= wf->fd && !wf->data && S_ISREG (wf->st.st_mode))
+    return grep_reverse (ctx, wf, ID, locked);
+
+  if (cacheable && result_cache_lookup (&wf->st, &count)
+      && (count == 0 || ctx->out_quiet))
+    {
+      if (count && exit_on_match)
+        exit (errseen ? exit_failure : EXIT_SUCCESS);
+      return count;
+    }
+
+  count = grep (ctx, wf->fd, &wf->st, ID, locked);
+  if (cacheable && !ctx->read_error)
+    result_cache_store (&wf->st, count);
+  return count;
+}
+
+static void *
+worker_thread_func (void *arg)
+{
+  struct workfile* wf;
+  struct grepctx ctx;
+  intmax_t count;
+  bool status = true;
+  bool l = false;
+  bool *locked; locked = &l;
+
+  memset (&ctx, 0, sizeof (ctx));
+  if (pagesize == 0 || 2 * pagesize + 1 <= pagesize)
+    abort ();
+  ctx.bufalloc = (ALIGN_TO (INITIAL_BUFSIZE, pagesize)
+                  + pagesize + sizeof (uword));
+  ctx.buffer = xmalloc (ctx.bufalloc);
+
+  ctx.out_quiet = out_quiet;
+  ctx.done_on_match = done_on_match;
+  ctx.out_max = max_count;
+  ctx.compiled_pattern = arg;
+  if (nqueries)
+    {
+      size_t set = __atomic_fetch_add (&query_sets_taken, 1,
+                                       __ATOMIC_RELAXED);
+      ctx.query_patterns = query_sets[set];
+      ctx.query_left = xnmalloc (nqueries, sizeof *ctx.query_left);
+      ctx.query_count = xnmalloc (nqueries, sizeof *ctx.query_count);
+    }
+
+#if WITH_GPERFTOOLS
+  if (profile_name)
+    ProfilerRegisterThread ();
+#endif
+
+  if (all_stats || all_traces)
+    {
+      int w = 1 + __atomic_fetch_add (&stats_workers, 1, __ATOMIC_RELAXED);
+      if (all_stats)
+        {
+          thread_stats = &all_stats[w];
+          thread_stats->start = stats_clock ();
+        }
+      if (all_traces)
+        thread_trace = &all_traces[w];
+    }
+
+  /* create node on loose queue */
+  struct node *n = (struct node*) malloc( sizeof( node ) );
+  n->ID = pthread_self(); n->idle = true; n->next = NULL; n->prev = NULL;
+  addNode( n );
+
+  while (( wf = dequeue_workfile (pthread_self()) ))
+    {
+      ctx.filename = wf->path;
+      ctx.input_mem = wf->data;
+      ctx.input_left = wf->data ? wf->datalen : -1;
+
+#if defined SET_BINARY
+      /* Set input to binary mode.  Pipes are simulated with files
+         on DOS, so this includes the case of "foo | grep bar".  */
+      if (0 <= wf->fd && !isatty (wf->fd))
+        SET_BINARY (wf->fd);
+#endif
+
+      uintmax_t start = thread_trace ? stats_clock () : 0;
+      if (wf->chunk)
+        count = grep_stdin_chunk (&ctx, wf, pthread_self (), locked);
+      else if (archive_workfile (wf))
+        {
+          count = grep_archive (&ctx, wf, pthread_self (), locked);
+          add_workqueue_producer (-1);
+        }
+      else
+        {
+          count = grep_cached (&ctx, wf, pthread_self (), locked);
+          print_file_summary (&ctx, count);
+        }
+      status = !count && status;
+      if (thread_stats)
+        thread_stats->files++;
+      if (thread_trace)
+        trace_span ("grep", start, stats_clock (), wf->path);
+
+      if (wf->fd == STDIN_FILENO)
+        {
+          off_t required_offset =
+            ctx.outleft ? ctx.bufoffset : ctx.after_last_match;
+          if (required_offset != ctx.bufoffset
+              && lseek (wf->fd, required_offset, SEEK_SET) < 0
+              && S_ISREG (wf->st.st_mode))
+            suppressible_error (wf->path, errno);
+        }
+
+      if (no_cache_pollution && 0 <= wf->fd && S_ISREG (wf->st.st_mode))
+        posix_fadvise (wf->fd, 0, 0, POSIX_FADV_DONTNEED);
+
+      if (0 <= wf->fd && wf->fd != STDIN_FILENO && close (wf->fd) != 0)
+        suppressible_error (wf->path, errno);
+      free (wf->data);
+      free (wf->path);
+      free (wf);
+      // only unlock if the lock has been placed
+      if( *locked )
+        unlock_output();
+      *locked = false;
+      
+    }
+  /* clean up memeory */
+  deleteNode( pthread_self() ); 
+  free (ctx.line_head);
+  free (ctx.runs);
+  free (ctx.query_left);
+  free (ctx.query_count);
+  if (thread_stats)
+    thread_stats->end = stats_clock ();
+  return (void *) status;
+}
+
+/* Print one row of the --stats table for S, labeled NAME.  The rate is
+   over ELAPSED nanoseconds.  */
+static void
+print_stats_row (char const *name, struct thread_stats const *s,
+                 uintmax_t elapsed)
+{
+  fprintf (stderr, "%-8s", name);
+  for (int i = 0; i < STAT_PHASES; i++)
+    fprintf (stderr, " %9.3f", s->ns[i] / 1e9);
+  fprintf (stderr, " %9ju %13ju %9.1f\n", s->files, s->bytes,
+           elapsed ? s->bytes / 1e6 / (elapsed / 1e9) : 0.0);
+}
+
+/* Report the --stats counters on standard error, in seconds.  */
+static void
+print_stats (void)
+{
+  struct thread_stats total;
+  memset (&total, 0, sizeof total);
+
+  fprintf (stderr, "%-8s", "thread");
+  for (int i = 0; i < STAT_PHASES; i++)
+    fprintf (stderr, " %9s", stat_phase_names[i]);
+  fprintf (stderr, " %9s %13s %9s\n", "files", "bytes", "MB/s");
+
+  for (int t = 0; t <= stats_workers; t++)
+    {
+      struct thread_stats const *s = &all_stats[t];
+      char name[INT_BUFSIZE_BOUND (int)];
+      if (t)
+        sprintf (name, "%d", t);
+      print_stats_row (t ? name : "main", s, s->end - s->start);
+      for (int i = 0; i < STAT_PHASES; i++)
+        total.ns[i] += s->ns[i];
+      total.files += s->files;
+      total.bytes += s->bytes;
+    }
+  print_stats_row ("total", &total, all_stats[0].end - all_stats[0].start);
+}
+
+/* Output S as a JSON string to STREAM.  */
+static void
+trace_json_string (FILE *stream, char const *s)
+{
+  putc ('"', stream);
+  for (; *s; s++)
+    {
+      unsigned char c = *s;
+      if (c == '"' || c == '\\')
+        fprintf (stream, "\\%c", c);
+      else if (c < ' ' || c == 0x7f)
+        fprintf (stream, "\\u%04x", c);
+      else
+        putc (c, stream);
+    }
+  putc ('"', stream);
+}
+
+/* Write the --trace rings to the trace file, in the Chrome trace event
+   format.  Times there are in microseconds.  */
+static void
+write_trace (void)
+{
+  FILE *stream = fopen (trace_name, "w");
+  if (!stream)
+    {
+      suppressible_error (trace_name, errno);
+      return;
+    }
+
+  fputs ("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n", stream);
+  for (int t = 0; t <= stats_workers; t++)
+    {
+      struct trace_ring const *r = &all_traces[t];
+      fprintf (stream, "%s{\"name\": \"thread_name\", \"ph\": \"M\","
+               " \"pid\": 1, \"tid\": %d, \"args\": {\"name\": ",
+               t ? ",\n" : "", t);
+      if (t)
+        fprintf (stream, "\"worker %d\"}}", t);
+      else
+        fputs ("\"main (traversal)\"}}", stream);
+
+      uintmax_t first = TRACE_RING_SIZE < r->count
+                        ? r->count - TRACE_RING_SIZE : 0;
+      for (uintmax_t i = first; i < r->count; i++)
+        {
+          struct trace_span const *s = &r->spans[i % TRACE_RING_SIZE];
+          fprintf (stream, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1,"
+                   " \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+                   s->name, t, (s->start - trace_epoch) / 1e3,
+                   (s->end - s->start) / 1e3);
+          if (s->file[0])
+            {
+              fputs (", \"args\": {\"file\": ", stream);
+              trace_json_string (stream, s->file);
+              putc ('}', stream);
+            }
+          putc ('}', stream);
+        }
+    }
+  fputs ("\n]}\n", stream);
+  if (ferror (stream) | fclose (stream))
+    suppressible_error (trace_name, errno);
+}
+
+/* Start the CPU profiler for --profile, first running grep afresh if
+   that is needed for the --profile-frequency rate to take effect.
+   ARGV is the command line as given, before any GREP_OPTIONS; it
+   cannot be run again if STDIN_READ, as standard input is used up.  */
+static void
+start_profiler (char **argv, bool stdin_read)
+{
+#if WITH_GPERFTOOLS
+  if (profile_frequency)
+    {
+      char rate[INT_BUFSIZE_BOUND (intmax_t)];
+      sprintf (rate, "%jd", profile_frequency);
+      char const *env = getenv ("CPUPROFILE_FREQUENCY");
+      if (env && STREQ (env, rate))
+        ;
+      else if (stdin_read)
+        ts_error (0, 0, _("warning: --profile-frequency ignored,"
+                          " as standard input has been read"));
+      else
+        {
+          /* A daemon would sample at its own rate, so search here.  */
+          setenv ("CPUPROFILE_FREQUENCY", rate, 1);
+          unsetenv ("GREP_DAEMON_SOCKET");
+          fflush (stdout);
+          execv ("/proc/self/exe", argv);
+          ts_error (0, errno, _("warning: --profile-frequency ignored"));
+        }
+    }
+  if (! ProfilerStart (profile_name))
+    ts_error (EXIT_TROUBLE, 0, _("%s: cannot start the CPU profiler"),
+              profile_name);
+#else
+  ts_error (EXIT_TROUBLE, 0,
+            _("--profile is not supported by this build of grep"));
+#endif
+}
+
+/* Report the --lock-stats counters on standard error.  */
+static void
+print_lock_stats (void)
+{
+  if (lock_stats_format == LOCK_STATS_JSON)
+    {
+      fputs ("{\"locks\": [", stderr);
+      for (int i = 0; i < NLOCKS; i++)
+        {
+          struct lock_stats const *s = &lock_stats[i];
+          fprintf (stderr, "%s\n  {\"name\": \"%s\", \"acquired\": %ju,"
+                   " \"contended\": %ju, \"wait_ns\": %ju,"
+                   " \"max_wait_ns\": %ju, \"hold_ns\": %ju,"
+                   " \"max_hold_ns\": %ju}",
+                   i ? "," : "", lock_names[i], s->acquired, s->contended,
+                   s->wait_ns, s->max_wait_ns, s->hold_ns, s->max_hold_ns);
+        }
+      fprintf (stderr, "],\n \"headNodeUpdate\": {\"wakeups\": %ju,"
+               " \"spurious\": %ju}}\n", head_wakeups, head_spurious);
+      return;
+    }
+
+  fprintf (stderr, "%-16s %10s %10s %10s %10s %10s %10s\n", "lock",
+           "acquired", "contended", "wait", "max wait", "hold", "max hold");
+  for (int i = 0; i < NLOCKS; i++)
+    {
+      struct lock_stats const *s = &lock_stats[i];
+      fprintf (stderr, "%-16s %10ju %10ju %10.6f %10.6f %10.6f %10.6f\n",
+               lock_names[i], s->acquired, s->contended, s->wait_ns / 1e9,
+               s->max_wait_ns / 1e9, s->hold_ns / 1e9, s->max_hold_ns / 1e9);
+    }
+  fprintf (stderr, "headNodeUpdate: %ju wakeups, %ju spurious\n",
+           head_wakeups, head_spurious);
+}
+
+/* Trigram index.  --build-index=FILE records, for each regular file
+   under the given trees, its identity and the set of byte trigrams it
+   contains.  Searches run with --index=FILE then skip any unchanged file
+   that lacks a trigram every match of the pattern must contain.  Files
+   that are new or have changed are searched regardless, and the index
+   is brought up to date for them afterwards without rereading the
+   others.  Trigrams are case-folded ASCII and never span a newline or
+   a null byte, so they serve every pattern whatever -i and -z say.  */
+
+#define INDEX_MAGIC "MTGRIDX1"
+
+struct index_header
+{
+  char magic[8];
+  uint64_t nfiles;
+  uint64_t ntrigrams;
+  uint64_t npostings;
+  uint64_t files_off;		/* struct index_file[nfiles] */
+  uint64_t trigrams_off;	/* struct index_trigram[ntrigrams] */
+  uint64_t postings_off;	/* uint32_t[npostings] */
+  uint64_t names_off;		/* null-terminated absolute file names */
+  uint64_t size;		/* size of the whole index */
+};
+
+/* Files are sorted by device and inode number.  A negative MTIME_SEC
+   means the file was too recently modified to trust its timestamp.  */
+struct index_file
+{
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t name_off;
+};
+
+/* Trigrams are sorted.  Each is followed by COUNT postings, the
+   ascending numbers of the files that contain it, starting at the
+   POSTINGS'th entry of the posting array.  */
+struct index_trigram
+{
+  uint32_t trigram;
+  uint32_t count;
+  uint64_t postings;
+};
+
+enum { TRIGRAM_BITS = 24 };
+
+static char const *index_name;	/* --index or --build-index FILE */
+static bool building_index;
+
+/* The index as found when grep started, mapped read-only.  */
+static struct
+{
+  void *map;
+  size_t size;
+  struct index_header const *hdr;
+  struct index_file const *files;
+  struct index_trigram const *trigrams;
+  uint32_t const *postings;
+  char const *names;
+  unsigned char *candidates;	/* files worth searching; NULL for all */
+  unsigned char *seen;		/* files met unchanged in this run */
+} idx;
+
+/* Names of the files met that are missing from the index or have
+   changed since it was written.  */
+static char **index_stale;
+static size_t index_nstale, index_stale_alloc;
+
+/* A growable array of trigrams.  */
+struct trigram_set
+{
+  uint32_t *v;
+  size_t n, alloc;
+};
+
+static void
+trigram_set_add (struct trigram_set *ts, uint32_t t)
+{
+  if (ts->n == ts->alloc)
+    ts->v = x2nrealloc (ts->v, &ts->alloc, sizeof *ts->v);
+  ts->v[ts->n++] = t;
+}
+
+static bool
+index_bit (unsigned char const *map, size_t n)
+{
+  return map[n / CHAR_BIT] >> (n % CHAR_BIT) & 1;
+}
+
+static void
+index_set_bit (unsigned char *map, size_t n)
+{
+  map[n / CHAR_BIT] |= 1 << (n % CHAR_BIT);
+}
+
+/* True if byte C can be part of an indexed trigram.  */
+static bool
+trigram_byte (unsigned char c)
+{
+  return c != '\n' && c != '\0';
+}
+
+static uint32_t
+trigram_of (unsigned char a, unsigned char b, unsigned char c)
+{
+  return (c_tolower (a) << 16) | (c_tolower (b) << 8) | c_tolower (c);
+}
+
+/* Add to TS the trigrams of the string LIT of length LEN.  */
+static void
+add_literal_trigrams (struct trigram_set *ts, char const *lit, size_t len)
+{
+  for (size_t i = 0; i + 3 <= len; i++)
+    trigram_set_add (ts, trigram_of (lit[i], lit[i + 1], lit[i + 2]));
+}
+
+static int
+uint32_cmp (void const *a, void const *b)
+{
+  uint32_t x = *(uint32_t const *) a, y = *(uint32_t const *) b;
+  return (x > y) - (x < y);
+}
+
+static int
+uint64_cmp (void const *a, void const *b)
+{
+  uint64_t x = *(uint64_t const *) a, y = *(uint64_t const *) b;
+  return (x > y) - (x < y);
+}
+
+/* Return the trigrams of the file open on FD, sorted and without
+   duplicates, and set *NTRI to their number.  Return NULL on a read
+   error, with errno set.  */
+static uint32_t *
+file_trigrams (int fd, size_t *ntri)
+{
+  static unsigned char *present;
+  if (!present)
+    present = xzalloc ((1 << TRIGRAM_BITS) / CHAR_BIT);
+  struct trigram_set ts = { NULL, 0, 0 };
+  char buf[65536];
+  uint32_t window = 0;
+  int valid = 0;
+  int err = 0;
+
+  for (;;)
+    {
+      size_t n = safe_read (fd, buf, sizeof buf);
+      if (n == SAFE_READ_ERROR)
+        {
+          err = errno;
+          break;
+        }
+      if (n == 0)
+        break;
+      for (size_t i = 0; i < n; i++)
+        {
+          unsigned char c = buf[i];
+          if (! trigram_byte (c))
+            {
+              valid = 0;
+              continue;
+            }
+          window = ((window << 8) | c_tolower (c)) & ((1 << TRIGRAM_BITS) - 1);
+          if (++valid >= 3 && ! index_bit (present, window))
+            {
+              index_set_bit (present, window);
+              trigram_set_add (&ts, window);
+            }
+        }
+    }
+
+  for (size_t i = 0; i < ts.n; i++)
+    present[ts.v[i] / CHAR_BIT] = 0;
+  if (err)
+    {
+      free (ts.v);
+      errno = err;
+      return NULL;
+    }
+  qsort (ts.v, ts.n, sizeof *ts.v, uint32_cmp);
+  *ntri = ts.n;
+  return ts.v ? ts.v : xmalloc (1);
+}
+
+/* Map the index named INDEX_NAME, if it exists and looks sound.  */
+static void
+load_index (void)
+{
+  int fd = open (index_name, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0)
+    {
+      if (errno != ENOENT)
+        suppressible_error (index_name, errno);
+      return;
+    }
+  if (fstat (fd, &st) != 0)
+    {
+      suppressible_error (index_name, errno);
+      close (fd);
+      return;
+    }
+
+  void *map = MAP_FAILED;
+  if (sizeof (struct index_header) <= st.st_size && st.st_size <= SIZE_MAX)
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+
+  struct index_header const *hdr = map;
+  size_t size = st.st_size;
+  if (map == MAP_FAILED
+      || memcmp (hdr->magic, INDEX_MAGIC, sizeof hdr->magic) != 0
+      || hdr->size != size
+      || hdr->files_off % 8 || hdr->trigrams_off % 8 || hdr->postings_off % 4
+      || size < hdr->files_off
+      || (size - hdr->files_off) / sizeof *idx.files < hdr->nfiles
+      || size < hdr->trigrams_off
+      || (size - hdr->trigrams_off) / sizeof *idx.trigrams < hdr->ntrigrams
+      || size < hdr->postings_off
+      || (size - hdr->postings_off) / sizeof *idx.postings < hdr->npostings
+      || size < hdr->names_off || UINT32_MAX < hdr->nfiles)
+    {
+      if (! suppress_errors)
+        ts_error (0, 0, _("%s: not a valid index; ignoring it"),
+                  quote (index_name));
+      if (map != MAP_FAILED)
+        munmap (map, size);
+      return;
+    }
+
+  idx.map = map;
+  idx.size = size;
+  idx.hdr = hdr;
+  idx.files = (struct index_file const *) ((char const *) map + hdr->files_off);
+  idx.trigrams = ((struct index_trigram const *)
+                  ((char const *) map + hdr->trigrams_off));
+  idx.postings = (uint32_t const *) ((char const *) map + hdr->postings_off);
+  idx.names = (char const *) map + hdr->names_off;
+  idx.seen = xzalloc (hdr->nfiles / CHAR_BIT + 1);
+}
+
+/* Return the postings of trigram T in the index, setting *COUNT to
+   their number; return NULL if no file has T.  */
+static uint32_t const *
+index_postings (uint32_t t, size_t *count)
+{
+  size_t lo = 0, hi = idx.hdr->ntrigrams;
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      struct index_trigram const *it = &idx.trigrams[mid];
+      if (it->trigram < t)
+        lo = mid + 1;
+      else if (t < it->trigram)
+        hi = mid;
+      else if (it->postings <= idx.hdr->npostings
+               && it->count <= idx.hdr->npostings - it->postings)
+        {
+          *count = it->count;
+          return idx.postings + it->postings;
+        }
+      else
+        break;
+    }
+  return NULL;
+}
+
+/* Mark as candidates the files that contain all the NTRI trigrams in
+   TRI.  */
+static void
+index_select (uint32_t const *tri, size_t ntri)
+{
+  struct list { uint32_t const *p; size_t n; } *lists
+    = xnmalloc (ntri, sizeof *lists);
+  size_t i, j;
+
+  /* Start from the rarest trigram and narrow the set down from there.  */
+  for (i = 0; i < ntri; i++)
+    {
+      lists[i].p = index_postings (tri[i], &lists[i].n);
+      if (!lists[i].p)
+        {
+          free (lists);
+          return;
+        }
+      for (j = i; 0 < j && lists[j].n < lists[j - 1].n; j--)
+        {
+          struct list tmp = lists[j];
+          lists[j] = lists[j - 1];
+          lists[j - 1] = tmp;
+        }
+    }
+
+  uint32_t *set = xnmalloc (lists[0].n + 1, sizeof *set);
+  size_t nset = lists[0].n;
+  memcpy (set, lists[0].p, nset * sizeof *set);
+  for (i = 1; i < ntri && nset; i++)
+    {
+      size_t k = 0, n = 0;
+      for (j = 0; j < nset; j++)
+        {
+          while (k < lists[i].n && lists[i].p[k] < set[j])
+            k++;
+          if (k == lists[i].n)
+            break;
+          if (lists[i].p[k] == set[j])
+            set[n++] = set[j];
+        }
+      nset = n;
+    }
+
+  for (j = 0; j < nset; j++)
+    if (set[j] < idx.hdr->nfiles)
+      index_set_bit (idx.candidates, set[j]);
+  free (set);
+  free (lists);
+}
+
+/* Skip the bracket expression starting at PAT[I], and return the
+   index just past it, or LEN if it is unterminated.  */
+static size_t
+skip_bracket (char const *pat, size_t len, size_t i)
+{
+  i++;
+  if (i < len && pat[i] == '^')
+    i++;
+  if (i < len && pat[i] == ']')
+    i++;
+  for (; i < len; i++)
+    if (pat[i] == '[' && i + 1 < len
+        && (pat[i + 1] == ':' || pat[i + 1] == '.' || pat[i + 1] == '='))
+      {
+        char delim = pat[i + 1];
+        for (i += 2; i + 1 < len; i++)
+          if (pat[i] == delim && pat[i + 1] == ']')
+            break;
+        i++;
+      }
+    else if (pat[i] == ']')
+      return i + 1;
+  return len;
+}
+
+/* Return the length of the operator at PAT[I] in a pattern of length
+   LEN, if it is one that EXTENDED (ERE, rather than BRE) syntax spells
+   as OP, e.g. '|' or '('; otherwise return 0.  */
+static size_t
+regex_operator (char const *pat, size_t len, size_t i, bool extended,
+                char op)
+{
+  if (extended)
+    return pat[i] == op;
+  return pat[i] == '\\' && i + 1 < len && pat[i + 1] == op ? 2 : 0;
+}
+
+/* Skip the parenthesized group or interval starting at PAT[I], which
+   is OPEN and ends with the matching CLOSE, and return the index just
+   past it.  */
+static size_t
+skip_group (char const *pat, size_t len, size_t i, bool extended,
+            char open, char close)
+{
+  int depth = 0;
+  while (i < len)
+    {
+      size_t n;
+      if (pat[i] == '[' && open == '(')
+        {
+          i = skip_bracket (pat, len, i);
+          continue;
+        }
+      if ((n = regex_operator (pat, len, i, extended, open)))
+        depth++;
+      else if ((n = regex_operator (pat, len, i, extended, close)))
+        {
+          if (--depth == 0)
+            return i + n;
+        }
+      else
+        n = pat[i] == '\\' && i + 1 < len ? 2 : 1;
+      i += n;
+    }
+  return len;
+}
+
+/* Return true if, with -i, the pattern character C matches only ASCII
+   characters, whose case the index folds.  Besides C's own case
+   variants, which are not ASCII for I in Turkish locales, Unicode
+   locales match K with KELVIN SIGN and S with LATIN SMALL LETTER
+   LONG S.  */
+static bool
+icase_ascii_only (unsigned char c)
+{
+  if (! c_isascii (c))
+    return false;
+  wint_t wc = btowc (c);
+  if (! c_isascii (towupper (wc)) || ! c_isascii (towlower (wc)))
+    return false;
+  return MB_CUR_MAX == 1 || (c_tolower (c) != 'k' && c_tolower (c) != 's');
+}
+
+/* Add to TS the trigrams of the literal strings that every match of the
+   branch PAT (of length LEN, free of top-level alternation) must
+   contain.  The branch is in BRE syntax, or in ERE if EXTENDED.
+   Anything not understood just ends the current literal, which keeps
+   the set conservative.  */
+static void
+branch_trigrams (struct trigram_set *ts, char const *pat, size_t len,
+                 bool extended)
+{
+  char *run = xmalloc (len + 1);
+  size_t rlen = 0;
+  size_t last = SIZE_MAX;	/* start of the last character in RUN */
+  mbstate_t mbs = { 0 };
+  size_t i = 0;
+
+  while (i < len)
+    {
+      unsigned char c = pat[i];
+      size_t n;
+      bool optional = false, repeated = false, literal = false;
+
+      if ((n = regex_operator (pat, len, i, extended, '(')))
+        i = skip_group (pat, len, i, extended, '(', ')');
+      else if ((n = regex_operator (pat, len, i, extended, '{')))
+        {
+          /* An interval might allow zero repetitions.  */
+          i = skip_group (pat, len, i, extended, '{', '}');
+          optional = true;
+        }
+      else if (c == '*'
+               || (n = regex_operator (pat, len, i, extended, '?')))
+        {
+          i += n ? n : 1;
+          optional = true;
+        }
+      else if ((n = regex_operator (pat, len, i, extended, '+')))
+        {
+          i += n;
+          repeated = true;
+        }
+      else if (c == '[')
+        i = skip_bracket (pat, len, i);
+      else if (c == '.' || c == '^' || c == '$')
+        i++;
+      else if (c == '\\')
+        {
+          /* Backreferences, anchors, and classes like \w end a literal;
+             other escaped characters stand for themselves.  */
+          if (i + 1 == len
+              || strchr ("123456789wWsSbB<>`'", pat[i + 1]))
+            i += 2;
+          else
+            {
+              i++;
+              literal = true;
+            }
+        }
+      else
+        literal = true;
+
+      if (literal)
+        {
+          size_t clen = mb_clen (pat + i, len - i, &mbs);
+          if ((size_t) -2 <= clen || clen == 0)
+            {
+              memset (&mbs, 0, sizeof mbs);
+              clen = 1;
+            }
+          /* Case variants of non-ASCII characters need not share bytes.  */
+          if (match_icase && (clen != 1 || ! icase_ascii_only (pat[i])))
+            {
+              add_literal_trigrams (ts, run, rlen);
+              rlen = 0;
+              last = SIZE_MAX;
+            }
+          else
+            {
+              last = rlen;
+              memcpy (run + rlen, pat + i, clen);
+              rlen += clen;
+            }
+          i += clen;
+          continue;
+        }
+
+      /* A repeated character is required, but what follows it need not
+         be adjacent to what precedes it.  An optional one is not
+         required at all.  */
+      size_t keep = optional && last != SIZE_MAX ? last : rlen;
+      add_literal_trigrams (ts, run, keep);
+      if (repeated && last != SIZE_MAX)
+        {
+          memmove (run, run + last, rlen - last);
+          rlen -= last;
+          last = 0;
+        }
+      else
+        {
+          rlen = 0;
+          last = SIZE_MAX;
+        }
+    }
+
+  add_literal_trigrams (ts, run, rlen);
+  free (run);
+}
+
+/* Work out from the newline-separated patterns KEYS (of length KEYCC)
+   which indexed files might match, and set idx.candidates accordingly.
+   Leave it null if every file must be searched.  */
+static void
+index_prepare (char const *keys, size_t keycc)
+{
+  char const *m = matcher ? matcher : "grep";
+  bool fixed = STREQ (m, "fgrep");
+  bool extended = STREQ (m, "egrep");
+
+  load_index ();
+  if (!idx.hdr || out_invert || count_matches
+      || list_files == LISTFILES_NONMATCHING
+      || ! (fixed || extended || STREQ (m, "grep")))
+    return;
+
+  unsigned char *candidates = xzalloc (idx.hdr->nfiles / CHAR_BIT + 1);
+  struct trigram_set ts = { NULL, 0, 0 };
+  char const *lim = keys + keycc;
+  char const *p = keys;
+
+  idx.candidates = candidates;
+  for (;;)
+    {
+      char const *nl = memchr (p, '\n', lim - p);
+      char const *end = nl ? nl : lim;
+      char const *b = p;
+
+      /* Each alternative of each pattern selects its own files.  */
+      for (char const *q = p; ; )
+        {
+          size_t n = 0;
+          if (q < end && !fixed)
+            {
+              if (*q == '[')
+                {
+                  q = p + skip_bracket (p, end - p, q - p);
+                  continue;
+                }
+              if (regex_operator (q, end - q, 0, extended, '('))
+                {
+                  q = p + skip_group (p, end - p, q - p, extended, '(', ')');
+                  continue;
+                }
+              n = regex_operator (q, end - q, 0, extended, '|');
+            }
+          if (q < end && !n)
+            {
+              q += *q == '\\' && !fixed && q + 1 < end ? 2 : 1;
+              continue;
+            }
+
+          ts.n = 0;
+          if (fixed)
+            {
+              for (char const *r = b; r < end; )
+                {
+                  char const *s = r;
+                  while (s < end
+                         && ! (match_icase && ! icase_ascii_only (*s)))
+                    s++;
+                  add_literal_trigrams (&ts, r, s - r);
+                  r = s + 1;
+                }
+            }
+          else
+            branch_trigrams (&ts, b, q - b, extended);
+          if (ts.n == 0)
+            {
+              /* Nothing is required; search every file.  */
+              idx.candidates = NULL;
+              free (candidates);
+              free (ts.v);
+              return;
+            }
+          qsort (ts.v, ts.n, sizeof *ts.v, uint32_cmp);
+          index_select (ts.v, ts.n);
+
+          if (q == end)
+            break;
+          q += n;
+          b = q;
+        }
+
+      if (!nl)
+        break;
+      p = nl + 1;
+    }
+  free (ts.v);
+}
+
+static bool
+index_entry_current (struct index_file const *f, struct stat const *st)
+{
+  return (0 <= f->mtime_sec && f->size == st->st_size
+          && f->mtime_sec == st->st_mtim.tv_sec
+          && f->mtime_nsec == st->st_mtim.tv_nsec);
+}
+
+/* Return the entry in the index for the file with status ST, or NULL.  */
+static struct index_file const *
+index_find (struct stat const *st)
+{
+  size_t lo = 0, hi = idx.hdr ? idx.hdr->nfiles : 0;
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      struct index_file const *f = &idx.files[mid];
+      if (f->dev < st->st_dev || (f->dev == st->st_dev && f->ino < st->st_ino))
+        lo = mid + 1;
+      else if (f->dev == st->st_dev && f->ino == st->st_ino)
+        return f;
+      else
+        hi = mid;
+    }
+  return NULL;
+}
+
+/* Return true if the regular file PATH with status ST should be
+   searched: it is new or changed, in which case it is also noted for
+   reindexing, or the index says it might match.  */
+static bool
+index_admits (char const *path, struct stat const *st)
+{
+  struct index_file const *f = index_find (st);
+  if (f && index_entry_current (f, st))
+    {
+      size_t n = f - idx.files;
+      index_set_bit (idx.seen, n);
+      return (!idx.candidates || index_bit (idx.candidates, n)
+              || (search_archives && is_tar_name (path)));
+    }
+
+  if (index_nstale == index_stale_alloc)
+    index_stale = x2nrealloc (index_stale, &index_stale_alloc,
+                              sizeof *index_stale);
+  index_stale[index_nstale++] = xstrdup (path);
+  return true;
+}
+
+/* A file to be written to the new index.  */
+struct index_entry
+{
+  struct index_file f;
+  char *name;
+  size_t old;			/* number in the old index, or SIZE_MAX */
+  uint32_t *tri;		/* trigrams of a file read afresh */
+  size_t ntri;
+};
+
+static int
+index_entry_cmp (void const *a, void const *b)
+{
+  struct index_file const *x = a, *y = b;
+  if (x->dev != y->dev)
+    return x->dev < y->dev ? -1 : 1;
+  return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+/* Return the absolute form of the file name NAME, relative to the
+   working directory CWD.  */
+static char *
+index_absolute_name (char const *cwd, char const *name)
+{
+  if (*name == '/' || !cwd)
+    return xstrdup (name);
+  while (name[0] == '.' && name[1] == '/')
+    for (name += 2; *name == '/'; name++)
+      continue;
+  size_t cwdlen = strlen (cwd);
+  char *r = xmalloc (cwdlen + strlen (name) + 2);
+  strcpy (stpcpy (stpcpy (r, cwd), cwdlen && cwd[cwdlen - 1] == '/'
+                  ? "" : "/"), name);
+  return r;
+}
+
+/* Write out the index.  Entries of the old index that were seen
+   unchanged keep their trigrams; stale files are read afresh.  Other
+   old entries are dropped if DROP_UNSEEN, and otherwise kept as long
+   as their files are still there unchanged.  The new index replaces
+   the old one atomically.  */
+static void
+write_index (bool drop_unseen)
+{
+  size_t nold = idx.hdr ? idx.hdr->nfiles : 0;
+  struct index_entry *e = xnmalloc (nold + index_nstale + 1, sizeof *e);
+  size_t ne = 0, i, j;
+  char *cwd = getcwd (NULL, 0);
+  time_t now = time (NULL);
+
+  for (i = 0; i < nold; i++)
+    {
+      struct index_file const *f = &idx.files[i];
+      char const *name = idx.names + f->name_off;
+      if (idx.hdr->names_off + f->name_off >= idx.size
+          || ! memchr (name, '\0', idx.size - idx.hdr->names_off - f->name_off))
+        continue;
+      if (! index_bit (idx.seen, i))
+        {
+          struct stat st;
+          if (drop_unseen || stat (name, &st) != 0
+              || f->dev != st.st_dev || f->ino != st.st_ino
+              || ! index_entry_current (f, &st))
+            continue;
+        }
+      e[ne].f = *f;
+      e[ne].name = xstrdup (name);
+      e[ne].old = i;
+      e[ne].tri = NULL;
+      e[ne].ntri = 0;
+      ne++;
+    }
+
+  for (i = 0; i < index_nstale; i++)
+    {
+      char const *name = index_stale[i];
+      int fd = open (name, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+      struct stat st;
+      uint32_t *tri;
+      if (fd < 0)
+        {
+          suppressible_error (name, errno);
+          continue;
+        }
+      if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode)
+          || ! (tri = file_trigrams (fd, &e[ne].ntri)))
+        {
+          if (errno)
+            suppressible_error (name, errno);
+          close (fd);
+          continue;
+        }
+      close (fd);
+      e[ne].f.dev = st.st_dev;
+      e[ne].f.ino = st.st_ino;
+      e[ne].f.size = st.st_size;
+      /* A file modified within the timestamp's granularity of now could
+         change again without its timestamp changing; check it next time.  */
+      e[ne].f.mtime_sec = now - 1 <= st.st_mtim.tv_sec ? -1 : st.st_mtim.tv_sec;
+      e[ne].f.mtime_nsec = st.st_mtim.tv_nsec;
+      e[ne].name = index_absolute_name (cwd, name);
+      e[ne].old = SIZE_MAX;
+      e[ne].tri = tri;
+      ne++;
+    }
+  free (cwd);
+
+  /* Sort, and keep one entry per file, preferring fresh trigrams.  */
+  qsort (e, ne, sizeof *e, index_entry_cmp);
+  for (i = j = 0; i < ne; i++)
+    if (j && index_entry_cmp (&e[j - 1].f, &e[i].f) == 0)
+      {
+        struct index_entry *loser = e[i].tri ? &e[j - 1] : &e[i];
+        free (loser->name);
+        free (loser->tri);
+        if (loser == &e[j - 1])
+          e[j - 1] = e[i];
+      }
+    else
+      e[j++] = e[i];
+  ne = j;
+  if (UINT32_MAX < ne)
+    xalloc_die ();
+
+  /* Gather (trigram, file number) pairs and sort them, which sorts
+     each trigram's postings too.  */
+  uint32_t *renumber = xnmalloc (nold + 1, sizeof *renumber);
+  size_t npairs = 0, pairs_alloc = 0;
+  uint64_t *pairs = NULL;
+  for (i = 0; i < nold; i++)
+    renumber[i] = UINT32_MAX;
+  for (i = 0; i < ne; i++)
+    if (e[i].old != SIZE_MAX)
+      renumber[e[i].old] = i;
+  for (i = 0; nold && i < idx.hdr->ntrigrams; i++)
+    {
+      size_t count;
+      uint32_t t = idx.trigrams[i].trigram;
+      uint32_t const *p = index_postings (t, &count);
+      for (j = 0; p && j < count; j++)
+        if (p[j] < nold && renumber[p[j]] != UINT32_MAX)
+          {
+            if (npairs == pairs_alloc)
+              pairs = x2nrealloc (pairs, &pairs_alloc, sizeof *pairs);
+            pairs[npairs++] = (uint64_t) t << 32 | renumber[p[j]];
+          }
+    }
+  free (renumber);
+  for (i = 0; i < ne; i++)
+    for (j = 0; j < e[i].ntri; j++)
+      {
+        if (npairs == pairs_alloc)
+          pairs = x2nrealloc (pairs, &pairs_alloc, sizeof *pairs);
+        pairs[npairs++] = (uint64_t) e[i].tri[j] << 32 | i;
+      }
+  qsort (pairs, npairs, sizeof *pairs, uint64_cmp);
+
+  size_t ntri = 0;
+  for (i = 0; i < npairs; i++)
+    ntri += !i || pairs[i] >> 32 != pairs[i - 1] >> 32;
+
+  struct index_header hdr;
+  memset (&hdr, 0, sizeof hdr);
+  memcpy (hdr.magic, INDEX_MAGIC, sizeof hdr.magic);
+  hdr.nfiles = ne;
+  hdr.ntrigrams = ntri;
+  hdr.npostings = npairs;
+  hdr.files_off = sizeof hdr;
+  hdr.trigrams_off = hdr.files_off + ne * sizeof (struct index_file);
+  hdr.postings_off = hdr.trigrams_off + ntri * sizeof (struct index_trigram);
+  hdr.names_off = hdr.postings_off + npairs * sizeof (uint32_t);
+  uint64_t name_off = 0;
+  for (i = 0; i < ne; i++)
+    {
+      e[i].f.name_off = name_off;
+      name_off += strlen (e[i].name) + 1;
+    }
+  hdr.size = hdr.names_off + name_off;
+
+  size_t tmplen = strlen (index_name) + INT_BUFSIZE_BOUND (intmax_t) + 2;
+  char *tmp = xmalloc (tmplen);
+  snprintf (tmp, tmplen, "%s.%jd", index_name, (intmax_t) getpid ());
+  FILE *out = fopen (tmp, "wbe");
+  if (out)
+    {
+      fwrite (&hdr, sizeof hdr, 1, out);
+      for (i = 0; i < ne; i++)
+        fwrite (&e[i].f, sizeof e[i].f, 1, out);
+      for (i = 0; i < npairs; )
+        {
+          struct index_trigram it;
+          it.trigram = pairs[i] >> 32;
+          it.postings = i;
+          for (j = i; j < npairs && pairs[j] >> 32 == it.trigram; j++)
+            continue;
+          it.count = j - i;
+          fwrite (&it, sizeof it, 1, out);
+          i = j;
+        }
+      for (i = 0; i < npairs; i++)
+        {
+          uint32_t num = pairs[i];
+          fwrite (&num, sizeof num, 1, out);
+        }
+      for (i = 0; i < ne; i++)
+        fwrite (e[i].name, strlen (e[i].name) + 1, 1, out);
+    }
+  if (!out || ferror (out) | (fclose (out) != 0)
+      || rename (tmp, index_name) != 0)
+    {
+      suppressible_error (index_name, errno);
+      if (out)
+        unlink (tmp);
+    }
+  free (tmp);
+
+  free (pairs);
+  for (i = 0; i < ne; i++)
+    {
+      free (e[i].name);
+      free (e[i].tri);
+    }
+  free (e);
+}
+
+/* Bring the index up to date after a search, if anything changed.  */
+static void
+refresh_index (void)
+{
+  if (index_nstale)
+    write_index (false);
+}
+
+/* Ignore files.  With --gitignore, a recursive search skips .git
+   directories and whatever the .gitignore and .ignore files it meets
+   (and .git/info/exclude, next to a .git directory) say to ignore,
+   with the usual precedence: a deeper file overrides a shallower one,
+   .ignore overrides .gitignore, and within a file the last matching
+   pattern wins.  Ignored directories are never opened.  */
+
+static bool vcs_ignore;
+
+static char const *const ignore_file_names[] =
+{
+  ".git/info/exclude", ".gitignore", ".ignore", NULL
+};
+
+struct ignore_rule
+{
+  char *pattern;		/* Without any '!', leading '/' or trailing '/'.  */
+  bool negated;			/* Re-include what matches.  */
+  bool dir_only;		/* Match only directories.  */
+  bool anchored;		/* Match the path relative to the directory
+                                   of the ignore file, not the last
+                                   component.  */
+};
+
+/* The rules of the ignore files in one directory, chained to those of
+   the directories above it.  */
+struct ignore_rules
+{
+  struct ignore_rules *parent;
+  size_t base_len;		/* Length of the directory's name plus '/'.  */
+  ptrdiff_t level;		/* Depth of the directory in its walk.  */
+  struct ignore_rule *rule;
+  size_t nrules, rules_alloc;
+};
+
+/* Return true if the glob P matches the string S.  '*' and '?' do not
+   match '/'; "**" as a whole path component matches any number of
+   components.  P0 is the start of the whole pattern.  */
+static bool
+ignore_glob (char const *p0, char const *p, char const *s)
+{
+  while (*p)
+    {
+      if (p[0] == '*' && p[1] == '*' && (p == p0 || p[-1] == '/')
+          && (!p[2] || p[2] == '/'))
+        {
+          if (!p[2])
+            return true;
+          for (p += 3; ; s++)
+            {
+              if (ignore_glob (p0, p, s))
+                return true;
+              s = strchr (s, '/');
+              if (!s)
+                return false;
+            }
+        }
+      if (*p == '*')
+        {
+          while (*p == '*')
+            p++;
+          for (; ; s++)
+            {
+              if (ignore_glob (p0, p, s))
+                return true;
+              if (!*s || *s == '/')
+                return false;
+            }
+        }
+      if (!*s)
+        return false;
+      if (*p == '[')
+        {
+          char const *end = p + 1;
+          if (*end == '!' || *end == '^')
+            end++;
+          if (*end == ']')
+            end++;
+          end = strchr (end, ']');
+          if (end && *s != '/')
+            {
+              char bracket[256];
+              char c[2] = { *s, '\0' };
+              size_t len = end + 1 - p;
+              if (len < sizeof bracket)
+                {
+                  memcpy (bracket, p, len);
+                  bracket[len] = '\0';
+                  if (bracket[1] == '^')
+                    bracket[1] = '!';
+                  if (fnmatch (bracket, c, 0) != 0)
+                    return false;
+                  p = end + 1;
+                  s++;
+                  continue;
+                }
+            }
+        }
+      if (*p == '?')
+        {
+          if (*s == '/')
+            return false;
+        }
+      else
+        {
+          if (*p == '\\' && p[1])
+            p++;
+          if (*p != *s)
+            return false;
+        }
+      p++;
+      s++;
+    }
+  return !*s;
+}
+
+/* Add to RULES the patterns in the ignore file FILE in the directory
+   open on DIRFD.  */
+static void
+read_ignore_file (struct ignore_rules *rules, int dirfd, char const *file)
+{
+  int fd = openat (dirfd, file, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  char *buf = NULL;
+  size_t len = 0, alloc = 0;
+  for (;;)
+    {
+      if (alloc - len < 8192)
+        {
+          alloc += 8192;
+          buf = xrealloc (buf, alloc);
+        }
+      size_t n = safe_read (fd, buf + len, alloc - len - 1);
+      if (n == SAFE_READ_ERROR || n == 0)
+        break;
+      len += n;
+    }
+  close (fd);
+  if (!buf)
+    return;
+  buf[len] = '\0';
+
+  for (char *line = buf, *next; line < buf + len; line = next)
+    {
+      char *end = memchr (line, '\n', buf + len - line);
+      if (!end)
+        end = buf + len;
+      next = end + 1;
+      if (line < end && end[-1] == '\r')
+        end--;
+      /* Trailing spaces do not count unless escaped.  */
+      while (line < end && end[-1] == ' '
+             && ! (line < end - 1 && end[-2] == '\\'))
+        end--;
+      *end = '\0';
+      if (!*line || *line == '#')
+        continue;
+
+      struct ignore_rule r = { NULL, false, false, false };
+      if (*line == '!')
+        {
+          r.negated = true;
+          line++;
+        }
+      if (line < end && end[-1] == '/')
+        {
+          r.dir_only = true;
+          *--end = '\0';
+        }
+      r.anchored = strchr (line, '/') != NULL;
+      if (*line == '/')
+        line++;
+      if (!*line)
+        continue;
+      r.pattern = xstrdup (line);
+
+      if (rules->nrules == rules->rules_alloc)
+        rules->rule = x2nrealloc (rules->rule, &rules->rules_alloc,
+                                  sizeof *rules->rule);
+      rules->rule[rules->nrules++] = r;
+    }
+  free (buf);
+}
+
+/* Return the rules that apply within the directory named NAME
+   relative to DIRFD, named PATH in the walk and at depth LEVEL, given
+   the rules PARENT that apply to it.  The result is PARENT itself if
+   the directory has no ignore files.  HAS_IGNORE_FILES is false if the
+   caller knows the directory has none.  */
+static struct ignore_rules *
+enter_ignore_dir (int dirfd, char const *name, char const *path,
+                  ptrdiff_t level, struct ignore_rules *parent,
+                  bool has_ignore_files)
+{
+  if (!has_ignore_files)
+    return parent;
+
+  int fd = openat (dirfd, name, (O_RDONLY | O_NOCTTY | O_DIRECTORY
+                                 | O_CLOEXEC));
+  if (fd < 0)
+    return parent;
+
+  struct ignore_rules *rules = xzalloc (sizeof *rules);
+  for (char const *const *f = ignore_file_names; *f; f++)
+    read_ignore_file (rules, fd, *f);
+  close (fd);
+  if (!rules->nrules)
+    {
+      free (rules);
+      return parent;
+    }
+
+  size_t len = strlen (path);
+  rules->parent = parent;
+  rules->base_len = len - (len && path[len - 1] == '/') + 1;
+  rules->level = level;
+  return rules;
+}
+
+/* Free RULES if they belong to the directory at depth LEVEL.  */
+static void
+leave_ignore_dir (struct ignore_rules *rules, ptrdiff_t level)
+{
+  if (rules && rules->level == level)
+    {
+      for (size_t i = 0; i < rules->nrules; i++)
+        free (rules->rule[i].pattern);
+      free (rules->rule);
+      free (rules);
+    }
+}
+
+/* Return true if RULES say to skip the entry named PATH in the walk,
+   whose last component is NAME.  IS_DIR says whether it is a
+   directory.  */
+static bool
+ignored_entry (struct ignore_rules const *rules, char const *path,
+               char const *name, bool is_dir)
+{
+  if (is_dir && STREQ (name, ".git"))
+    return true;
+  for (; rules; rules = rules->parent)
+    {
+      char const *rel = path + rules->base_len;
+      if (strlen (path) < rules->base_len)
+        continue;
+      for (size_t i = rules->nrules; i-- != 0; )
+        {
+          struct ignore_rule const *r = &rules->rule[i];
+          if ((is_dir || !r->dir_only)
+              && ignore_glob (r->pattern, r->pattern,
+                              r->anchored ? rel : name))
+            return !r->negated;
+        }
+    }
+  return false;
+}
+
+/* Walk cache.  With --walk-cache=FILE, recursive searches (-r) remember
+   each directory's modification time together with those of its
+   entries that survived the --include, --exclude, --exclude-dir and
+   device filters.  A directory whose modification time is unchanged is
+   replayed from the cache, without reading it or checking the types of
+   its entries.  The cache records a hash of the filtering options and is
+   ignored altogether when that differs.  */
+
+#define WALK_CACHE_MAGIC "MTGRWLK2"
+
+struct walk_cache_header
+{
+  char magic[8];
+  uint64_t options;		/* hash of the filtering options */
+  uint64_t ndirs;
+};
+
+/* A directory record is a struct walk_dir, then the directory's
+   null-terminated absolute name, then its entries, each a type byte
+   ('d' or 'f') followed by a null-terminated name.  Records are padded
+   to a multiple of 8 bytes; SIZE includes the padding.  A negative
+   MTIME_SEC means the directory was too recently modified to trust.  */
+struct walk_dir
+{
+  uint64_t dev;
+  uint64_t ino;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t size;
+  uint64_t nentries;
+  uint64_t flags;
+};
+
+/* Flags of a directory record.  The directory has a file named like
+   an ignore file or a .git directory, whether or not it is listed.  */
+enum { WALK_DIR_IGNORE_FILES = 1 };
+
+static char const *walk_cache_name;
+static uint64_t walk_options_hash = HASH_INIT;
+
+/* The cache as found when grep started.  */
+static struct
+{
+  char *map;
+  size_t size;
+  size_t *recs;			/* offsets of the directory records */
+  size_t nrecs;
+  size_t *slots;		/* hash table of record numbers plus 1 */
+  size_t nslots;
+  unsigned char *visited;
+} walk_old;
+
+/* The cache being written, less its header.  */
+static struct
+{
+  char *buf;
+  size_t len, alloc;
+  uint64_t ndirs;
+} walk_new;
+
+/* Absolute names of the trees walked in this run.  */
+static char **walk_roots;
+static size_t walk_nroots, walk_roots_alloc;
+
+/* A directory being walked, to detect loops.  */
+struct walk_ancestor
+{
+  dev_t dev;
+  ino_t ino;
+  struct walk_ancestor const *up;
+  ptrdiff_t level;
+  struct ignore_rules *rules;	/* With --gitignore, the rules within it.  */
+};
+
+/* Mix option OPT with argument ARG into the filtering options hash.  */
+static void
+walk_hash_option (int opt, char const *arg)
+{
+  walk_options_hash = hash_bytes (walk_options_hash, &opt, sizeof opt);
+  walk_options_hash = hash_bytes (walk_options_hash, arg, strlen (arg) + 1);
+}
+
+static char const *
+walk_dir_name (struct walk_dir const *d)
+{
+  return (char const *) (d + 1);
+}
+
+/* Return true if the record of SIZE bytes at D is well formed.  */
+static bool
+walk_dir_sound (struct walk_dir const *d, size_t size)
+{
+  char const *p = walk_dir_name (d);
+  char const *lim = (char const *) d + size;
+  if (size < sizeof *d || d->size != size)
+    return false;
+  for (uint64_t i = 0; i <= d->nentries; i++)
+    {
+      if (i && (p == lim || (*p != 'd' && *p != 'f') || ! *++p))
+        return false;
+      char const *nul = memchr (p, '\0', lim - p);
+      if (!nul)
+        return false;
+      p = nul + 1;
+    }
+  return true;
+}
+
+/* Map the walk cache, if it exists and was made with the same
+   filtering options.  */
+static void
+load_walk_cache (void)
+{
+  int fd = open (walk_cache_name, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0)
+    {
+      if (errno != ENOENT)
+        suppressible_error (walk_cache_name, errno);
+      return;
+    }
+  char *map = MAP_FAILED;
+  if (fstat (fd, &st) == 0
+      && sizeof (struct walk_cache_header) <= st.st_size
+      && st.st_size <= SIZE_MAX)
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return;
+
+  struct walk_cache_header const *hdr = (struct walk_cache_header const *) map;
+  size_t size = st.st_size;
+  if (memcmp (hdr->magic, WALK_CACHE_MAGIC, sizeof hdr->magic) != 0
+      || hdr->options != walk_options_hash
+      || (size - sizeof *hdr) / sizeof (struct walk_dir) < hdr->ndirs)
+    {
+      munmap (map, size);
+      return;
+    }
+
+  walk_old.map = map;
+  walk_old.size = size;
+  walk_old.recs = xnmalloc (hdr->ndirs + 1, sizeof *walk_old.recs);
+  for (size_t off = sizeof *hdr; walk_old.nrecs < hdr->ndirs; )
+    {
+      struct walk_dir const *d = (struct walk_dir const *) (map + off);
+      if (size - off < sizeof *d || d->size % 8 || size - off < d->size
+          || ! walk_dir_sound (d, d->size))
+        break;
+      walk_old.recs[walk_old.nrecs++] = off;
+      off += d->size;
+    }
+
+  for (walk_old.nslots = 16; walk_old.nslots < 2 * walk_old.nrecs; )
+    walk_old.nslots *= 2;
+  walk_old.slots = xcalloc (walk_old.nslots, sizeof *walk_old.slots);
+  walk_old.visited = xzalloc (walk_old.nrecs / CHAR_BIT + 1);
+  for (size_t i = 0; i < walk_old.nrecs; i++)
+    {
+      char const *name
+        = walk_dir_name ((struct walk_dir const *) (map + walk_old.recs[i]));
+      size_t h = hash_bytes (HASH_INIT, name, strlen (name));
+      for (h &= walk_old.nslots - 1; walk_old.slots[h];
+           h = (h + 1) & (walk_old.nslots - 1))
+        continue;
+      walk_old.slots[h] = i + 1;
+    }
+}
+
+/* Finish the filtering options hash and load the cache.  */
+static void
+start_walk_cache (void)
+{
+  walk_options_hash = hash_bytes (walk_options_hash, &devices, sizeof devices);
+  load_walk_cache ();
+}
+
+/* Return the number of the cached record for the directory named
+   ABSNAME with status ST if it is still current, or SIZE_MAX.  */
+static size_t
+walk_cache_lookup (char const *absname, struct stat const *st)
+{
+  if (!walk_old.slots)
+    return SIZE_MAX;
+  size_t h = hash_bytes (HASH_INIT, absname, strlen (absname));
+  for (h &= walk_old.nslots - 1; walk_old.slots[h];
+       h = (h + 1) & (walk_old.nslots - 1))
+    {
+      size_t i = walk_old.slots[h] - 1;
+      struct walk_dir const *d
+        = (struct walk_dir const *) (walk_old.map + walk_old.recs[i]);
+      if (STREQ (walk_dir_name (d), absname))
+        return (d->dev == st->st_dev && d->ino == st->st_ino
+                && 0 <= d->mtime_sec
+                && d->mtime_sec == st->st_mtim.tv_sec
+                && d->mtime_nsec == st->st_mtim.tv_nsec
+                ? i : SIZE_MAX);
+    }
+  return SIZE_MAX;
+}
+
+static void
+walk_new_append (void const *p, size_t n)
+{
+  while (walk_new.alloc - walk_new.len < n)
+    walk_new.buf = x2nrealloc (walk_new.buf, &walk_new.alloc, 1);
+  memcpy (walk_new.buf + walk_new.len, p, n);
+  walk_new.len += n;
+}
+
+/* Append to the new cache a record for the directory read from DIRP,
+   named ABSNAME with status ST, keeping only the entries that a
+   recursive search would visit.  PATH names the directory in
+   diagnostics.  */
+static void
+walk_read_directory (DIR *dirp, char const *path, char const *absname,
+                     struct stat const *st)
+{
+  static char const zeros[8];
+  size_t start = walk_new.len;
+  struct walk_dir d;
+  struct dirent const *de;
+
+  memset (&d, 0, sizeof d);
+  walk_new_append (&d, sizeof d);
+  walk_new_append (absname, strlen (absname) + 1);
+
+  while ((errno = 0, de = readdir (dirp)))
+    {
+      char const *name = de->d_name;
+      int type = DT_UNKNOWN;
+      if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+        continue;
+#ifdef _DIRENT_HAVE_D_TYPE
+      type = de->d_type;
+#endif
+      if (STREQ (name, ".gitignore") || STREQ (name, ".ignore")
+          || STREQ (name, ".git"))
+        d.flags |= WALK_DIR_IGNORE_FILES;
+      if (type == DT_UNKNOWN)
+        {
+          struct stat est;
+          if (fstatat (dirfd (dirp), name, &est, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+              suppressible_error (name, errno);
+              continue;
+            }
+          type = (S_ISDIR (est.st_mode) ? DT_DIR
+                  : S_ISLNK (est.st_mode) ? DT_LNK
+                  : S_ISREG (est.st_mode) ? DT_REG
+                  : DT_CHR);
+        }
+
+      /* As with fts, symbolic links below the command line are not
+         followed, and so are never searched.  */
+      if (type == DT_LNK)
+        continue;
+      if (type != DT_DIR && type != DT_REG && skip_devices (false))
+        continue;
+      if (skipped_file (name, false, type == DT_DIR))
+        continue;
+
+      char t = type == DT_DIR ? 'd' : 'f';
+      walk_new_append (&t, 1);
+      walk_new_append (name, strlen (name) + 1);
+      d.nentries++;
+    }
+  if (errno)
+    suppressible_error (path, errno);
+
+  walk_new_append (zeros, -(walk_new.len - start) % 8);
+  d.dev = st->st_dev;
+  d.ino = st->st_ino;
+  /* A directory modified within the timestamp's granularity of now
+     could change again without its timestamp changing.  */
+  d.mtime_sec = (time (NULL) - 1 <= st->st_mtim.tv_sec
+                 ? -1 : st->st_mtim.tv_sec);
+  d.mtime_nsec = st->st_mtim.tv_nsec;
+  d.size = walk_new.len - start;
+  memcpy (walk_new.buf + start, &d, sizeof d);
+  walk_new.ndirs++;
+}
+
+/* Return the name of the entry NAME in the directory DIR, as fts would
+   spell it.  */
+static char *
+walk_child_name (char const *dir, char const *name)
+{
+  size_t dirlen = strlen (dir);
+  char *r = xmalloc (dirlen + strlen (name) + 2);
+  char *p = mempcpy (r, dir, dirlen);
+  if (! (dirlen && dir[dirlen - 1] == '/'))
+    *p++ = '/';
+  strcpy (p, name);
+  return r;
+}
+
+/* A directory this many levels below the root of the walk, or deeper,
+   is closed while each of its subdirectories is walked, and reopened
+   through ".." afterwards.  This bounds the descriptors that a deep
+   tree holds open, at the cost of two system calls per subdirectory.  */
+enum { WALK_HELD_LEVELS = 16 };
+
+/* Close the directory of the walk open on DESC, or on DIRP if that is
+   nonnull, and named PATH.  If UP is nonnull, first open the parent
+   directory, which should be UP's, and return its descriptor; return
+   -1 if it cannot be opened or is not UP's, or if UP is null.  */
+static int
+walk_leave_directory (int desc, DIR *dirp, char const *path,
+                      struct walk_ancestor const *up)
+{
+  int parent = -1;
+  if (up)
+    {
+      struct stat pst;
+      parent = openat (desc, "..", (O_RDONLY | O_NOCTTY | O_DIRECTORY
+                                    | O_CLOEXEC));
+      if (parent < 0 || fstat (parent, &pst) != 0)
+        {
+          suppressible_error (path, errno);
+          if (0 <= parent)
+            close (parent);
+          parent = -1;
+        }
+      else if (! (pst.st_dev == up->dev && pst.st_ino == up->ino))
+        {
+          if (!suppress_errors)
+            ts_error (0, 0, _("%s: %s"), path,
+                      _("directory moved during the search"));
+          errseen = true;
+          close (parent);
+          parent = -1;
+        }
+    }
+  if (dirp)
+    closedir (dirp);
+  else
+    close (desc);
+  return parent;
+}
+
+/* Search the directory open on DESC, with status ST, named PATH as fts
+   would name it and ABSNAME in the walk cache.  Close DESC.  If
+   REOPEN_PARENT, the caller has closed the parent directory UP, so
+   reopen it and return its descriptor, or -1 on failure; otherwise
+   return -1.  */
+static int
+walk_directory (int desc, struct stat const *st, char const *path,
+                char const *absname, struct walk_ancestor const *up,
+                bool reopen_parent)
+{
+  struct walk_ancestor const *back = reopen_parent ? up : NULL;
+  struct walk_ancestor me = { st->st_dev, st->st_ino, up,
+                             up ? up->level + 1 : 0, NULL };
+  for (struct walk_ancestor const *a = up; a; a = a->up)
+    if (a->dev == st->st_dev && a->ino == st->st_ino)
+      {
+        if (!suppress_errors)
+          ts_error (0, 0, _("warning: %s: %s"), path,
+                    _("recursive directory loop"));
+        return walk_leave_directory (desc, NULL, path, back);
+      }
+
+  DIR *dirp = NULL;
+  size_t start = walk_new.len;
+  size_t rec = walk_cache_lookup (absname, st);
+  if (rec != SIZE_MAX)
+    {
+      struct walk_dir const *d
+        = (struct walk_dir const *) (walk_old.map + walk_old.recs[rec]);
+      index_set_bit (walk_old.visited, rec);
+      walk_new_append (d, d->size);
+      walk_new.ndirs++;
+    }
+  else
+    {
+      dirp = fdopendir (desc);
+      if (!dirp)
+        {
+          suppressible_error (path, errno);
+          return walk_leave_directory (desc, NULL, path, back);
+        }
+      desc = dirfd (dirp);
+      walk_read_directory (dirp, path, absname, st);
+    }
+
+  /* The new cache may move as subdirectories are added to it, so
+     step through this record by offset.  */
+  struct walk_dir d;
+  memcpy (&d, walk_new.buf + start, sizeof d);
+  if (vcs_ignore)
+    me.rules = enter_ignore_dir (desc, ".", path, me.level,
+                                 up ? up->rules : NULL,
+                                 d.flags & WALK_DIR_IGNORE_FILES);
+  size_t off = start + sizeof d + strlen (absname) + 1;
+  for (uint64_t i = 0; i < d.nentries; i++)
+    {
+      char type = walk_new.buf[off];
+      char *name = xstrdup (walk_new.buf + off + 1);
+      char *child = walk_child_name (path, name);
+      char const *shown = (omit_dot_slash && strlen (child) >= 2
+                           ? child + 2 : child);
+      off += strlen (name) + 2;
+
+      if (vcs_ignore && ignored_entry (me.rules, child, name, type == 'd'))
+        ;
+      else if (type == 'f')
+        {
+          if (! skipped_by_limits (desc, name, NULL, false))
+            search_file (desc, name, shown, false, false);
+        }
+      else
+        {
+          int fd = openat (desc, name, (O_RDONLY | O_NOCTTY | O_DIRECTORY
+                                        | O_NOFOLLOW | O_CLOEXEC));
+          struct stat cst;
+          if (fd < 0)
+            {
+              if (! open_symlink_nofollow_error (errno))
+                suppressible_error (shown, errno);
+            }
+          else if (fstat (fd, &cst) != 0)
+            {
+              suppressible_error (shown, errno);
+              close (fd);
+            }
+          else
+            {
+              char *childabs = walk_child_name (absname, name);
+              bool hold = me.level < WALK_HELD_LEVELS;
+              if (!hold)
+                {
+                  if (dirp)
+                    closedir (dirp);
+                  else
+                    close (desc);
+                  dirp = NULL;
+                }
+              int parent = walk_directory (fd, &cst, child, childabs, &me,
+                                           !hold);
+              free (childabs);
+              if (!hold)
+                desc = parent;
+            }
+        }
+      free (child);
+      free (name);
+
+      /* Without the directory, the rest of it cannot be searched.  */
+      if (desc < 0)
+        break;
+    }
+
+  if (vcs_ignore)
+    leave_ignore_dir (me.rules, me.level);
+  if (desc < 0)
+    return -1;
+  return walk_leave_directory (desc, dirp, path, back);
+}
+
+/* Search the tree rooted at the directory open on DESC, with status
+   ST and named PATH, using the walk cache.  Close DESC.  */
+static void
+walk_cached_tree (int desc, struct stat const *st, char const *path)
+{
+  char *cwd = getcwd (NULL, 0);
+  char *absname = index_absolute_name (cwd, path);
+  free (cwd);
+  for (size_t len = strlen (absname); 1 < len && absname[len - 1] == '/'; )
+    absname[--len] = '\0';
+
+  if (walk_nroots == walk_roots_alloc)
+    walk_roots = x2nrealloc (walk_roots, &walk_roots_alloc,
+                             sizeof *walk_roots);
+  walk_roots[walk_nroots++] = absname;
+  walk_directory (desc, st, path, absname, NULL, false);
+}
+
+/* Return true if NAME is within one of the trees walked in this run.  */
+static bool
+walk_within_roots (char const *name)
+{
+  for (size_t i = 0; i < walk_nroots; i++)
+    {
+      size_t len = strlen (walk_roots[i]);
+      if (strncmp (name, walk_roots[i], len) == 0
+          && (!name[len] || name[len] == '/'
+              || (len && walk_roots[i][len - 1] == '/')))
+        return true;
+    }
+  return false;
+}
+
+/* Write out the walk cache: the directories walked in this run, plus
+   those of the old cache that lie outside the trees walked.  */
+static void
+write_walk_cache (void)
+{
+  if (!walk_nroots)
+    return;
+
+  for (size_t i = 0; i < walk_old.nrecs; i++)
+    if (! index_bit (walk_old.visited, i))
+      {
+        struct walk_dir const *d
+          = (struct walk_dir const *) (walk_old.map + walk_old.recs[i]);
+        if (! walk_within_roots (walk_dir_name (d)))
+          {
+            walk_new_append (d, d->size);
+            walk_new.ndirs++;
+          }
+      }
+
+  struct walk_cache_header hdr;
+  memset (&hdr, 0, sizeof hdr);
+  memcpy (hdr.magic, WALK_CACHE_MAGIC, sizeof hdr.magic);
+  hdr.options = walk_options_hash;
+  hdr.ndirs = walk_new.ndirs;
+
+  size_t tmplen = strlen (walk_cache_name) + INT_BUFSIZE_BOUND (intmax_t) + 2;
+  char *tmp = xmalloc (tmplen);
+  snprintf (tmp, tmplen, "%s.%jd", walk_cache_name, (intmax_t) getpid ());
+  FILE *out = fopen (tmp, "wbe");
+  if (out)
+    {
+      fwrite (&hdr, sizeof hdr, 1, out);
+      fwrite (walk_new.buf, 1, walk_new.len, out);
+    }
+  if (!out || ferror (out) | (fclose (out) != 0)
+      || rename (tmp, walk_cache_name) != 0)
+    {
+      suppressible_error (walk_cache_name, errno);
+      if (out)
+        unlink (tmp);
+    }
+  free (tmp);
+}
+
+/* Return the ignore rules that apply to the fts entry ENT.  */
+static struct ignore_rules *
+parent_ignore_rules (FTSENT const *ent)
+{
+  return ent->fts_level == FTS_ROOTLEVEL ? NULL : ent->fts_parent->fts_pointer;
+}
+
+static void
+search_dirent (FTS *fts, FTSENT *ent, bool command_line)
+{
+  char *name;
+  bool follow;
+  command_line &= ent->fts_level == FTS_ROOTLEVEL;
+
+  if (ent->fts_info == FTS_DP)
+    {
+      if (vcs_ignore)
+        leave_ignore_dir (ent->fts_pointer, ent->fts_level);
+      return;
+    }
+
+  bool is_dir = (ent->fts_info == FTS_D || ent->fts_info == FTS_DC
+                 || ent->fts_info == FTS_DNR);
+  if (!command_line
+      && (skipped_file (ent->fts_name, false, is_dir)
+          || (vcs_ignore
+              && ignored_entry (parent_ignore_rules (ent), ent->fts_path,
+                                ent->fts_name, is_dir))))
+    {
+      /* fts still reports skipped directories in postorder.  */
+      ent->fts_pointer = NULL;
+      fts_set (fts, ent, FTS_SKIP);
+      return;
+    }
+
+  /* The file's status, if fts has it in full.  */
+  struct stat st1;
+  struct stat const *known_st = (ent->fts_info == FTS_NSOK ? NULL
+                                 : ent->fts_statp);
+
+  name = ent->fts_path;
+  if (omit_dot_slash && strlen (name) >= 2)
+    name += 2;
+  follow = (fts->fts_options & FTS_LOGICAL
+            || (fts->fts_options & FTS_COMFOLLOW && command_line));
+
+  switch (ent->fts_info)
+    {
+    case FTS_D:
+      if (directories == RECURSE_DIRECTORIES)
+        {
+          /* Ignore files apply from here down.  */
+          if (vcs_ignore)
+            ent->fts_pointer
+              = enter_ignore_dir (fts->fts_cwd_fd, ent->fts_accpath,
+                                  ent->fts_path, ent->fts_level,
+                                  parent_ignore_rules (ent), true);
+          return;
+        }
+      ent->fts_pointer = NULL;
+      fts_set (fts, ent, FTS_SKIP);
+      break;
+
+    case FTS_DC:
+      if (!suppress_errors)
+        ts_error (0, 0, _("warning: %s: %s"), name,
+                    _("recursive directory loop"));
+      return;
+
+    case FTS_DNR:
+    case FTS_ERR:
+    case FTS_NS:
+      suppressible_error (name, ent->fts_errno);
+      return;
+
+    case FTS_DEFAULT:
+    case FTS_NSOK:
+      if (skip_devices (command_line))
+        {
+          struct stat *st = ent->fts_statp;
+          if (! st->st_mode)
+            {
+              /* The file type is not already known.  Get the file status
+                 before opening, since opening might have side effects
+                 on a device.  */
+              int flag = follow ? 0 : AT_SYMLINK_NOFOLLOW;
+              if (fstatat (fts->fts_cwd_fd, ent->fts_accpath, &st1, flag) != 0)
+                {
+                  suppressible_error (name, errno);
+                  return;
+                }
+              st = &st1;
+              known_st = &st1;
+            }
+          if (is_device_mode (st->st_mode))
+            return;
+        }
+      break;
+
+    case FTS_F:
+    case FTS_SLNONE:
+      break;
+
+    case FTS_SL:
+    case FTS_W:
+      return;
+
+    default:
+      abort ();
+    }
+
+  if (!command_line
+      && skipped_by_limits (fts->fts_cwd_fd, ent->fts_accpath, known_st,
+                            follow))
+    return;
+
+  search_file (fts->fts_cwd_fd, ent->fts_accpath, name, follow, command_line);
+}
+
+static void
+search_desc (int desc, char const *path, bool command_line)
+{
+  struct stat st;
+
+  if (fstat (desc, &st) != 0)
+    {
+      suppressible_error (path, errno);
+      goto closeout;
+    }
+
+  if (desc != STDIN_FILENO && skip_devices (command_line)
+      && is_device_mode (st.st_mode))
+    goto closeout;
+
+  if (desc != STDIN_FILENO && command_line
+      && skipped_file (path, true, S_ISDIR (st.st_mode)))
+    goto closeout;
+
+  if (desc != STDIN_FILENO && file_limits && outside_file_limits (&st))
+    goto closeout;
+
+  if (desc != STDIN_FILENO
+      && directories == RECURSE_DIRECTORIES && S_ISDIR (st.st_mode))
+    {
+      if (walk_cache_name && ! (fts_options & FTS_LOGICAL))
+        {
+          walk_cached_tree (desc, &st, path);
+          return;
+        }
+
+      /* Traverse the directory starting with its full name, because
+         unfortunately fts provides no way to traverse the directory
+         starting from its file descriptor.  */
+
+      FTS *fts;
+      FTSENT *ent;
+      int opts = fts_options & ~(command_line ? 0 : FTS_COMFOLLOW);
+      char *fts_arg[2] = { (char *) path, NULL, };
+
+      /* Close DESC now, to conserve file descriptors if the race
+         condition occurs many times in a deep recursion.  */
+      if (close (desc) != 0)
+        suppressible_error (path, errno);
+
+      fts = fts_open (fts_arg, opts, NULL);
+
+      if (!fts)
+        xalloc_die ();
+      while ((ent = fts_read (fts)))
+        search_dirent (fts, ent, command_line);
+      if (errno)
+        suppressible_error (path, errno);
+      if (fts_close (fts))
+        suppressible_error (path, errno);
+      return;
+    }
+  if (desc != STDIN_FILENO
+      && ((directories == SKIP_DIRECTORIES && S_ISDIR (st.st_mode))
+          || ((devices == SKIP_DEVICES
+               || (devices == READ_COMMAND_LINE_DEVICES && !command_line))
+              && is_device_mode (st.st_mode))))
+    goto closeout;
+
+  if (building_index)
+    {
+      if (desc != STDIN_FILENO && S_ISREG (st.st_mode))
+        index_admits (path, &st);
+      goto closeout;
+    }
+  if (index_name && desc != STDIN_FILENO && S_ISREG (st.st_mode)
+      && ! index_admits (path, &st))
+    goto closeout;
+
+  /* If there is a regular file on stdout and the current file refers
+     to the same i-node, we have to report the problem and skip it.
+     Otherwise when matching lines from some other input reach the
+     disk before we open this file, we can end up reading and matching
+     those lines and appending them to the file from which we're reading.
+     Then we'd have what appears to be an infinite loop that'd terminate
+     only upon filling the output file system or reaching a quota.
+     However, there is no risk of an infinite loop if grep is generating
+     no output, i.e., with --silent, --quiet, -q.
+     Similarly, with any of these:
+       --max-count=N (-m) (for N >= 2)
+       --files-with-matches (-l)
+       --files-without-match (-L)
+     there is no risk of trouble.
+     For --max-count=1, grep stops after printing the first match,
+     so there is no risk of malfunction.  But even --max-count=2, with
+     input==output, while there is no risk of infloop, there is a race
+     condition that could result in "alternate" output.  */
+  if (!out_quiet && list_files == LISTFILES_NONE && 1 < max_count
+      && SAME_INODE (st, out_stat))
+    {
+      if (! suppress_errors)
+        ts_error (0, 0, _("input file %s is also the output"), quote (path));
+      errseen = true;
+      goto closeout;
+    }
+
+  if (desc == STDIN_FILENO && stdin_chunkable (&st))
+    {
+      search_stdin_chunks (path, &st);
+      return;
+    }
+
+  /* Request readahead and enqueue a piece of work to worker threads.
+     With --no-cache-pollution, readahead waits until the file nears the
+     head of the queue; see willneed_window.  */
+  if (!no_cache_pollution)
+    posix_fadvise (desc, 0, 0, POSIX_FADV_WILLNEED);
+  enqueue_workfile (desc, path, &st);
+
+  return;
+
+ closeout:
+  if (desc != STDIN_FILENO && close (desc) != 0)
+    suppressible_error (path, errno);
+}
+
+/* True if errno is ERR after 'open ("symlink", ... O_NOFOLLOW ...)'.
+   POSIX specifies ELOOP, but it's EMLINK on FreeBSD and EFTYPE on NetBSD.  */
+static bool
+open_symlink_nofollow_error (int err)
+{
+  if (err == ELOOP || err == EMLINK)
+    return true;
+#ifdef EFTYPE
+  if (err == EFTYPE)
+    return true;
+#endif
+  return false;
+}
+
+static void
+search_file (int dirdesc, char const *name, char const *path, bool follow,
+             bool command_line)
+{
+  int oflag = (O_RDONLY | O_NOCTTY
+               | (follow ? 0 : O_NOFOLLOW)
+               | (skip_devices (command_line) ? O_NONBLOCK : 0));
+  int desc = openat_safer (dirdesc, name, oflag);
+  if (desc < 0)
+    {
+      if (follow || ! open_symlink_nofollow_error (errno))
+        suppressible_error (name, errno);
+      return;
+    }
+  search_desc (desc, path, command_line);
+}
+
+static void
+search_command_line_arg (char const *arg)
+{
+  if (STREQ (arg, "-"))
+    search_desc (STDIN_FILENO, label ? label : _("(standard input)"), true);
+  else
+    search_file (AT_FDCWD, arg, arg, true, true);
+}
+
+_Noreturn void usage (int);
+void
+usage (int status)
+{
+  if (status != 0)
+    {
+      fprintf (stderr, _("Usage: %s [OPTION]... PATTERN [FILE]...\n"),
+               program_name);
+      fprintf (stderr, _("Try '%s --help' for more information.\n"),
+               program_name);
+    }
+  else
+    {
+      printf (_("Usage: %s [OPTION]... PATTERN [FILE]...\n"), program_name);
+      printf (_("Search for PATTERN in each FILE or standard input.\n"));
+      printf (_("PATTERN is, by default, a basic regular expression (BRE).\n"));
+      printf (_("\
+Example: %s -i 'hello world' menu.h main.c\n\
+\n\
+Regexp selection and interpretation:\n"), program_name);
+      printf (_("\
+  -E, --extended-regexp     PATTERN is an extended regular expression (ERE)\n\
+  -F, --fixed-strings       PATTERN is a set of newline-separated strings\n\
+  -G, --basic-regexp        PATTERN is a basic regular expression (BRE)\n\
+  -P, --perl-regexp         PATTERN is a Perl regular expression\n"));
+  /* -X is deliberately undocumented.  */
+      printf (_("\
+  -e, --regexp=PATTERN      use PATTERN for matching\n\
+  -f, --file=FILE           obtain PATTERN from FILE\n\
+      --query-file=FILE     search at once for the patterns in FILE, each on\n\
+                            a line after an ID and a tab, and put the ID of\n\
+                            the pattern before each line it matches\n\
+  -i, --ignore-case         ignore case distinctions\n\
+  -w, --word-regexp         force PATTERN to match only whole words\n\
+  -x, --line-regexp         force PATTERN to match only whole lines\n\
+  -z, --null-data           a data line ends in 0 byte, not newline\n"));
+      printf (_("\
+\n\
+Miscellaneous:\n\
+  -s, --no-messages         suppress error messages\n\
+  -v, --invert-match        select non-matching lines\n\
+  -M, --parallel=NUM        use NUM search threads\n\
+      --time-range=START,END  in files of lines that start with ISO 8601\n\
+                            timestamps in order, search only the lines\n\
+                            stamped from START through END\n\
+      --no-cache-pollution  drop file data from the page cache once searched\n\
+      --stats               report where each thread spent its time\n\
+      --lock-stats[=FORMAT]  report lock contention at exit;\n\
+                            FORMAT is 'table' (the default) or 'json'\n\
+      --trace=FILE          write a Chrome trace of the threads' activity\n\
+                            to FILE\n\
+      --profile=FILE        write a CPU profile of all threads to FILE\n\
+      --profile-frequency=HZ  take HZ profile samples per second\n\
+      --result-cache=FILE   remember in FILE which files match and how often,\n\
+                            and skip reading unchanged files accordingly\n\
+  -V, --version             display version information and exit\n\
+      --help                display this help text and exit\n"));
+      printf (_("\
+\n\
+Output control:\n\
+  -m, --max-count=NUM       stop after NUM matches\n\
+      --reverse             search regular files from the end, printing the\n\
+                            last lines first; with -m, the last NUM matches\n\
+  -b, --byte-offset         print the byte offset with output lines\n\
+  -n, --line-number         print line number with output lines\n\
+      --line-buffered       flush output on every line\n\
+  -H, --with-filename       print the file name for each match\n\
+  -h, --no-filename         suppress the file name prefix on output\n\
+      --label=LABEL         use LABEL as the standard input file name prefix\n\
+"));
+      printf (_("\
+  -o, --only-matching       show only the part of a line matching PATTERN\n\
+  -q, --quiet, --silent     suppress all normal output\n\
+      --binary-files=TYPE   assume that binary files are TYPE;\n\
+                            TYPE is 'binary', 'text', or 'without-match'\n\
+  -a, --text                equivalent to --binary-files=text\n\
+"));
+      printf (_("\
+  -I                        equivalent to --binary-files=without-match\n\
+  -d, --directories=ACTION  how to handle directories;\n\
+                            ACTION is 'read', 'recurse', or 'skip'\n\
+  -D, --devices=ACTION      how to handle devices, FIFOs and sockets;\n\
+                            ACTION is 'read' or 'skip'\n\
+  -r, --recursive           like --directories=recurse\n\
+  -R, --dereference-recursive  likewise, but follow all symlinks\n\
+      --walk-cache=FILE     with -r, reuse the listings of unchanged directories\n\
+                            saved in FILE, and save them there\n\
+      --tar                 search the members of tar archives, which may be\n\
+                            compressed with gzip, bzip2, xz or zstd\n\
+"));
+      printf (_("\
+      --include=FILE_PATTERN  search only files that match FILE_PATTERN\n\
+      --exclude=FILE_PATTERN  skip files and directories matching\
+ FILE_PATTERN\n\
+      --exclude-from=FILE   skip files matching any file pattern from FILE\n\
+      --exclude-dir=PATTERN  directories that match PATTERN will be skipped.\n\
+      --min-filesize=SIZE   skip files smaller than SIZE bytes\n\
+      --max-filesize=SIZE   skip files larger than SIZE bytes\n\
+      --newer-than=AGE      skip files not modified within AGE; AGE is a\n\
+                            number of seconds, or of minutes, hours, days or\n\
+                            weeks with suffix m, h, d or w, or @EPOCH-SECONDS\n\
+      --older-than=AGE      skip files modified within AGE\n\
+      --gitignore           skip .git directories and what .gitignore and\n\
+                            .ignore files say to ignore\n\
+      --index=FILE          search only the files that the trigram index FILE\n\
+                            says might match, then update FILE\n\
+      --build-index=FILE    build the trigram index FILE for the given files\n\
+                            and directories and exit; no PATTERN is read\n\
+"));
+      printf (_("\
+  -L, --files-without-match  print only names of FILEs containing no match\n\
+  -l, --files-with-matches  print only names of FILEs containing matches\n\
+  -c, --count               print only a count of matching lines per FILE\n\
+  -T, --initial-tab         make tabs line up (if needed)\n\
+  -Z, --null                print 0 byte after FILE name\n"));
+      printf (_("\
+\n\
+Context control:\n\
+  -B, --before-context=NUM  print NUM lines of leading context\n\
+  -A, --after-context=NUM   print NUM lines of trailing context\n\
+  -C, --context=NUM         print NUM lines of output context\n\
+"));
+      printf (_("\
+  -NUM                      same as --context=NUM\n\
+      --color[=WHEN],\n\
+      --colour[=WHEN]       use markers to highlight the matching strings;\n\
+                            WHEN is 'always', 'never', or 'auto'\n\
+  -U, --binary              do not strip CR characters at EOL (MSDOS/Windows)\n\
+  -u, --unix-byte-offsets   report offsets as if CRs were not there\n\
+                            (MSDOS/Windows)\n\
+\n"));
+      printf (_("\
+'egrep' means 'grep -E'.  'fgrep' means 'grep -F'.\n\
+Direct invocation as either 'egrep' or 'fgrep' is deprecated.\n"));
+      printf (_("\
+When FILE is -, read standard input.  With no FILE, read . if a command-line\n\
+-r is given, - otherwise.  If fewer than two FILEs are given, assume -h.\n\
+Exit status is 0 if any line is selected, 1 otherwise;\n\
+if any error occurs and -q is not given, the exit status is 2.\n"));
+      emit_bug_reporting_address ();
+    }
+  exit (status);
+}
+
+/* Pattern compilers and matchers.  */
+
+/* Return true if the current locale's encoding is UTF-8.  */
+static bool
+locale_is_utf8 (void)
+{
+  return STREQ (nl_langinfo (CODESET), "UTF-8");
+}
+
+/* A compiled pattern, with a shortcut for finding all of its matches
+   in a line.  If the pattern is a single nonempty string that matches
+   only itself, byte for byte, LITERAL is a copy of it and
+   literal_iterate finds its successive matches with memmem, rather
+   than by running the matcher again from each one.  */
+struct literal_pattern
+{
+  void *compiled;		/* What the matcher's compile returned.  */
+  execute_fp_t execute;		/* The matcher's execute.  */
+  void (*free_compiled) (void *); /* How the matcher frees COMPILED.  */
+  char *literal;
+  size_t len;
+};
+
+/* Return the literal_pattern for PATTERN (of size SIZE), which the
+   matcher whose execute is EXECUTE has compiled into COMPILED, to be
+   freed with FREE_COMPILED.  The bytes in SPECIALS make a pattern more
+   than a string for the matcher.  */
+static void *
+literal_compile (void *compiled, execute_fp_t execute,
+                 void (*free_compiled) (void *),
+                 char const *pattern, size_t size, char const *specials)
+{
+  struct literal_pattern *lp = xmalloc (sizeof *lp);
+  lp->compiled = compiled;
+  lp->execute = execute;
+  lp->free_compiled = free_compiled;
+  lp->literal = NULL;
+  lp->len = size;
+
+  /* Outside UTF-8, a multibyte character can end with bytes that look
+     like the string.  In UTF-8, so can a string with an encoding
+     error.  */
+  if (! (size && !memchr (pattern, '\n', size)
+         && !memchr (pattern, eolbyte, size)
+         && !match_icase && !match_words && !match_lines
+         && (MB_CUR_MAX == 1
+             || (locale_is_utf8 ()
+                 && !contains_encoding_error (pattern, size)))))
+    return lp;
+  for (char const *c = specials; *c; c++)
+    if (memchr (pattern, *c, size))
+      return lp;
+  lp->literal = xmemdup (pattern, size);
+  return lp;
+}
+
+/* The bytes that can make a pattern more than a string for regex and
+   PCRE.  Some are special only in some syntaxes or contexts.  */
+static char const regex_specials[] = "\\.[]*^$+?{}|()";
+
+static void *
+Gcompile (char const *pattern, size_t size)
+{
+  return literal_compile (GEAcompile (pattern, size, RE_SYNTAX_GREP),
+                          EGexecute, GEAfree, pattern, size, regex_specials);
+}
+
+static void *
+Ecompile (char const *pattern, size_t size)
+{
+  return literal_compile (GEAcompile (pattern, size, RE_SYNTAX_EGREP),
+                          EGexecute, GEAfree, pattern, size, regex_specials);
+}
+
+static void *
+Acompile (char const *pattern, size_t size)
+{
+  return literal_compile (GEAcompile (pattern, size, RE_SYNTAX_AWK),
+                          EGexecute, GEAfree, pattern, size, regex_specials);
+}
+
+static void *
+GAcompile (char const *pattern, size_t size)
+{
+  return literal_compile (GEAcompile (pattern, size, RE_SYNTAX_GNU_AWK),
+                          EGexecute, GEAfree, pattern, size, regex_specials);
+}
+
+static void *
+PAcompile (char const *pattern, size_t size)
+{
+  return literal_compile (GEAcompile (pattern, size, RE_SYNTAX_POSIX_AWK),
+                          EGexecute, GEAfree, pattern, size, regex_specials);
+}
+
+static void *
+Fcompile_literal (char const *pattern, size_t size)
+{
+  return literal_compile (Fcompile (pattern, size), Fexecute, Ffree,
+                          pattern, size, "");
+}
+
+static void *
+Pcompile_literal (char const *pattern, size_t size)
+{
+  return literal_compile (Pcompile (pattern, size), Pexecute, Pfree,
+                          pattern, size, regex_specials);
+}
+
+/* Free PATTERN, which a matcher's compile returned.  */
+static void
+literal_free (void *pattern)
+{
+  struct literal_pattern *lp = pattern;
+  lp->free_compiled (lp->compiled);
+  free (lp->literal);
+  free (lp);
+}
+
+/* The execute_fp_t of every matcher.  */
+static size_t
+literal_execute (void *pattern, struct grepctx *ctx, char *buf, size_t size,
+                 size_t *match_size, char const *start_ptr)
+{
+  struct literal_pattern *lp = pattern;
+  return lp->execute (lp->compiled, ctx, buf, size, match_size, start_ptr);
+}
+
+/* The iterate_fp_t of every matcher.  */
+static bool
+literal_iterate (struct match_iter *it, size_t *match_offset,
+                 size_t *match_size)
+{
+  struct literal_pattern *lp = it->compiled_pattern;
+  if (!lp->literal)
+    {
+      *match_offset = lp->execute (lp->compiled, it->ctx, it->beg, it->size,
+                                   match_size, it->cur);
+      return *match_offset != (size_t) -1;
+    }
+
+  char const *p = memmem (it->cur, it->beg + it->size - it->cur,
+                          lp->literal, lp->len);
+  if (!p)
+    return false;
+  *match_offset = p - it->beg;
+  *match_size = lp->len;
+  return true;
+}
+
+struct matcher
+{
+  char const name[16];
+  compile_fp_t compile;
+  execute_fp_t execute;
+  iterate_fp_t iterate;		/* Null if the matcher has none.  */
+};
+static struct matcher const matchers[] = {
+  { "grep",      Gcompile,         literal_execute, literal_iterate },
+  { "egrep",     Ecompile,         literal_execute, literal_iterate },
+  { "fgrep",     Fcompile_literal, literal_execute, literal_iterate },
+  { "awk",       Acompile,         literal_execute, literal_iterate },
+  { "gawk",     GAcompile,         literal_execute, literal_iterate },
+  { "posixawk", PAcompile,         literal_execute, literal_iterate },
+  { "perl",      Pcompile_literal, literal_execute, literal_iterate },
+  { "", NULL, NULL, NULL },
+};
+
+/* Set the matcher to M if available.  Exit in case of conflicts or if
+   M is not available.  */
+static void
+setmatcher (char const *m)
+{
+  struct matcher const *p;
+
+  if (matcher && !STREQ (matcher, m))
+    ts_error (EXIT_TROUBLE, 0, _("conflicting matchers specified"));
+
+  for (p = matchers; p->compile; p++)
+    if (STREQ (m, p->name))
+      {
+        matcher = p->name;
+        compile = p->compile;
+        execute = p->execute;
+        iterate = p->iterate;
+        return;
+      }
+
+  ts_error (EXIT_TROUBLE, 0, _("invalid matcher %s"), m);
+}
+
+/* Find the white-space-separated options specified by OPTIONS, and
+   using BUF to store copies of these options, set ARGV[0], ARGV[1],
+   etc. to the option copies.  Return the number N of options found.
+   Do not set ARGV[N] to NULL.  If ARGV is NULL, do not store ARGV[0]
+   etc.  Backslash can be used to escape whitespace (and backslashes).  */
+static size_t
+prepend_args (char const *options, char *buf, char **argv)
+{
+  char const *o = options;
+  char *b = buf;
+  size_t n = 0;
+
+  for (;;)
+    {
+      while (c_isspace (to_uchar (*o)))
+        o++;
+      if (!*o)
+        return n;
+      if (argv)
+        argv[n] = b;
+      n++;
+
+      do
+        if ((*b++ = *o++) == '\\' && *o)
+          b[-1] = *o++;
+      while (*o && ! c_isspace (to_uchar (*o)));
+
+      *b++ = '\0';
+    }
+}
+
+/* Prepend the whitespace-separated options in OPTIONS to the argument
+   vector of a main program with argument count *PARGC and argument
+   vector *PARGV.  Return the number of options prepended.  */
+static int
+prepend_default_options (char const *options, int *pargc, char ***pargv)
+{
+  if (options && *options)
+    {
+      char *buf = xmalloc (strlen (options) + 1);
+      size_t prepended = prepend_args (options, buf, NULL);
+      int argc = *pargc;
+      char *const *argv = *pargv;
+      char **pp;
+      enum { MAX_ARGS = MIN (INT_MAX, SIZE_MAX / sizeof *pp - 1) };
+      if (MAX_ARGS - argc < prepended)
+        xalloc_die ();
+      pp = xmalloc ((prepended + argc + 1) * sizeof *pp);
+      *pargc = prepended + argc;
+      *pargv = pp;
+      *pp++ = *argv++;
+      pp += prepend_args (options, buf, pp);
+      while ((*pp++ = *argv++))
+        continue;
+      return prepended;
+    }
+
+  return 0;
+}
+
+/* Get the next non-digit option from ARGC and ARGV.
+   Return -1 if there are no more options.
+   Process any digit options that were encountered on the way,
+   and store the resulting integer into *DEFAULT_CONTEXT.  */
+static int
+get_nondigit_option (int argc, char *const *argv, intmax_t *default_context)
+{
+  /* Static is OK here since this is only called from the main thread. */
+  static int prev_digit_optind = -1;
+  int this_digit_optind;
+  bool was_digit;
+  char buf[INT_BUFSIZE_BOUND (intmax_t) + 4];
+  char *p = buf;
+  int opt;
+
+  was_digit = false;
+  this_digit_optind = optind;
+  while (true)
+    {
+      opt = getopt_long (argc, (char **) argv, short_options,
+                         long_options, NULL);
+      if ( ! ('0' <= opt && opt <= '9'))
+        break;
+
+      if (prev_digit_optind != this_digit_optind || !was_digit)
+        {
+          /* Reset to start another context length argument.  */
+          p = buf;
+        }
+      else
+        {
+          /* Suppress trivial leading zeros, to avoid incorrect
+             diagnostic on strings like 00000000000.  */
+          p -= buf[0] == '0';
+        }
+
+      if (p == buf + sizeof buf - 4)
+        {
+          /* Too many digits.  Append "..." to make context_length_arg
+             complain about "X...", where X contains the digits seen
+             so far.  */
+          strcpy (p, "...");
+          p += 3;
+          break;
+        }
+      *p++ = opt;
+
+      was_digit = true;
+      prev_digit_optind = this_digit_optind;
+      this_digit_optind = optind;
+    }
+  if (p != buf)
+    {
+      *p = '\0';
+      context_length_arg (buf, default_context);
+    }
+
+  return opt;
+}
+
+/* Parse GREP_COLORS.  The default would look like:
+     GREP_COLORS='ms=01;31:mc=01;31:sl=:cx=:fn=35:ln=32:bn=32:se=36'
+   with boolean capabilities (ne and rv) unset (i.e., omitted).
+   No character escaping is needed or supported.  */
+static void
+parse_grep_colors (void)
+{
+  const char *p;
+  char *q;
+  char *name;
+  char *val;
+
+  p = getenv ("GREP_COLORS"); /* Plural! */
+  if (p == NULL || *p == '\0')
+    return;
+
+  /* Work off a writable copy.  */
+  q = xstrdup (p);
+
+  name = q;
+  val = NULL;
+  /* From now on, be well-formed or you're gone.  */
+  for (;;)
+    if (*q == ':' || *q == '\0')
+      {
+        char c = *q;
+        struct color_cap const *cap;
+
+        *q++ = '\0'; /* Terminate name or val.  */
+        /* Empty name without val (empty cap)
+         * won't match and will be ignored.  */
+        for (cap = color_dict; cap->name; cap++)
+          if (STREQ (cap->name, name))
+            break;
+        /* If name unknown, go on for forward compatibility.  */
+        if (cap->var && val)
+          *(cap->var) = val;
+        if (cap->fct)
+          cap->fct ();
+        if (c == '\0')
+          return;
+        name = q;
+        val = NULL;
+      }
+    else if (*q == '=')
+      {
+        if (q == name || val)
+          return;
+        *q++ = '\0'; /* Terminate name.  */
+        val = q; /* Can be the empty string.  */
+      }
+    else if (val == NULL)
+      q++; /* Accumulate name.  */
+    else if (*q == ';' || (*q >= '0' && *q <= '9'))
+      q++; /* Accumulate val.  Protect the terminal from being sent crap.  */
+    else
+      return;
+}
+
+/* Return true if PAT (of length PATLEN) contains an encoding error.  */
+static bool
+contains_encoding_error (char const *pat, size_t patlen)
+{
+  mbstate_t mbs = { 0 };
+  size_t i, charlen;
+
+  for (i = 0; i < patlen; i += charlen)
+    {
+      charlen = mb_clen (pat + i, patlen - i, &mbs);
+      if ((size_t) -2 <= charlen)
+        return true;
+    }
+  return false;
+}
+
+/* Change a pattern for fgrep into grep.  */
+static void
+fgrep_to_grep_pattern (size_t len, char const *keys,
+                       size_t *new_len, char **new_keys)
+{
+  char *p = *new_keys = xnmalloc (len + 1, 2);
+  mbstate_t mb_state = { 0 };
+  size_t n;
+
+  for (; len; keys += n, len -= n)
+    {
+      n = mb_clen (keys, len, &mb_state);
+      switch (n)
+        {
+        case (size_t) -2:
+          n = len;
+          /* Fall through.  */
+        default:
+          p = mempcpy (p, keys, n);
+          break;
+
+        case (size_t) -1:
+          memset (&mb_state, 0, sizeof mb_state);
+          /* Fall through.  */
+        case 1:
+          *p = '\\';
+          p += strchr ("$*.[\\^", *keys) != NULL;
+          /* Fall through.  */
+        case 0:
+          *p++ = *keys;
+          n = 1;
+          break;
+        }
+    }
+
+  *new_len = p - *new_keys;
+}
+
+/* The search library; see mtgrep.h.  */
+
+/* The matchers consult match_icase, match_words, match_lines and
+   eolbyte while compiling and executing, and grep consults execute,
+   out_invert and binary_files while searching, so library searches
+   may overlap only when they agree on these.  A mode holds them in
+   that order, the matcher as its index in MATCHERS.  MTGREP_ACTIVE
+   counts the searches and compilations under way, all with settings
+   MTGREP_MODE.  */
+enum { MTGREP_MODE_SIZE = 7 };
+static pthread_mutex_t mtgrep_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mtgrep_idle = PTHREAD_COND_INITIALIZER;
+static int mtgrep_active;
+static char mtgrep_mode[MTGREP_MODE_SIZE];
+static pthread_once_t mtgrep_once = PTHREAD_ONCE_INIT;
+
+/* A file waiting to be searched.  */
+struct mtgrep_file
+{
+  struct mtgrep_file *next;
+  char *name;
+};
+
+struct mtgrep
+{
+  struct mtgrep_options options;
+  char mode[MTGREP_MODE_SIZE];
+  int nthreads;
+  pthread_t *threads;
+  void **compiled;		/* A compiled pattern for each thread.  */
+
+  /* Searches with this handle take turns.  */
+  pthread_mutex_t search_lock;
+
+  /* LOCK guards the rest.  WORK_COND is signaled when a file is
+     queued or on shutdown, DONE_COND when the last file is done.  */
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  struct mtgrep_file *head, *tail;
+  int busy;			/* Files being searched.  */
+  bool shutdown;
+
+  /* The search under way.  The workers set STOP, MATCHED and ERROR
+     without LOCK, so access them atomically.  */
+  mtgrep_callback callback;
+  void *arg;
+  bool stop;
+  bool matched;
+  bool error;
+};
+
+/* Set FLAG, one of STOP, MATCHED and ERROR in a search handle.  */
+static void
+mtgrep_set (bool *flag)
+{
+  __atomic_store_n (flag, true, __ATOMIC_RELAXED);
+}
+
+/* Return true if the search with H has been told to stop.  */
+static bool
+mtgrep_stopped (struct mtgrep *h)
+{
+  return __atomic_load_n (&h->stop, __ATOMIC_RELAXED);
+}
+
+/* In a thread compiling a pattern for a handle, where to go if the
+   matcher reports an error; otherwise null.  */
+static __thread jmp_buf *mtgrep_compile_error;
+
+/* The library's hook for error, which calls it before printing a
+   message.  The matchers report an invalid pattern with error and
+   exit, which must not take the program using the library with them,
+   so escape to mtgrep_compile instead.  */
+static void
+mtgrep_print_progname (void)
+{
+  if (mtgrep_compile_error)
+    {
+#ifdef __GLIBC__
+      /* glibc's error has locked stderr.  */
+      funlockfile (stderr);
+#endif
+      longjmp (*mtgrep_compile_error, 1);
+    }
+  fprintf (stderr, "%s: ", program_name ? program_name : "mtgrep");
+}
+
+static void
+mtgrep_initialize (void)
+{
+  pagesize = getpagesize ();
+  dfa_init ();
+  build_mbclen_cache ();
+  initialize_unibyte_mask ();
+  error_print_progname = mtgrep_print_progname;
+
+  /* grep's defaults, as main would set them: no context, and errors
+     show only in the search's status.  */
+  out_after = out_before = -1;
+  suppress_errors = true;
+}
+
+/* Wait until the matchers may be used with the settings MODE.  */
+static void
+mtgrep_enter (char const mode[MTGREP_MODE_SIZE])
+{
+  pthread_mutex_lock (&mtgrep_lock);
+  while (mtgrep_active && memcmp (mtgrep_mode, mode, sizeof mtgrep_mode))
+    pthread_cond_wait (&mtgrep_idle, &mtgrep_lock);
+  if (!mtgrep_active++)
+    {
+      memcpy (mtgrep_mode, mode, sizeof mtgrep_mode);
+      match_icase = mode[0];
+      match_words = mode[1];
+      match_lines = mode[2];
+      eolbyte = mode[3];
+      out_invert = mode[4];
+      binary_files = (mode[5] ? WITHOUT_MATCH_BINARY_FILES
+                      : TEXT_BINARY_FILES);
+      execute = matchers[(unsigned char) mode[6]].execute;
+      iterate = matchers[(unsigned char) mode[6]].iterate;
+    }
+  pthread_mutex_unlock (&mtgrep_lock);
+}
+
+static void
+mtgrep_leave (void)
+{
+  pthread_mutex_lock (&mtgrep_lock);
+  if (!--mtgrep_active)
+    pthread_cond_broadcast (&mtgrep_idle);
+  pthread_mutex_unlock (&mtgrep_lock);
+}
+
+/* Compile N copies of PATTERN (of size SIZE) with COMP into COMPILED.
+   Return the number compiled, which is less than N if the pattern is
+   invalid; whatever the matcher had allocated for the failed copy is
+   lost.  */
+static int
+mtgrep_compile (compile_fp_t comp, char const *pattern, size_t size,
+                void **compiled, int n)
+{
+  jmp_buf env;
+  int volatile i = 0;
+  int cancel;
+
+  /* Being cancelled within error would leave stderr locked.  */
+  pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &cancel);
+  if (! setjmp (env))
+    {
+      mtgrep_compile_error = &env;
+      for (; i < n; i++)
+        compiled[i] = comp (pattern, size);
+    }
+  mtgrep_compile_error = NULL;
+  pthread_setcancelstate (cancel, NULL);
+  return i;
+}
+
+/* Report the line BEG..LIM (which includes its line end), numbered
+   LINE and starting at byte OFFSET of the file.  Return false if the
+   callback asks to stop.  */
+static bool
+mtgrep_report (struct mtgrep *h, struct grepctx *ctx, char *beg, char *lim,
+               uintmax_t line, uintmax_t offset)
+{
+  struct mtgrep_match m;
+  m.file = ctx->filename;
+  m.line = line;
+  m.offset = offset;
+  m.text = beg;
+  m.len = lim - 1 - beg;
+  mtgrep_set (&h->matched);
+
+  if (h->options.invert)
+    {
+      m.start = 0;
+      m.size = m.len;
+      return h->callback (&m, h->arg) == 0;
+    }
+
+  /* Report each nonempty match in the line, as --color would show it,
+     or the empty match at its start if there is nothing else.  */
+  bool reported = false;
+  size_t match_size;
+  size_t match_offset;
+  struct match_iter it;
+  match_iter_init (&it, ctx, execute, beg, lim);
+  while (match_iter_next (&it, iterate, &match_offset, &match_size))
+    {
+      it.cur = beg + match_offset + MAX (match_size, 1);
+      if (m.len <= match_offset)
+        break;
+      if (match_size == 0)
+        continue;
+      m.start = match_offset;
+      m.size = MIN (match_size, m.len - match_offset);
+      reported = true;
+      if (h->callback (&m, h->arg) != 0)
+        return false;
+    }
+  if (reported)
+    return true;
+  m.start = m.size = 0;
+  return h->callback (&m, h->arg) == 0;
+}
+
+/* The reporting hook of the worker contexts of the handle ARG.  Return
+   false to end the search of CTX's input, once any worker's callback
+   has asked to stop.  */
+static bool
+mtgrep_report_hook (void *arg, struct grepctx *ctx, char *beg, char *lim,
+                    uintmax_t line, uintmax_t offset)
+{
+  struct mtgrep *h = arg;
+  if (mtgrep_stopped (h))
+    return false;
+  if (mtgrep_report (h, ctx, beg, lim, line, offset))
+    return true;
+  mtgrep_set (&h->stop);
+  return false;
+}
+
+/* Search the file NAME using CTX, whose reporting hook is set.  */
+static void
+mtgrep_search_file (struct mtgrep *h, struct grepctx *ctx, char const *name)
+{
+  int fd = open (name, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat (fd, &st) != 0)
+    {
+      mtgrep_set (&h->error);
+      if (0 <= fd)
+        close (fd);
+      return;
+    }
+  if (! S_ISDIR (st.st_mode))
+    {
+      bool locked = false;
+      ctx->filename = name;
+      ctx->input_left = -1;
+      ctx->input_mem = NULL;
+      ctx->out_max = (0 < h->options.max_count
+                      ? h->options.max_count : INTMAX_MAX);
+      grep (ctx, fd, &st, pthread_self (), &locked);
+      if (ctx->read_error)
+        mtgrep_set (&h->error);
+    }
+  close (fd);
+}
+
+static void *
+mtgrep_worker (void *arg)
+{
+  struct mtgrep *h = arg;
+  struct grepctx ctx;
+  memset (&ctx, 0, sizeof ctx);
+  ctx.bufalloc = (ALIGN_TO (INITIAL_BUFSIZE, pagesize)
+                  + pagesize + sizeof (uword));
+  ctx.buffer = xmalloc (ctx.bufalloc);
+  ctx.report = mtgrep_report_hook;
+  ctx.report_arg = h;
+
+  pthread_mutex_lock (&h->lock);
+  for (int i = 0; i < h->nthreads; i++)
+    if (pthread_equal (h->threads[i], pthread_self ()))
+      ctx.compiled_pattern = h->compiled[i];
+  for (;;)
+    {
+      while (!h->head && !h->shutdown)
+        pthread_cond_wait (&h->work_cond, &h->lock);
+      if (!h->head)
+        break;
+      struct mtgrep_file *f = h->head;
+      h->head = f->next;
+      h->busy++;
+      pthread_mutex_unlock (&h->lock);
+
+      if (!mtgrep_stopped (h))
+        mtgrep_search_file (h, &ctx, f->name);
+      free (f->name);
+      free (f);
+
+      pthread_mutex_lock (&h->lock);
+      if (!--h->busy && !h->head)
+        pthread_cond_broadcast (&h->done_cond);
     }
-  exit (status);
+  pthread_mutex_unlock (&h->lock);
+  free (ctx.buffer);
+  return NULL;
 }
 
-/* Pattern compilers and matchers.  */
-
-static void *
-Gcompile (char const *pattern, size_t size)
+/* Queue the file NAME for searching.  */
+static void
+mtgrep_queue (struct mtgrep *h, char const *name)
 {
-  return GEAcompile (pattern, size, RE_SYNTAX_GREP);
+  struct mtgrep_file *f = xmalloc (sizeof *f);
+  f->next = NULL;
+  f->name = xstrdup (name);
+  pthread_mutex_lock (&h->lock);
+  if (h->head)
+    h->tail->next = f;
+  else
+    h->head = f;
+  h->tail = f;
+  pthread_cond_signal (&h->work_cond);
+  pthread_mutex_unlock (&h->lock);
 }
 
-static void *
-Ecompile (char const *pattern, size_t size)
+/* Queue the files under the directory NAME.  */
+static void
+mtgrep_queue_tree (struct mtgrep *h, char const *name)
 {
-  return GEAcompile (pattern, size, RE_SYNTAX_EGREP);
+  char *const roots[] = { (char *) name, NULL };
+  FTS *fts = fts_open (roots, FTS_CWDFD | FTS_PHYSICAL
+                       | FTS_TIGHT_CYCLE_CHECK, NULL);
+  if (!fts)
+    {
+      mtgrep_set (&h->error);
+      return;
+    }
+  FTSENT *ent;
+  errno = 0;
+  while ((ent = fts_read (fts)) && !mtgrep_stopped (h))
+    switch (ent->fts_info)
+      {
+      case FTS_F:
+        mtgrep_queue (h, ent->fts_path);
+        break;
+
+      case FTS_DNR:
+      case FTS_ERR:
+      case FTS_NS:
+        mtgrep_set (&h->error);
+        break;
+
+      default:
+        break;
+      }
+  if (!ent && errno)
+    mtgrep_set (&h->error);
+  fts_close (fts);
 }
 
-static void *
-Acompile (char const *pattern, size_t size)
+struct mtgrep *
+mtgrep_new (char const *pattern, size_t size,
+            struct mtgrep_options const *options)
 {
-  return GEAcompile (pattern, size, RE_SYNTAX_AWK);
+  struct matcher const *p;
+  char const *m = options->matcher ? options->matcher : "grep";
+  for (p = matchers; p->compile; p++)
+    if (STREQ (m, p->name))
+      break;
+  if (!p->compile)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  pthread_once (&mtgrep_once, mtgrep_initialize);
+
+  struct mtgrep *h = xzalloc (sizeof *h);
+  h->options = *options;
+  h->mode[0] = options->ignore_case;
+  h->mode[1] = options->match_words;
+  h->mode[2] = options->match_lines;
+  h->mode[3] = options->null_data ? '\0' : '\n';
+  h->mode[4] = options->invert;
+  h->mode[5] = options->skip_binary;
+  h->nthreads = 0 < options->threads ? options->threads : 1;
+
+  /* As in main, prefer grep to fgrep where fgrep is slow or wrong.  */
+  compile_fp_t comp = p->compile;
+  char *keys = xmemdup (pattern, size + 1);
+  keys[size] = '\0';
+  if (comp == Fcompile_literal
+      && (MB_CUR_MAX <= 1
+          ? options->match_words
+          : options->ignore_case || contains_encoding_error (keys, size)))
+    {
+      char *new_keys;
+      fgrep_to_grep_pattern (size, pattern, &size, &new_keys);
+      free (keys);
+      keys = new_keys;
+      comp = Gcompile;
+      p = matchers;
+    }
+  h->mode[6] = p - matchers;
+
+  h->compiled = xnmalloc (h->nthreads, sizeof *h->compiled);
+  mtgrep_enter (h->mode);
+  int ncompiled = mtgrep_compile (comp, keys, size, h->compiled,
+                                  h->nthreads);
+  mtgrep_leave ();
+  free (keys);
+  if (ncompiled < h->nthreads)
+    {
+      for (int i = 0; i < ncompiled; i++)
+        literal_free (h->compiled[i]);
+      free (h->compiled);
+      free (h);
+      errno = EINVAL;
+      return NULL;
+    }
+
+  if (pthread_mutex_init (&h->search_lock, NULL)
+      || pthread_mutex_init (&h->lock, NULL)
+      || pthread_cond_init (&h->work_cond, NULL)
+      || pthread_cond_init (&h->done_cond, NULL))
+    abort ();
+  h->threads = xnmalloc (h->nthreads, sizeof *h->threads);
+  pthread_mutex_lock (&h->lock);
+  for (int i = 0; i < h->nthreads; i++)
+    {
+      int err = pthread_create (&h->threads[i], NULL, mtgrep_worker, h);
+      if (err)
+        {
+          for (int j = i; j < h->nthreads; j++)
+            literal_free (h->compiled[j]);
+          h->nthreads = i;
+          pthread_mutex_unlock (&h->lock);
+          mtgrep_free (h);
+          errno = err;
+          return NULL;
+        }
+    }
+  pthread_mutex_unlock (&h->lock);
+  return h;
 }
 
-static void *
-GAcompile (char const *pattern, size_t size)
+int
+mtgrep_search (struct mtgrep *h, char const *const *files,
+               mtgrep_callback callback, void *arg)
 {
-  return GEAcompile (pattern, size, RE_SYNTAX_GNU_AWK);
+  pthread_mutex_lock (&h->search_lock);
+  mtgrep_enter (h->mode);
+  h->callback = callback;
+  h->arg = arg;
+  __atomic_store_n (&h->stop, false, __ATOMIC_RELAXED);
+  __atomic_store_n (&h->matched, false, __ATOMIC_RELAXED);
+  __atomic_store_n (&h->error, false, __ATOMIC_RELAXED);
+
+  for (; *files && !mtgrep_stopped (h); files++)
+    {
+      struct stat st;
+      if (stat (*files, &st) != 0)
+        mtgrep_set (&h->error);
+      else if (! S_ISDIR (st.st_mode))
+        mtgrep_queue (h, *files);
+      else if (h->options.recursive)
+        mtgrep_queue_tree (h, *files);
+    }
+
+  pthread_mutex_lock (&h->lock);
+  while (h->head || h->busy)
+    pthread_cond_wait (&h->done_cond, &h->lock);
+  pthread_mutex_unlock (&h->lock);
+
+  int status = (__atomic_load_n (&h->error, __ATOMIC_RELAXED) ? EXIT_TROUBLE
+                : __atomic_load_n (&h->matched, __ATOMIC_RELAXED) ? 0 : 1);
+  mtgrep_leave ();
+  pthread_mutex_unlock (&h->search_lock);
+  return status;
 }
 
-static void *
-PAcompile (char const *pattern, size_t size)
+void
+mtgrep_free (struct mtgrep *h)
 {
-  return GEAcompile (pattern, size, RE_SYNTAX_POSIX_AWK);
+  pthread_mutex_lock (&h->lock);
+  h->shutdown = true;
+  pthread_cond_broadcast (&h->work_cond);
+  pthread_mutex_unlock (&h->lock);
+  for (int i = 0; i < h->nthreads; i++)
+    pthread_join (h->threads[i], NULL);
+
+  for (int i = 0; i < h->nthreads; i++)
+    literal_free (h->compiled[i]);
+  pthread_mutex_destroy (&h->search_lock);
+  pthread_mutex_destroy (&h->lock);
+  pthread_cond_destroy (&h->work_cond);
+  pthread_cond_destroy (&h->done_cond);
+  free (h->threads);
+  free (h->compiled);
+  free (h);
 }
 
-struct matcher
+/* Search daemon.  grep --daemon=SOCKET listens on the Unix socket
+   SOCKET.  When GREP_DAEMON_SOCKET names that socket, grep hands its
+   arguments, environment, working directory and standard streams to
+   the daemon instead of searching itself, and exits with the status
+   the daemon reports; if the daemon cannot be reached, grep searches
+   as usual.  Each request is served by a fresh process forked from the
+   daemon, with the client's descriptors as its own, so output streams
+   straight to the client and behaves exactly as if grep had run there.
+
+   Threads do not survive fork, so each request starts its own workers.
+   What the daemon keeps warm is everything set up before the fork:
+   the loaded program and locale data, and a cache of compiled patterns.
+   After a request compiles its pattern, it reports the pattern to the
+   daemon, which compiles copies of it for later requests to inherit.  */
+
+static char const *daemon_socket;
+
+/* In a process serving a request, the pipe on which to report
+   compiled patterns to the daemon; otherwise -1.  */
+static int daemon_report_fd = -1;
+
+/* The daemon's locale; only patterns compiled in it are cached.  */
+static char *daemon_locale;
+
+enum { DAEMON_MAGIC = 0x67726570 };
+
+/* A request starts with this header, sent together with the client's
+   standard input, output and error and its working directory.  The
+   header is followed by LEN bytes: ARGC null-terminated arguments and
+   then ENVC null-terminated environment entries.  */
+struct daemon_request
 {
-  char const name[16];
-  compile_fp_t compile;
-  execute_fp_t execute;
+  uint32_t magic;
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t len;
 };
-static struct matcher const matchers[] = {
-  { "grep",      Gcompile, EGexecute },
-  { "egrep",     Ecompile, EGexecute },
-  { "fgrep",     Fcompile,  Fexecute },
-  { "awk",       Acompile, EGexecute },
-  { "gawk",     GAcompile, EGexecute },
-  { "posixawk", PAcompile, EGexecute },
-  { "perl",      Pcompile,  Pexecute },
-  { "", NULL, NULL },
+
+enum { DAEMON_FDS = 4, DAEMON_REQUEST_MAX = 1 << 24 };
+
+/* Compiled copies of a pattern, identified by KEY; see
+   pattern_cache_key.  */
+struct pattern_cache_entry
+{
+  char *key;
+  size_t keylen;
+  void **compiled;
+  size_t ncompiled;
+  struct pattern_cache_entry *next;
 };
 
-/* Set the matcher to M if available.  Exit in case of conflicts or if
-   M is not available.  */
+enum { PATTERN_CACHE_MAX = 32 };
+static struct pattern_cache_entry *pattern_cache;
+static int pattern_cache_size;
+
+/* Return a string identifying the pattern KEYS (of length KEYCC) as
+   compiled with the current matcher, options and locale, and set *LEN
+   to its length.  */
+static char *
+pattern_cache_key (char const *keys, size_t keycc, size_t *len)
+{
+  char const *m = matcher ? matcher : "grep";
+  char const *locale = setlocale (LC_ALL, NULL);
+  size_t mlen = strlen (m) + 1;
+  size_t llen = strlen (locale) + 1;
+  char *key = xmalloc (mlen + llen + 4 + keycc);
+  char *p = key;
+  p = mempcpy (p, m, mlen);
+  p = mempcpy (p, locale, llen);
+  *p++ = match_icase;
+  *p++ = match_words;
+  *p++ = match_lines;
+  *p++ = eolbyte;
+  p = mempcpy (p, keys, keycc);
+  *len = p - key;
+  return key;
+}
+
+static struct pattern_cache_entry *
+pattern_cache_find (char const *key, size_t keylen)
+{
+  for (struct pattern_cache_entry *e = pattern_cache; e; e = e->next)
+    if (e->keylen == keylen && memcmp (e->key, key, keylen) == 0)
+      return e;
+  return NULL;
+}
+
+/* Compile KEYS (of length KEYCC), or take a copy compiled in advance
+   by the daemon.  */
+static void *
+compile_pattern (char const *keys, size_t keycc)
+{
+  if (pattern_cache)
+    {
+      size_t keylen;
+      char *key = pattern_cache_key (keys, keycc, &keylen);
+      struct pattern_cache_entry *e = pattern_cache_find (key, keylen);
+      free (key);
+      if (e && e->ncompiled)
+        return e->compiled[--e->ncompiled];
+    }
+  return compile (keys, keycc);
+}
+
+/* Read the queries for --query-file from FILE, "-" meaning standard
+   input, and set *KEYS and *KEYCC to all their patterns, each followed
+   by a newline as if given with -e.  */
 static void
-setmatcher (char const *m)
+read_query_file (char const *file, char **keys, size_t *keycc)
 {
-  struct matcher const *p;
+  bool use_stdin = STREQ (file, "-");
+  FILE *in = use_stdin ? stdin : fopen (file, "r");
+  if (!in)
+    ts_error (EXIT_TROUBLE, errno, "%s", file);
+
+  size_t queries_alloc = 0;
+  char *line = NULL;
+  size_t linealloc = 0;
+  ssize_t len;
+  intmax_t lineno = 0;
+  while (0 <= (len = getline (&line, &linealloc, in)))
+    {
+      lineno++;
+      if (len && line[len - 1] == '\n')
+        line[--len] = '\0';
+      if (!len)
+        continue;
+      char *tab = memchr (line, '\t', len);
+      if (!tab)
+        ts_error (EXIT_TROUBLE, 0, _("%s:%" PRIdMAX ": missing tab after ID"),
+                  file, lineno);
+      if (nqueries == queries_alloc)
+        queries = x2nrealloc (queries, &queries_alloc, sizeof *queries);
+      struct query *q = &queries[nqueries++];
+      q->idlen = tab - line;
+      q->id = xmemdup (line, q->idlen);
+      q->size = line + len - (tab + 1);
+      q->pattern = xmemdup (tab + 1, q->size + 1);
+      query_id_max = MAX (query_id_max, q->idlen);
+    }
+  free (line);
+  if (ferror (in))
+    ts_error (EXIT_TROUBLE, errno, "%s", file);
+  if (!use_stdin)
+    fclose (in);
+
+  *keycc = 0;
+  for (size_t i = 0; i < nqueries; i++)
+    *keycc += queries[i].size + 1;
+  char *p = *keys = xmalloc (*keycc + 1);
+  for (size_t i = 0; i < nqueries; i++)
+    {
+      p = mempcpy (p, queries[i].pattern, queries[i].size);
+      *p++ = '\n';
+    }
+  *p = '\0';
+}
 
-  if (matcher && !STREQ (matcher, m))
-    ts_error (EXIT_TROUBLE, 0, _("conflicting matchers specified"));
+/* Compile every query's pattern COPIES times, once for each worker
+   thread.  */
+static void
+compile_queries (intmax_t copies)
+{
+  query_sets = xnmalloc (copies, sizeof *query_sets);
+  for (intmax_t i = 0; i < copies; i++)
+    {
+      query_sets[i] = xnmalloc (nqueries, sizeof *query_sets[i]);
+      for (size_t q = 0; q < nqueries; q++)
+        query_sets[i][q] = compile (queries[q].pattern, queries[q].size);
+    }
+}
+
+/* Tell the daemon that this request compiled KEYS (of length KEYCC),
+   for COPIES threads.  */
+static void
+report_pattern (char const *keys, size_t keycc, uint32_t copies)
+{
+  size_t keylen;
+  char *key = pattern_cache_key (keys, keycc, &keylen);
+  uint32_t head[2] = { keylen, copies };
+
+  /* Writes of at most PIPE_BUF bytes do not interleave.  */
+  if (sizeof head + keylen <= PIPE_BUF
+      && ! pattern_cache_find (key, keylen))
+    {
+      char msg[PIPE_BUF];
+      memcpy (msg, head, sizeof head);
+      memcpy (msg + sizeof head, key, keylen);
+      if (write (daemon_report_fd, msg, sizeof head + keylen) < 0)
+        daemon_report_fd = -1;
+    }
+  free (key);
+}
+
+/* In the daemon, compile copies of the pattern identified by KEY (of
+   length KEYLEN) for later requests that use COPIES threads: one for
+   each thread, and one for grep_main's own use.  */
+static void
+warm_pattern (char const *key, size_t keylen, uint32_t copies)
+{
+  char const *m = key;
+  char const *mend = memchr (key, '\0', keylen);
+  char const *locale = mend + 1;
+  char const *lend = mend ? memchr (locale, '\0', key + keylen - locale) : NULL;
+  char const *flags = lend + 1;
+  struct matcher const *p;
 
+  if (!lend || key + keylen - flags < 4 || ! STREQ (locale, daemon_locale)
+      || PATTERN_CACHE_MAX <= pattern_cache_size
+      || pattern_cache_find (key, keylen))
+    return;
   for (p = matchers; p->compile; p++)
     if (STREQ (m, p->name))
-      {
-        matcher = p->name;
-        compile = p->compile;
-        execute = p->execute;
-        return;
-      }
+      break;
+  if (!p->compile)
+    return;
 
-  ts_error (EXIT_TROUBLE, 0, _("invalid matcher %s"), m);
+  /* Compile with the request's settings, then restore the daemon's.  */
+  bool icase = match_icase, words = match_words, lines = match_lines;
+  char eol = eolbyte;
+  compile_fp_t comp = compile;
+  match_icase = flags[0];
+  match_words = flags[1];
+  match_lines = flags[2];
+  eolbyte = flags[3];
+  compile = p->compile;
+
+  struct pattern_cache_entry *e = xmalloc (sizeof *e);
+  e->key = xmemdup (key, keylen);
+  e->keylen = keylen;
+  e->ncompiled = MIN (copies, 63) + 1;
+  e->compiled = xnmalloc (e->ncompiled, sizeof *e->compiled);
+  for (size_t i = 0; i < e->ncompiled; i++)
+    e->compiled[i] = compile (flags + 4, key + keylen - (flags + 4));
+  e->next = pattern_cache;
+  pattern_cache = e;
+  pattern_cache_size++;
+
+  match_icase = icase;
+  match_words = words;
+  match_lines = lines;
+  eolbyte = eol;
+  compile = comp;
 }
 
-/* Find the white-space-separated options specified by OPTIONS, and
-   using BUF to store copies of these options, set ARGV[0], ARGV[1],
-   etc. to the option copies.  Return the number N of options found.
-   Do not set ARGV[N] to NULL.  If ARGV is NULL, do not store ARGV[0]
-   etc.  Backslash can be used to escape whitespace (and backslashes).  */
-static size_t
-prepend_args (char const *options, char *buf, char **argv)
+/* Read pattern reports from the pipe FD and act on them.  */
+static void
+read_pattern_reports (int fd)
 {
-  char const *o = options;
-  char *b = buf;
-  size_t n = 0;
+  static char buf[2 * PIPE_BUF];
+  static size_t have;
+  ssize_t n = read (fd, buf + have, sizeof buf - have);
+  if (n <= 0)
+    return;
+  have += n;
 
-  for (;;)
+  char *p = buf;
+  uint32_t head[2];
+  while (sizeof head <= buf + have - p)
     {
-      while (c_isspace (to_uchar (*o)))
-        o++;
-      if (!*o)
-        return n;
-      if (argv)
-        argv[n] = b;
-      n++;
-
-      do
-        if ((*b++ = *o++) == '\\' && *o)
-          b[-1] = *o++;
-      while (*o && ! c_isspace (to_uchar (*o)));
-
-      *b++ = '\0';
+      memcpy (head, p, sizeof head);
+      if (buf + have - p - sizeof head < head[0])
+        break;
+      warm_pattern (p + sizeof head, head[0], head[1]);
+      p += sizeof head + head[0];
     }
+  have = buf + have - p;
+  memmove (buf, p, have);
 }
 
-/* Prepend the whitespace-separated options in OPTIONS to the argument
-   vector of a main program with argument count *PARGC and argument
-   vector *PARGV.  Return the number of options prepended.  */
-static int
-prepend_default_options (char const *options, int *pargc, char ***pargv)
+static int grep_main (int, char **);
+
+/* Serve the request on the connection CONN, in a process of its own.
+   Do not return.  */
+static _Noreturn void
+serve_request (int conn)
 {
-  if (options && *options)
+  struct daemon_request req;
+  int fds[DAEMON_FDS];
+  union
+  {
+    char buf[CMSG_SPACE (sizeof fds)];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { &req, sizeof req };
+  struct msghdr msg;
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof control.buf;
+
+  signal (SIGCHLD, SIG_DFL);
+  ssize_t n = recvmsg (conn, &msg, MSG_CMSG_CLOEXEC);
+  struct cmsghdr *cmsg = n == sizeof req ? CMSG_FIRSTHDR (&msg) : NULL;
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET
+      || cmsg->cmsg_type != SCM_RIGHTS
+      || cmsg->cmsg_len != CMSG_LEN (sizeof fds)
+      || req.magic != DAEMON_MAGIC || !req.argc
+      || DAEMON_REQUEST_MAX < req.len)
+    _exit (EXIT_TROUBLE);
+  memcpy (fds, CMSG_DATA (cmsg), sizeof fds);
+
+  char *strings = xmalloc (req.len + 1);
+  if (read_fully (conn, strings, req.len) != req.len)
+    _exit (EXIT_TROUBLE);
+  strings[req.len] = '\0';
+
+  /* ARGV and ENVP share one array, each followed by a null pointer.  */
+  char **argv = xnmalloc ((size_t) req.argc + req.envc + 2, sizeof *argv);
+  char **envp = argv + req.argc + 1;
+  char *s = strings;
+  for (uint32_t i = 0; i < req.argc + req.envc; i++)
     {
-      char *buf = xmalloc (strlen (options) + 1);
-      size_t prepended = prepend_args (options, buf, NULL);
-      int argc = *pargc;
-      char *const *argv = *pargv;
-      char **pp;
-      enum { MAX_ARGS = MIN (INT_MAX, SIZE_MAX / sizeof *pp - 1) };
-      if (MAX_ARGS - argc < prepended)
-        xalloc_die ();
-      pp = xmalloc ((prepended + argc + 1) * sizeof *pp);
-      *pargc = prepended + argc;
-      *pargv = pp;
-      *pp++ = *argv++;
-      pp += prepend_args (options, buf, pp);
-      while ((*pp++ = *argv++))
-        continue;
-      return prepended;
+      if (strings + req.len <= s)
+        _exit (EXIT_TROUBLE);
+      argv[i < req.argc ? i : i + 1] = s;
+      s += strlen (s) + 1;
+    }
+  argv[req.argc] = NULL;
+  envp[req.envc] = NULL;
+
+  /* The search itself runs in a child, whose exit closes LIFE[1].  */
+  int life[2];
+  if (pipe2 (life, O_CLOEXEC) != 0)
+    _exit (EXIT_TROUBLE);
+  signal (SIGPIPE, SIG_DFL);
+  pid_t pid = fork ();
+  if (pid == 0)
+    {
+      close (life[0]);
+      close (conn);
+      for (int fd = 0; fd < 3; fd++)
+        if (dup2 (fds[fd], fd) < 0)
+          _exit (EXIT_TROUBLE);
+      if (fchdir (fds[3]) != 0)
+        _exit (EXIT_TROUBLE);
+      for (int i = 0; i < DAEMON_FDS; i++)
+        close (fds[i]);
+      environ = envp;
+      set_program_name (argv[0]);
+      program_name = argv[0];
+      daemon_socket = NULL;
+      optind = 0;
+      exit (grep_main (req.argc, argv));
     }
+  for (int i = 0; i < DAEMON_FDS; i++)
+    close (fds[i]);
+  close (life[1]);
 
-  return 0;
+  /* Wait for the search to finish, or for the client to give up.  */
+  int status = EXIT_TROUBLE;
+  if (0 < pid)
+    {
+      struct pollfd pfd[2] = { { life[0], POLLIN, 0 }, { conn, POLLIN, 0 } };
+      while (poll (pfd, 2, -1) < 0 && errno == EINTR)
+        continue;
+      if (! pfd[0].revents && pfd[1].revents)
+        kill (pid, SIGTERM);
+      while (waitpid (pid, &status, 0) < 0 && errno == EINTR)
+        continue;
+      status = (WIFEXITED (status) ? WEXITSTATUS (status)
+                : 128 + WTERMSIG (status));
+    }
+  int32_t reply = status;
+  _exit (write (conn, &reply, sizeof reply) == sizeof reply
+         ? EXIT_SUCCESS : EXIT_TROUBLE);
 }
 
-/* Get the next non-digit option from ARGC and ARGV.
-   Return -1 if there are no more options.
-   Process any digit options that were encountered on the way,
-   and store the resulting integer into *DEFAULT_CONTEXT.  */
+/* Listen on the Unix socket named PATH and serve requests forever.  */
 static int
-get_nondigit_option (int argc, char *const *argv, intmax_t *default_context)
+serve_daemon (char const *path)
 {
-  /* Static is OK here since this is only called from the main thread. */
-  static int prev_digit_optind = -1;
-  int this_digit_optind;
-  bool was_digit;
-  char buf[INT_BUFSIZE_BOUND (intmax_t) + 4];
-  char *p = buf;
-  int opt;
+  struct sockaddr_un addr;
+  if (sizeof addr.sun_path <= strlen (path))
+    ts_error (EXIT_TROUBLE, ENAMETOOLONG, "%s", path);
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+
+  int lfd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (lfd < 0)
+    ts_error (EXIT_TROUBLE, errno, "%s", path);
+
+  /* Replace a stale socket, but not a live daemon.  */
+  if (connect (lfd, (struct sockaddr *) &addr, sizeof addr) == 0)
+    ts_error (EXIT_TROUBLE, 0, _("%s: a daemon is already listening"),
+              quote (path));
+  close (lfd);
+  struct stat st;
+  if (lstat (path, &st) == 0 && S_ISSOCK (st.st_mode))
+    unlink (path);
+
+  lfd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  mode_t mask = umask (077);
+  if (lfd < 0 || bind (lfd, (struct sockaddr *) &addr, sizeof addr) != 0
+      || listen (lfd, SOMAXCONN) != 0)
+    ts_error (EXIT_TROUBLE, errno, "%s", path);
+  umask (mask);
+
+  int report[2];
+  if (pipe2 (report, O_CLOEXEC) != 0)
+    ts_error (EXIT_TROUBLE, errno, "pipe");
+  daemon_locale = xstrdup (setlocale (LC_ALL, NULL));
+  build_mbclen_cache ();
+  initialize_unibyte_mask ();
+  signal (SIGCHLD, SIG_IGN);
+  signal (SIGPIPE, SIG_IGN);
 
-  was_digit = false;
-  this_digit_optind = optind;
-  while (true)
+  for (;;)
     {
-      opt = getopt_long (argc, (char **) argv, short_options,
-                         long_options, NULL);
-      if ( ! ('0' <= opt && opt <= '9'))
-        break;
-
-      if (prev_digit_optind != this_digit_optind || !was_digit)
+      struct pollfd pfd[2] = { { lfd, POLLIN, 0 }, { report[0], POLLIN, 0 } };
+      if (poll (pfd, 2, -1) < 0)
         {
-          /* Reset to start another context length argument.  */
-          p = buf;
+          if (errno == EINTR)
+            continue;
+          ts_error (EXIT_TROUBLE, errno, "poll");
         }
-      else
+      if (pfd[1].revents)
+        read_pattern_reports (report[0]);
+      if (pfd[0].revents)
         {
-          /* Suppress trivial leading zeros, to avoid incorrect
-             diagnostic on strings like 00000000000.  */
-          p -= buf[0] == '0';
+          int conn = accept4 (lfd, NULL, NULL, SOCK_CLOEXEC);
+          if (conn < 0)
+            continue;
+          pid_t pid = fork ();
+          if (pid == 0)
+            {
+              close (lfd);
+              close (report[0]);
+              daemon_report_fd = report[1];
+              serve_request (conn);
+            }
+          close (conn);
         }
+    }
+}
 
-      if (p == buf + sizeof buf - 4)
-        {
-          /* Too many digits.  Append "..." to make context_length_arg
-             complain about "X...", where X contains the digits seen
-             so far.  */
-          strcpy (p, "...");
-          p += 3;
-          break;
-        }
-      *p++ = opt;
+#if !defined MTGREP_LIBRARY && !defined GREP_MICROBENCH
+/* If GREP_DAEMON_SOCKET names a daemon that will take this search, hand
+   it over, set *STATUS to the exit status the daemon reports, and
+   return true.  Return false to search locally instead.  */
+static bool
+daemon_client (int argc, char **argv, int *status)
+{
+  char const *path = getenv ("GREP_DAEMON_SOCKET");
+  struct sockaddr_un addr;
+  if (!path || !*path || sizeof addr.sun_path <= strlen (path))
+    return false;
+  for (int i = 1; i < argc; i++)
+    if (strncmp (argv[i], "--daemon", 8) == 0)
+      return false;
 
-      was_digit = true;
-      prev_digit_optind = this_digit_optind;
-      this_digit_optind = optind;
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+  int sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return false;
+  int cwd = open (".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (cwd < 0 || connect (sock, (struct sockaddr *) &addr, sizeof addr) != 0)
+    {
+      if (0 <= cwd)
+        close (cwd);
+      close (sock);
+      return false;
+    }
+
+  struct daemon_request req = { DAEMON_MAGIC, argc, 0, 0 };
+  size_t len = 0;
+  for (int i = 0; i < argc; i++)
+    len += strlen (argv[i]) + 1;
+  for (char **e = environ; *e; e++, req.envc++)
+    len += strlen (*e) + 1;
+  char *strings = xmalloc (len);
+  char *p = strings;
+  for (int i = 0; i < argc; i++)
+    p = stpcpy (p, argv[i]) + 1;
+  for (char **e = environ; *e; e++)
+    p = stpcpy (p, *e) + 1;
+  req.len = len;
+
+  int fds[DAEMON_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd };
+  union
+  {
+    char buf[CMSG_SPACE (sizeof fds)];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { &req, sizeof req };
+  struct msghdr msg;
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof control.buf;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof fds);
+  memcpy (CMSG_DATA (cmsg), fds, sizeof fds);
+
+  /* Until the request is sent, the search can still run locally.  */
+  bool sent = (sendmsg (sock, &msg, MSG_NOSIGNAL) == sizeof req
+               && send (sock, strings, len, MSG_NOSIGNAL) == len);
+  free (strings);
+  close (cwd);
+  if (!sent)
+    {
+      close (sock);
+      return false;
+    }
+
+  int32_t reply;
+  if (read_fully (sock, (char *) &reply, sizeof reply) != sizeof reply)
+    ts_error (EXIT_TROUBLE, 0, _("%s: the daemon failed to reply"),
+              quote (path));
+  close (sock);
+  *status = reply;
+  return true;
+}
+#endif
+
+#ifdef GREP_MICROBENCH
+/* Compiling grep.c with GREP_MICROBENCH defined replaces main with a
+   harness that times the scanning and printing primitives on
+   synthetic input, so that a change to one of them can be measured
+   without the noise of file I/O and matching.  Usage:
+
+     grep-microbench [MEGABYTES [LINE-LENGTH [NUL-EVERY]]]
+
+   The input is MEGABYTES (default 16) of printable text in lines of
+   about LINE-LENGTH bytes (default 64), one byte in NUL-EVERY of which
+   (default 4096) is a null byte in the copy used for the null-byte
+   primitives.  Run it under a UTF-8 locale to make the encoding checks
+   do real work.  Each primitive is repeated for at least
+   MICROBENCH_MIN_NS and the fastest repetition is reported.  */
+
+enum { MICROBENCH_MIN_NS = 250000000, MICROBENCH_MIN_REPS = 3 };
+
+#if defined __x86_64__ || defined __i386__
+# define MICROBENCH_CYCLES() __builtin_ia32_rdtsc ()
+#else
+# define MICROBENCH_CYCLES() 0
+#endif
+
+struct microbench
+{
+  struct grepctx *ctx;
+  char *text;			/* The text, followed by slop.  */
+  char *nuls;			/* A copy with null bytes in it.  */
+  char *scratch;		/* Room for a copy, followed by slop.  */
+  size_t size;
+  uintmax_t lines;
+  int fd;			/* A temporary file holding the text.  */
+  uintmax_t sink;		/* Keeps results from being optimized away.  */
+};
+
+static void
+microbench_fill (struct microbench *mb, bool from_file)
+{
+  struct grepctx *ctx = mb->ctx;
+  struct stat st;
+  memset (&st, 0, sizeof st);
+  st.st_mode = S_IFREG;
+  st.st_size = mb->size;
+  if (from_file)
+    {
+      ctx->input_mem = NULL;
+      ctx->input_left = -1;
+      if (lseek (mb->fd, 0, SEEK_SET) != 0)
+        ts_error (EXIT_TROUBLE, errno, "lseek");
     }
-  if (p != buf)
+  else
     {
-      *p = '\0';
-      context_length_arg (buf, default_context);
+      ctx->input_mem = mb->text;
+      ctx->input_left = mb->size;
     }
+  reset (ctx, from_file ? mb->fd : -1, &st);
+  do
+    if (! fillbuf (ctx, 0, &st))
+      ts_error (EXIT_TROUBLE, errno, "fillbuf");
+  while (ctx->buflim != ctx->bufbeg);
+}
 
-  return opt;
+static void
+microbench_fillbuf_mem (struct microbench *mb)
+{
+  microbench_fill (mb, false);
 }
 
-/* Parse GREP_COLORS.  The default would look like:
-     GREP_COLORS='ms=01;31:mc=01;31:sl=:cx=:fn=35:ln=32:bn=32:se=36'
-   with boolean capabilities (ne and rv) unset (i.e., omitted).
-   No character escaping is needed or supported.  */
 static void
-parse_grep_colors (void)
+microbench_fillbuf_file (struct microbench *mb)
 {
-  const char *p;
-  char *q;
-  char *name;
-  char *val;
+  microbench_fill (mb, true);
+}
 
-  p = getenv ("GREP_COLORS"); /* Plural! */
-  if (p == NULL || *p == '\0')
-    return;
+static void
+microbench_nlscan (struct microbench *mb)
+{
+  mb->ctx->lastnl = mb->text;
+  mb->ctx->totalnl = 0;
+  nlscan (mb->ctx, mb->text + mb->size);
+  mb->sink += mb->ctx->totalnl;
+}
 
-  /* Work off a writable copy.  */
-  q = xstrdup (p);
+static void
+microbench_zap_nuls (struct microbench *mb)
+{
+  memcpy (mb->scratch, mb->nuls, mb->size);
+  zap_nuls (mb->scratch, mb->scratch + mb->size, eolbyte);
+}
 
-  name = q;
-  val = NULL;
-  /* From now on, be well-formed or you're gone.  */
-  for (;;)
-    if (*q == ':' || *q == '\0')
-      {
-        char c = *q;
-        struct color_cap const *cap;
+static void
+microbench_memcpy (struct microbench *mb)
+{
+  memcpy (mb->scratch, mb->nuls, mb->size);
+}
 
-        *q++ = '\0'; /* Terminate name or val.  */
-        /* Empty name without val (empty cap)
-         * won't match and will be ignored.  */
-        for (cap = color_dict; cap->name; cap++)
-          if (STREQ (cap->name, name))
-            break;
-        /* If name unknown, go on for forward compatibility.  */
-        if (cap->var && val)
-          *(cap->var) = val;
-        if (cap->fct)
-          cap->fct ();
-        if (c == '\0')
-          return;
-        name = q;
-        val = NULL;
-      }
-    else if (*q == '=')
-      {
-        if (q == name || val)
-          return;
-        *q++ = '\0'; /* Terminate name.  */
-        val = q; /* Can be the empty string.  */
-      }
-    else if (val == NULL)
-      q++; /* Accumulate name.  */
-    else if (*q == ';' || (*q >= '0' && *q <= '9'))
-      q++; /* Accumulate val.  Protect the terminal from being sent crap.  */
-    else
-      return;
+static void
+microbench_has_nulls (struct microbench *mb)
+{
+  mb->sink += buf_has_nulls (mb->text, mb->size);
 }
 
-/* Return true if PAT (of length PATLEN) contains an encoding error.  */
-static bool
-contains_encoding_error (char const *pat, size_t patlen)
+static void
+microbench_has_encoding_errors (struct microbench *mb)
 {
-  mbstate_t mbs = { 0 };
-  size_t i, charlen;
+  mb->sink += buf_has_encoding_errors (mb->text, mb->size);
+}
 
-  for (i = 0; i < patlen; i += charlen)
+static void
+microbench_skip_easy_bytes (struct microbench *mb)
+{
+  char const *lim = mb->text + mb->size;
+  mb->text[mb->size] = -1;
+  for (char const *p = mb->text; (p = skip_easy_bytes (p)) < lim; p++)
+    mb->sink++;
+}
+
+static void
+microbench_format_offset (struct microbench *mb)
+{
+  char buf[INT_BUFSIZE_BOUND (uintmax_t) + 1];
+  for (uintmax_t i = 1; i <= mb->lines; i++)
     {
-      charlen = mb_clen (pat + i, patlen - i, &mbs);
-      if ((size_t) -2 <= charlen)
-        return true;
+      char *p = format_offset (buf, i, 4, line_num_color);
+      *p++ = ':';
+      fwrite_errno (buf, 1, p - buf);
     }
-  return false;
 }
 
-/* Change a pattern for fgrep into grep.  */
 static void
-fgrep_to_grep_pattern (size_t len, char const *keys,
-                       size_t *new_len, char **new_keys)
+microbench_prline (struct microbench *mb)
 {
-  char *p = *new_keys = xnmalloc (len + 1, 2);
-  mbstate_t mb_state = { 0 };
-  size_t n;
+  struct grepctx *ctx = mb->ctx;
+  char *lim = mb->text + mb->size;
+  ctx->lastnl = ctx->bufbeg = mb->text;
+  ctx->lastout = NULL;
+  ctx->totalnl = ctx->totalcc = 0;
+  for (char *beg = mb->text; beg < lim; )
+    {
+      char *nl = rawmemchr (beg, eolbyte);
+      prline (ctx, beg, nl + 1, SEP_CHAR_SELECTED);
+      beg = nl + 1;
+    }
+}
 
-  for (; len; keys += n, len -= n)
+/* Time FN on MB and print a row for it under NAME.  */
+static void
+microbench_run (char const *name, void (*fn) (struct microbench *),
+                struct microbench *mb)
+{
+  uintmax_t best = UINTMAX_MAX, best_cycles = 0, total = 0;
+  for (int reps = 0; reps < MICROBENCH_MIN_REPS || total < MICROBENCH_MIN_NS;
+       reps++)
     {
-      n = mb_clen (keys, len, &mb_state);
-      switch (n)
+      uintmax_t start = stats_clock ();
+      uintmax_t cycles = MICROBENCH_CYCLES ();
+      fn (mb);
+      cycles = MICROBENCH_CYCLES () - cycles;
+      uintmax_t ns = stats_clock () - start;
+      total += ns;
+      if (ns < best)
         {
-        case (size_t) -2:
-          n = len;
-          /* Fall through.  */
-        default:
-          p = mempcpy (p, keys, n);
-          break;
-
-        case (size_t) -1:
-          memset (&mb_state, 0, sizeof mb_state);
-          /* Fall through.  */
-        case 1:
-          *p = '\\';
-          p += strchr ("$*.[\\^", *keys) != NULL;
-          /* Fall through.  */
-        case 0:
-          *p++ = *keys;
-          n = 1;
-          break;
+          best = ns;
+          best_cycles = cycles;
         }
     }
+  fflush (capture_stream);
 
-  *new_len = p - *new_keys;
+  printf ("%-24s %10.3f %10.2f", name, (double) best / mb->size,
+          (double) best / mb->lines);
+  if (best_cycles)
+    printf (" %10.3f", (double) best_cycles / mb->size);
+  putchar ('\n');
+}
+
+static size_t
+microbench_arg (char const *arg, size_t default_value)
+{
+  char *end;
+  unsigned long n;
+  if (!arg)
+    return default_value;
+  errno = 0;
+  n = strtoul (arg, &end, 10);
+  if (end == arg || *end || errno || !n)
+    ts_error (EXIT_TROUBLE, 0, "invalid argument: %s", arg);
+  return n;
 }
 
 int
 main (int argc, char **argv)
 {
-  //ProfilerStart("pgrep.log");
+  struct grepctx ctx;
+  struct microbench mb;
+
+  exit_failure = EXIT_TROUBLE;
+  set_program_name (argv[0]);
+  setlocale (LC_ALL, "");
+  if (4 < argc)
+    ts_error (EXIT_TROUBLE, 0,
+              "usage: %s [MEGABYTES [LINE-LENGTH [NUL-EVERY]]]", argv[0]);
+  size_t size = microbench_arg (1 < argc ? argv[1] : NULL, 16) << 20;
+  size_t line_length = microbench_arg (2 < argc ? argv[2] : NULL, 64);
+  size_t nul_every = microbench_arg (3 < argc ? argv[3] : NULL, 4096);
+
+  pagesize = getpagesize ();
+  eolbyte = '\n';
+  build_mbclen_cache ();
+  initialize_unibyte_mask ();
+  if (pthread_mutex_init (&output_lock, NULL) != 0)
+    abort ();
+
+  /* Deterministic text: words of lowercase letters and digits, with
+     a multibyte character now and then if the locale has them.  */
+  memset (&mb, 0, sizeof mb);
+  mb.size = size;
+  mb.text = xmalloc (size + pagesize);
+  mb.nuls = xmalloc (size + pagesize);
+  mb.scratch = xmalloc (size + pagesize);
+  bool utf8 = MB_CUR_MAX > 1 && locale_is_utf8 ();
+  uint32_t seed = 1;
+  size_t col = 0;
+  for (size_t i = 0; i < size; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      unsigned int r = seed >> 16;
+      char c;
+      if (size - i == 1 || (line_length <= col && r % 8 == 0))
+        c = '\n';
+      else if (utf8 && r % 97 == 0 && i + 2 < size)
+        {
+          mb.text[i++] = '\xc3';
+          c = '\xa9';
+        }
+      else
+        c = r % 7 == 0 ? ' ' : "abcdefghijklmnopqrstuvwxyz0123456789"[r % 36];
+      mb.text[i] = c;
+      col = c == '\n' ? 0 : col + 1;
+      mb.lines += c == '\n';
+    }
+  memset (mb.text + size, 0, pagesize);
+  memcpy (mb.nuls, mb.text, size + pagesize);
+  for (size_t i = nul_every - 1; i < size - 1; i += nul_every)
+    mb.nuls[i] = '\0';
+
+  FILE *tmp = tmpfile ();
+  if (!tmp || fwrite (mb.text, 1, size, tmp) != size || fflush (tmp) != 0)
+    ts_error (EXIT_TROUBLE, errno, "tmpfile");
+  mb.fd = fileno (tmp);
+
+  /* Printing goes to the null device through a stdio buffer, as it
+     would to a pipe; it is never seen as standard output, so
+     exit_on_match does not apply.  */
+  capture_stream = fopen ("/dev/null", "w");
+  if (!capture_stream)
+    ts_error (EXIT_TROUBLE, errno, "/dev/null");
+
+  memset (&ctx, 0, sizeof ctx);
+  ctx.bufalloc = ALIGN_TO (INITIAL_BUFSIZE, pagesize) + pagesize + sizeof (uword);
+  ctx.buffer = xmalloc (ctx.bufalloc);
+  ctx.filename = "microbench";
+  ctx.outleft = INTMAX_MAX;
+  ctx.line_head_prefix = -1;
+  mb.ctx = &ctx;
+
+  printf ("%zu bytes, %ju lines, %s\n", mb.size, mb.lines,
+          utf8 ? "UTF-8" : unibyte_mask ? "multibyte" : "unibyte");
+  printf ("%-24s %10s %10s%s\n", "primitive", "ns/byte", "ns/line",
+          MICROBENCH_CYCLES () ? "   cycles/B" : "");
+  microbench_run ("fillbuf (memory)", microbench_fillbuf_mem, &mb);
+  microbench_run ("fillbuf (file)", microbench_fillbuf_file, &mb);
+  microbench_run ("nlscan", microbench_nlscan, &mb);
+  microbench_run ("memcpy", microbench_memcpy, &mb);
+  microbench_run ("memcpy + zap_nuls", microbench_zap_nuls, &mb);
+  microbench_run ("buf_has_nulls", microbench_has_nulls, &mb);
+  if (unibyte_mask)
+    microbench_run ("skip_easy_bytes", microbench_skip_easy_bytes, &mb);
+  microbench_run ("buf_has_encoding_errors", microbench_has_encoding_errors,
+                  &mb);
+  microbench_run ("format_offset", microbench_format_offset, &mb);
+  out_line = true;
+  microbench_run ("prline -n", microbench_prline, &mb);
+  out_file = 1;
+  out_byte = true;
+  ctx.line_head_prefix = -1;
+  microbench_run ("prline -Hnb", microbench_prline, &mb);
+
+  if (mb.sink == 1)
+    putchar ('\n');
+  return EXIT_SUCCESS;
+}
+#endif /* GREP_MICROBENCH */
+
+#if !defined MTGREP_LIBRARY && !defined GREP_MICROBENCH
+int
+main (int argc, char **argv)
+{
+  int status;
+
+  exit_failure = EXIT_TROUBLE;
+  initialize_main (&argc, &argv);
+  set_program_name (argv[0]);
+  program_name = argv[0];
+
+  atexit (clean_up_stdout);
+
+  if (daemon_client (argc, argv, &status))
+    return status;
+  return grep_main (argc, argv);
+}
+#endif
 
+static int
+grep_main (int argc, char **argv)
+{
   char *keys;
   size_t keycc, oldcc, keyalloc;
   bool with_filenames;
@@ -2613,17 +9075,12 @@ main (int argc, char **argv)
   int prev_optind, last_recursive;
   int fread_errno;
   intmax_t default_context;
-  intmax_t num_threads;
   FILE *fp;
   pthread_t *worker_threads;
   pthread_mutexattr_t output_lock_attr;
   void *worker_status;
   struct rlimit rlim;
   struct grepctx tmpctx;
-  exit_failure = EXIT_TROUBLE;
-  initialize_main (&argc, &argv);
-  set_program_name (argv[0]);
-  program_name = argv[0];
 
   pagesize = getpagesize ();
 
@@ -2672,10 +9129,10 @@ main (int argc, char **argv)
 
   dfa_init ();
 
-  atexit (clean_up_stdout);
-
   last_recursive = 0;
 
+  char **given_argv = argv;
+  bool stdin_read = false;
   prepended = prepend_default_options (getenv ("GREP_OPTIONS"), &argc, &argv);
   if (prepended)
     ts_error (0, 0, _("warning: GREP_OPTIONS is deprecated;"
@@ -2683,6 +9140,7 @@ main (int argc, char **argv)
 
   compile = matchers[0].compile;
   execute = matchers[0].execute;
+  iterate = matchers[0].iterate;
 
   while (prev_optind = optind,
          (opt = get_nondigit_option (argc, argv, &default_context)) != -1)
@@ -2802,6 +9260,8 @@ main (int argc, char **argv)
           ts_error (EXIT_TROUBLE, fread_errno, "%s", optarg);
         if (fp != stdin)
           fclose (fp);
+        else
+          stdin_read = true;
         /* Append final newline if file ended in non-newline. */
         if (oldcc != keycc && keys[keycc - 1] != '\n')
           keys[keycc++] = '\n';
@@ -2911,6 +9371,10 @@ main (int argc, char **argv)
           ts_error (EXIT_TROUBLE, 0, _("unknown binary-files type"));
         break;
 
+      case DAEMON_OPTION:
+        daemon_socket = optarg;
+        break;
+
       case COLOR_OPTION:
         if (optarg)
           {
@@ -2932,36 +9396,57 @@ main (int argc, char **argv)
 
       case EXCLUDE_OPTION:
       case INCLUDE_OPTION:
+        walk_hash_option (opt, optarg);
         for (int cmd = 0; cmd < 2; cmd++)
-          {
-            if (!excluded_patterns[cmd])
-              excluded_patterns[cmd] = new_exclude ();
-            add_exclude (excluded_patterns[cmd], optarg,
-                         ((opt == INCLUDE_OPTION ? EXCLUDE_INCLUDE : 0)
-                          | exclude_options (cmd)));
-          }
+          add_name_rule (&excluded_patterns[cmd], optarg,
+                         opt == INCLUDE_OPTION, cmd);
         break;
       case EXCLUDE_FROM_OPTION:
-        for (int cmd = 0; cmd < 2; cmd++)
-          {
-            if (!excluded_patterns[cmd])
-              excluded_patterns[cmd] = new_exclude ();
-            if (add_exclude_file (add_exclude, excluded_patterns[cmd],
-                                  optarg, exclude_options (cmd), '\n')
-                != 0)
-              ts_error (EXIT_TROUBLE, errno, "%s", optarg);
-          }
+        walk_hash_option (opt, optarg);
+        {
+          /* The walk cache must notice when the file changes.  */
+          struct stat st;
+          if (stat (optarg, &st) == 0)
+            {
+              walk_options_hash = hash_bytes (walk_options_hash, &st.st_size,
+                                             sizeof st.st_size);
+              walk_options_hash = hash_bytes (walk_options_hash, &st.st_mtim,
+                                             sizeof st.st_mtim);
+            }
+        }
+        if (add_name_rules_from_file (excluded_patterns, optarg, false) != 0)
+          ts_error (EXIT_TROUBLE, errno, "%s", optarg);
         break;
 
       case EXCLUDE_DIRECTORY_OPTION:
         strip_trailing_slashes (optarg);
+        walk_hash_option (opt, optarg);
         for (int cmd = 0; cmd < 2; cmd++)
-          {
-            if (!excluded_directory_patterns[cmd])
-              excluded_directory_patterns[cmd] = new_exclude ();
-            add_exclude (excluded_directory_patterns[cmd], optarg,
-                         exclude_options (cmd));
-          }
+          add_name_rule (&excluded_directory_patterns[cmd], optarg, false, cmd);
+        break;
+
+      case GITIGNORE_OPTION:
+        vcs_ignore = true;
+        break;
+
+      case MAX_FILESIZE_OPTION:
+        max_filesize = parse_filesize (optarg);
+        file_limits = true;
+        break;
+
+      case MIN_FILESIZE_OPTION:
+        min_filesize = parse_filesize (optarg);
+        file_limits = true;
+        break;
+
+      case NEWER_THAN_OPTION:
+        newer_than = parse_file_time (optarg);
+        file_limits = true;
+        break;
+
+      case OLDER_THAN_OPTION:
+        older_than = parse_file_time (optarg);
+        file_limits = true;
         break;
 
       case GROUP_SEPARATOR_OPTION:
@@ -2976,6 +9461,84 @@ main (int argc, char **argv)
         label = optarg;
         break;
 
+      case BUILD_INDEX_OPTION:
+        index_name = optarg;
+        building_index = true;
+        break;
+
+      case INDEX_OPTION:
+        index_name = optarg;
+        building_index = false;
+        break;
+
+      case NO_CACHE_POLLUTION_OPTION:
+        no_cache_pollution = true;
+        break;
+
+      case QUERY_FILE_OPTION:
+        query_file = optarg;
+        if (STREQ (optarg, "-"))
+          stdin_read = true;
+        break;
+
+      case RESULT_CACHE_OPTION:
+        result_cache_name = optarg;
+        break;
+
+      case LOCK_STATS_OPTION:
+        if (!optarg || STREQ (optarg, "table"))
+          lock_stats_format = LOCK_STATS_TABLE;
+        else if (STREQ (optarg, "json"))
+          lock_stats_format = LOCK_STATS_JSON;
+        else
+          ts_error (EXIT_TROUBLE, 0, _("unknown lock-stats format"));
+        break;
+
+      case PROFILE_OPTION:
+        profile_name = optarg;
+        break;
+
+      case PROFILE_FREQUENCY_OPTION:
+        if (xstrtoimax (optarg, 0, 10, &profile_frequency, "") != LONGINT_OK
+            || profile_frequency <= 0)
+          ts_error (EXIT_TROUBLE, 0, _("invalid profile frequency"));
+        break;
+
+      case REVERSE_OPTION:
+        reverse = true;
+        break;
+
+      case STATS_OPTION:
+        show_stats = true;
+        break;
+
+      case TAR_OPTION:
+        search_archives = true;
+        break;
+
+      case TIME_RANGE_OPTION:
+        {
+          char *comma = strchr (optarg, ',');
+          if (!comma || TIME_STAMP_MAX < comma - optarg
+              || TIME_STAMP_MAX < strlen (comma + 1))
+            ts_error (EXIT_TROUBLE, 0, _("invalid time range: %s"),
+                      quote (optarg));
+          time_range = true;
+          time_range_start = optarg;
+          time_range_start_len = comma - optarg;
+          time_range_end = comma + 1;
+          time_range_end_len = strlen (comma + 1);
+        }
+        break;
+
+      case TRACE_OPTION:
+        trace_name = optarg;
+        break;
+
+      case WALK_CACHE_OPTION:
+        walk_cache_name = optarg;
+        break;
+
       case 0:
         /* long options */
         break;
@@ -2996,6 +9559,13 @@ main (int argc, char **argv)
   if (show_help)
     usage (EXIT_SUCCESS);
 
+  if (daemon_socket)
+    {
+      if (argc != 2 || prepended)
+        ts_error (EXIT_TROUBLE, 0, _("--daemon takes no other arguments"));
+      return serve_daemon (daemon_socket);
+    }
+
   bool possibly_tty = false;
   struct stat tmp_stat;
   if (! exit_on_match && fstat (STDOUT_FILENO, &tmp_stat) == 0)
@@ -3043,6 +9613,43 @@ main (int argc, char **argv)
     out_after = default_context;
   if (out_before < 0)
     out_before = default_context;
+  if (reverse && (0 < out_before || 0 < out_after))
+    ts_error (EXIT_TROUBLE, 0, _("--reverse cannot be used with context"));
+  if (query_file && (out_invert || reverse || 0 < out_before || 0 < out_after
+                     || compile == Pcompile_literal))
+    ts_error (EXIT_TROUBLE, 0,
+              _("--query-file cannot be used with -v, -P, --reverse"
+                " or context"));
+
+  if (building_index)
+    {
+      if (directories == READ_DIRECTORIES)
+        directories = RECURSE_DIRECTORIES;
+      if (fts_options & FTS_LOGICAL && devices == READ_COMMAND_LINE_DEVICES)
+        devices = READ_DEVICES;
+      load_index ();
+      if (walk_cache_name)
+        start_walk_cache ();
+      if (optind == argc)
+        {
+          omit_dot_slash = true;
+          search_command_line_arg (".");
+        }
+      while (optind < argc)
+        search_command_line_arg (argv[optind++]);
+      write_index (true);
+      if (walk_cache_name)
+        write_walk_cache ();
+      return errseen ? EXIT_TROUBLE : EXIT_SUCCESS;
+    }
+
+  if (query_file)
+    {
+      if (keys)
+        ts_error (EXIT_TROUBLE, 0,
+                  _("--query-file cannot be used with -e or -f"));
+      read_query_file (query_file, &keys, &keycc);
+    }
 
   if (keys)
     {
@@ -3065,15 +9672,20 @@ main (int argc, char **argv)
   else
     usage (EXIT_TROUBLE);
 
-  build_mbclen_cache ();
-  initialize_unibyte_mask ();
+  /* A request that the daemon serves in its own locale inherits
+     these from it.  */
+  if (! (daemon_locale && STREQ (setlocale (LC_ALL, NULL), daemon_locale)))
+    {
+      build_mbclen_cache ();
+      initialize_unibyte_mask ();
+    }
 
   /* In a unibyte locale, switch from fgrep to grep if
      the pattern matches words (where grep is typically faster).
      In a multibyte locale, switch from fgrep to grep if either
      (1) case is ignored (where grep is typically faster), or
      (2) the pattern has an encoding error (where fgrep might not work).  */
-  if (compile == Fcompile
+  if (compile == Fcompile_literal
       && (MB_CUR_MAX <= 1
           ? match_words
           : match_icase || contains_encoding_error (keys, keycc)))
@@ -3084,15 +9696,31 @@ main (int argc, char **argv)
       free (keys);
       keys = new_keys;
       keycc = new_keycc;
+      for (size_t q = 0; q < nqueries; q++)
+        {
+          fgrep_to_grep_pattern (queries[q].size, queries[q].pattern,
+                                 &new_keycc, &new_keys);
+          free (queries[q].pattern);
+          queries[q].pattern = new_keys;
+          queries[q].size = new_keycc;
+        }
       matcher = "grep";
       compile = Gcompile;
-      execute = EGexecute;
+      execute = matchers[0].execute;
+      iterate = matchers[0].iterate;
     }
 
+  if (index_name)
+    index_prepare (keys, keycc);
+  if (result_cache_name)
+    result_cache_prepare (keys, keycc);
+
   /* Mild hack -- temporary little on-stack grepctx */
   memset (&tmpctx, 0, sizeof (tmpctx));
 
-  tmpctx.compiled_pattern = compile (keys, keycc);
+  tmpctx.compiled_pattern = compile_pattern (keys, keycc);
+  if (0 <= daemon_report_fd)
+    report_pattern (keys, keycc, num_threads);
   /* We need one byte prior and one after.  */
   char eolbytes[3] = { 0, eolbyte, 0 };
   size_t match_size;
@@ -3100,11 +9728,15 @@ main (int argc, char **argv)
                                 1, &match_size, NULL) == 0)
                       == out_invert);
 
-  if (((argc - optind > 1 || directories == RECURSE_DIRECTORIES)
+  if (((argc - optind > 1 || directories == RECURSE_DIRECTORIES
+        || search_archives)
        && !no_filenames)
       || with_filenames)
     out_file = 1;
 
+  bulk_invert = (out_invert && !out_file && !out_line && !out_byte
+                 && !only_matching && !color_option);
+
 #ifdef SET_BINARY
   /* Output is set to binary mode because we shouldn't convert
      NL to CR-LF pairs, especially when grepping binary files.  */
@@ -3124,11 +9756,32 @@ main (int argc, char **argv)
     abort ();
   max_queued_files = rlim.rlim_cur / 2;
 
+  if (profile_name)
+    start_profiler (given_argv, stdin_read);
+  if (show_stats)
+    {
+      all_stats = xcalloc (num_threads + 1, sizeof *all_stats);
+      thread_stats = &all_stats[0];
+      thread_stats->start = stats_clock ();
+    }
+  if (trace_name)
+    {
+      all_traces = xcalloc (num_threads + 1, sizeof *all_traces);
+      for (i = 0; i <= num_threads; i++)
+        all_traces[i].spans = xnmalloc (TRACE_RING_SIZE,
+                                        sizeof *all_traces[i].spans);
+      thread_trace = &all_traces[0];
+      trace_epoch = stats_clock ();
+    }
+
+  if (nqueries)
+    compile_queries (num_threads);
+
   worker_threads = xmalloc (num_threads * sizeof (*worker_threads));
   for (i = 0; i < num_threads; i++)
     {
       if (pthread_create (&worker_threads[i], NULL, worker_thread_func,
-                          compile (keys, keycc)))
+                          compile_pattern (keys, keycc)))
         abort ();
     }
 
@@ -3151,9 +9804,23 @@ main (int argc, char **argv)
       files = stdin_only;
     }
 
+  /* Time spent blocked on a full queue is not walking.  */
+  uintmax_t walk_start = stats_start ();
+  uintmax_t walk_queue = thread_stats ? thread_stats->ns[STAT_QUEUE] : 0;
+  if (walk_cache_name)
+    start_walk_cache ();
   do
-    search_command_line_arg (*files++);
+    {
+      uintmax_t start = thread_trace ? stats_clock () : 0;
+      search_command_line_arg (*files);
+      if (thread_trace)
+        trace_span ("walk", start, stats_clock (), *files);
+      files++;
+    }
   while (*files != NULL);
+  if (thread_stats)
+    stats_end (STAT_WALK, walk_start + (thread_stats->ns[STAT_QUEUE]
+                                        - walk_queue));
 
   finish_workqueue ();
 
@@ -3164,8 +9831,25 @@ main (int argc, char **argv)
         abort ();
       status = status && !!worker_status;
     }
-  
-  //ProfilerStop();
+
+  if (index_name)
+    refresh_index ();
+  if (walk_cache_name)
+    write_walk_cache ();
+  if (all_stats)
+    {
+      all_stats[0].end = stats_clock ();
+      print_stats ();
+    }
+  if (lock_stats_format)
+    print_lock_stats ();
+  if (all_traces)
+    write_trace ();
+
+#if WITH_GPERFTOOLS
+  if (profile_name)
+    ProfilerStop ();
+#endif
   /* We register via atexit() to test stdout.  */
   return errseen ? EXIT_TROUBLE : status;
 }
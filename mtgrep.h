@@ -0,0 +1,94 @@
+/* mtgrep.h - interface to the grep search library.
+   Copyright (C) 2016 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street - Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+/* Compiling grep.c with MTGREP_LIBRARY defined leaves out main, so
+   that the result can be linked into another program as libmtgrep.
+
+   A search handle holds a compiled pattern and a pool of worker
+   threads.  Searching with it calls back for each match instead of
+   printing anything.  Handles are independent of one another and of
+   the grep command-line options, and several handles may search at
+   once.  However, the matcher in use and the settings for -i, -w, -x,
+   -z, -v and binary files are shared between threads, so a search
+   waits for any other search that differs in these to finish first.  */
+
+#ifndef MTGREP_H
+#define MTGREP_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* How to search.  Zero-initialize, then set the fields wanted.  */
+struct mtgrep_options
+{
+  char const *matcher;		/* "grep" (the default if null), "egrep",
+                                   "fgrep", "awk", "gawk", "posixawk"
+                                   or "perl".  */
+  bool ignore_case;		/* Like -i.  */
+  bool match_words;		/* Like -w.  */
+  bool match_lines;		/* Like -x.  */
+  bool invert;			/* Like -v.  */
+  bool null_data;		/* Like -z.  */
+  bool recursive;		/* Like -r; otherwise skip directories.  */
+  bool skip_binary;		/* Like --binary-files=without-match.  */
+  intmax_t max_count;		/* Like -m, if positive.  */
+  int threads;			/* Number of worker threads, if positive;
+                                   otherwise 1.  */
+};
+
+/* A match.  TEXT and LEN give the whole line, without its terminator.
+   START and SIZE give the part of the line that matched; with
+   'invert', they give the whole line.  The pointers are valid only
+   during the callback.  */
+struct mtgrep_match
+{
+  char const *file;
+  uintmax_t line;		/* Line number, counting from 1.  */
+  uintmax_t offset;		/* Byte offset of the line in the file.  */
+  char const *text;
+  size_t len;
+  size_t start;
+  size_t size;
+};
+
+/* Called for each match, from the worker threads.  Matches within a
+   file are reported in order by one thread, but different files may
+   be reported concurrently.  Return nonzero to stop the search.  */
+typedef int (*mtgrep_callback) (struct mtgrep_match const *match, void *arg);
+
+struct mtgrep;
+
+/* Compile PATTERN (of length SIZE; newlines separate alternatives) as
+   OPTIONS say, and start the worker threads.  Return NULL and set
+   errno on failure; errno is EINVAL if the pattern is invalid.  Nothing
+   is printed.  */
+extern struct mtgrep *mtgrep_new (char const *pattern, size_t size,
+                                  struct mtgrep_options const *options);
+
+/* Search FILES, a null-terminated list of file names, calling
+   CALLBACK with ARG for each match.  Return 0 if something matched,
+   1 if not, and 2 if a file could not be read, as grep's exit status
+   does.  Searches with the same handle are done one at a time.  */
+extern int mtgrep_search (struct mtgrep *handle, char const *const *files,
+                          mtgrep_callback callback, void *arg);
+
+/* Stop the worker threads of HANDLE and free it.  */
+extern void mtgrep_free (struct mtgrep *handle);
+
+#endif /* MTGREP_H */